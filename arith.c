@@ -0,0 +1,530 @@
+#include "cscshell.h"
+
+/*
+** $((...)) expressions are parsed into a small AST stored in one array,
+** then evaluated with 64-bit integers. Parsed expressions are kept in a
+** cache keyed by their text, so a line that is run again (or a loop
+** body) does not parse the same expression twice.
+*/
+
+#define ARITH_CACHE_BUCKETS 64
+
+typedef enum ArithKind {
+    A_NUM,
+    A_VAR,
+    A_UNARY,
+    A_BINARY,
+    A_AND,
+    A_OR,
+    A_COND,
+    A_ASSIGN,
+} ArithKind;
+
+typedef enum ArithOp {
+    A_NONE, A_ADD, A_SUB, A_MUL, A_DIV, A_MOD, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE, A_BAND, A_BXOR, A_BOR,
+    A_LAND, A_LOR, A_NEG, A_POS, A_NOT, A_BNOT,
+} ArithOp;
+
+typedef struct ArithNode {
+    uint8_t kind;
+    uint8_t op;     // for A_ASSIGN, the operator of "op=", or A_NONE
+    int32_t a, b, c;
+    int64_t num;
+    char *name;
+} ArithNode;
+
+struct ArithExpr {
+    char *text;
+    ArithNode *nodes;
+    int32_t num_nodes, cap_nodes;
+    int32_t root;
+    struct ArithExpr *next;  // cache chain
+};
+
+typedef struct ArithParser {
+    ArithExpr *expr;
+    const char *pos;
+    bool failed;
+    bool out_of_memory;
+} ArithParser;
+
+// operators of binary expressions, longest first, with their precedence
+static const struct {
+    const char *str;
+    ArithOp op;
+    int prec;
+} binary_ops[] = {
+    {"||", A_LOR, 1}, {"&&", A_LAND, 2}, {"==", A_EQ, 6}, {"!=", A_NE, 6},
+    {"<=", A_LE, 7}, {">=", A_GE, 7}, {"<<", A_SHL, 8}, {">>", A_SHR, 8},
+    {"|", A_BOR, 3}, {"^", A_BXOR, 4}, {"&", A_BAND, 5}, {"<", A_LT, 7},
+    {">", A_GT, 7}, {"+", A_ADD, 9}, {"-", A_SUB, 9}, {"*", A_MUL, 10},
+    {"/", A_DIV, 10}, {"%", A_MOD, 10},
+};
+
+static const struct {
+    const char *str;
+    ArithOp op;
+} assign_ops[] = {
+    {"<<=", A_SHL}, {">>=", A_SHR}, {"+=", A_ADD}, {"-=", A_SUB},
+    {"*=", A_MUL}, {"/=", A_DIV}, {"%=", A_MOD}, {"&=", A_BAND},
+    {"^=", A_BXOR}, {"|=", A_BOR}, {"=", A_NONE},
+};
+
+static ArithExpr *arith_cache[ARITH_CACHE_BUCKETS];
+static int arith_cache_size = 0;
+
+
+static void skip_space(ArithParser *p){
+    while (isspace((unsigned char) *p->pos)) p->pos++;
+}
+
+
+static bool is_name_char(char c, bool first){
+    return isalpha((unsigned char) c) || c == '_' ||
+        (!first && isdigit((unsigned char) c));
+}
+
+
+static int32_t new_node(ArithParser *p, ArithKind kind, ArithOp op){
+    ArithExpr *expr = p->expr;
+    if (expr->num_nodes == expr->cap_nodes){
+        int32_t capacity = (expr->cap_nodes == 0) ? 8 : expr->cap_nodes * 2;
+        ArithNode *grown = realloc(expr->nodes, capacity * sizeof(ArithNode));
+        if (grown == NULL){
+            perror("arith");
+            p->failed = p->out_of_memory = true;
+            return -1;
+        }
+        expr->nodes = grown;
+        expr->cap_nodes = capacity;
+    }
+    ArithNode *node = &expr->nodes[expr->num_nodes];
+    memset(node, 0, sizeof(ArithNode));
+    node->kind = kind;
+    node->op = op;
+    node->a = node->b = node->c = -1;
+    return expr->num_nodes++;
+}
+
+
+static int32_t syntax_error(ArithParser *p){
+    if (!p->failed){
+        ERR_PRINT(ERR_ARITH_SYNTAX, p->expr->text);
+    }
+    p->failed = true;
+    return -1;
+}
+
+
+static int32_t parse_assign(ArithParser *p);
+
+
+static int32_t parse_unary(ArithParser *p){
+    skip_space(p);
+    char c = *p->pos;
+
+    if (c == '+' || c == '-' || c == '!' || c == '~'){
+        p->pos++;
+        int32_t operand = parse_unary(p);
+        if (operand < 0) return -1;
+        ArithOp op = (c == '+') ? A_POS : (c == '-') ? A_NEG
+                   : (c == '!') ? A_NOT : A_BNOT;
+        int32_t node = new_node(p, A_UNARY, op);
+        if (node < 0) return -1;
+        p->expr->nodes[node].a = operand;
+        return node;
+    }
+
+    if (c == '('){
+        p->pos++;
+        int32_t inner = parse_assign(p);
+        skip_space(p);
+        if (inner < 0 || *p->pos != ')'){
+            return syntax_error(p);
+        }
+        p->pos++;
+        return inner;
+    }
+
+    if (isdigit((unsigned char) c)){
+        char *end;
+        errno = 0;
+        long long value = strtoll(p->pos, &end, 0);
+        if (errno != 0 || is_name_char(*end, false)){
+            return syntax_error(p);
+        }
+        p->pos = end;
+        int32_t node = new_node(p, A_NUM, A_NONE);
+        if (node < 0) return -1;
+        p->expr->nodes[node].num = value;
+        return node;
+    }
+
+    // $NAME reads the same variable as NAME; $1..$N only have this form
+    bool dollar = (c == VARIABLE_PARSE_MARKER);
+    if (dollar){
+        c = *++p->pos;
+    }
+    if (is_name_char(c, true) || (dollar && isdigit((unsigned char) c))){
+        const char *start = p->pos;
+        while (is_name_char(*p->pos, false)) p->pos++;
+        int32_t node = new_node(p, A_VAR, A_NONE);
+        if (node < 0) return -1;
+        p->expr->nodes[node].name = strndup(start, p->pos - start);
+        if (p->expr->nodes[node].name == NULL){
+            perror("arith");
+            p->failed = p->out_of_memory = true;
+            return -1;
+        }
+        return node;
+    }
+
+    return syntax_error(p);
+}
+
+
+// Returns the binary operator at the cursor, if any
+static int match_binary(ArithParser *p){
+    for (size_t i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++){
+        size_t len = strlen(binary_ops[i].str);
+        if (strncmp(p->pos, binary_ops[i].str, len) != 0){
+            continue;
+        }
+        // "+=" and friends are assignments, not binary operators
+        if (p->pos[len] == '=' && binary_ops[i].prec != 6 &&
+            binary_ops[i].prec != 7){
+            return -1;
+        }
+        return (int) i;
+    }
+    return -1;
+}
+
+
+// Precedence climbing over binary_ops
+static int32_t parse_binary(ArithParser *p, int min_prec){
+    int32_t left = parse_unary(p);
+    while (left >= 0){
+        skip_space(p);
+        int i = match_binary(p);
+        if (i < 0 || binary_ops[i].prec < min_prec){
+            break;
+        }
+        p->pos += strlen(binary_ops[i].str);
+        int32_t right = parse_binary(p, binary_ops[i].prec + 1);
+        if (right < 0) return -1;
+
+        ArithOp op = binary_ops[i].op;
+        ArithKind kind = (op == A_LAND) ? A_AND
+                       : (op == A_LOR) ? A_OR : A_BINARY;
+        int32_t node = new_node(p, kind, op);
+        if (node < 0) return -1;
+        p->expr->nodes[node].a = left;
+        p->expr->nodes[node].b = right;
+        left = node;
+    }
+    return left;
+}
+
+
+static int32_t parse_cond(ArithParser *p){
+    int32_t cond = parse_binary(p, 1);
+    skip_space(p);
+    if (cond < 0 || *p->pos != '?'){
+        return cond;
+    }
+    p->pos++;
+    int32_t if_true = parse_assign(p);
+    skip_space(p);
+    if (if_true < 0 || *p->pos != ':'){
+        return syntax_error(p);
+    }
+    p->pos++;
+    int32_t if_false = parse_cond(p);
+    if (if_false < 0) return -1;
+
+    int32_t node = new_node(p, A_COND, A_NONE);
+    if (node < 0) return -1;
+    p->expr->nodes[node].a = cond;
+    p->expr->nodes[node].b = if_true;
+    p->expr->nodes[node].c = if_false;
+    return node;
+}
+
+
+// NAME op= expr is right associative and binds loosest
+static int32_t parse_assign(ArithParser *p){
+    skip_space(p);
+    const char *start = p->pos;
+    if (is_name_char(*p->pos, true)){
+        const char *name_end = p->pos;
+        while (is_name_char(*name_end, false)) name_end++;
+        const char *op_pos = name_end;
+        while (isspace((unsigned char) *op_pos)) op_pos++;
+
+        for (size_t i = 0; i < sizeof(assign_ops) / sizeof(assign_ops[0]); i++){
+            size_t len = strlen(assign_ops[i].str);
+            if (strncmp(op_pos, assign_ops[i].str, len) != 0 ||
+                (assign_ops[i].op == A_NONE && op_pos[1] == '=')){
+                continue;
+            }
+            p->pos = op_pos + len;
+            int32_t value = parse_assign(p);
+            if (value < 0) return -1;
+            int32_t node = new_node(p, A_ASSIGN, assign_ops[i].op);
+            if (node < 0) return -1;
+            p->expr->nodes[node].a = value;
+            p->expr->nodes[node].name = strndup(start, name_end - start);
+            if (p->expr->nodes[node].name == NULL){
+                perror("arith");
+                p->failed = p->out_of_memory = true;
+                return -1;
+            }
+            return node;
+        }
+    }
+    p->pos = start;
+    return parse_cond(p);
+}
+
+
+void arith_free(ArithExpr *expr){
+    if (expr == NULL){
+        return;
+    }
+    for (int32_t i = 0; i < expr->num_nodes; i++){
+        free(expr->nodes[i].name);
+    }
+    free(expr->nodes);
+    free(expr->text);
+    free(expr);
+}
+
+
+ArithExpr *arith_compile(const char *text, size_t len){
+    ArithExpr *expr = calloc(1, sizeof(ArithExpr));
+    if (expr == NULL || (expr->text = strndup(text, len)) == NULL){
+        perror("arith_compile");
+        free(expr);
+        return (ArithExpr *) -1;
+    }
+
+    ArithParser parser = {expr, expr->text, false, false};
+    expr->root = parse_assign(&parser);
+    skip_space(&parser);
+    if (!parser.failed && *parser.pos != '\0'){
+        syntax_error(&parser);
+    }
+    if (parser.failed){
+        arith_free(expr);
+        return parser.out_of_memory ? (ArithExpr *) -1 : NULL;
+    }
+    return expr;
+}
+
+
+ArithExpr *arith_lookup(const char *text, size_t len){
+    uint64_t hash = fnv_bytes(FNV_OFFSET, text, len);
+    ArithExpr **bucket = &arith_cache[hash % ARITH_CACHE_BUCKETS];
+
+    for (ArithExpr *expr = *bucket; expr != NULL; expr = expr->next){
+        if (strlen(expr->text) == len && strncmp(expr->text, text, len) == 0){
+            return expr;
+        }
+    }
+
+    // a full cache is simply emptied; lines rarely hold many expressions
+    if (arith_cache_size >= ARITH_CACHE_SIZE){
+        for (int i = 0; i < ARITH_CACHE_BUCKETS; i++){
+            while (arith_cache[i] != NULL){
+                ArithExpr *next = arith_cache[i]->next;
+                arith_free(arith_cache[i]);
+                arith_cache[i] = next;
+            }
+        }
+        arith_cache_size = 0;
+    }
+
+    ArithExpr *expr = arith_compile(text, len);
+    if (expr == NULL || expr == (ArithExpr *) -1){
+        return expr;
+    }
+    expr->next = *bucket;
+    *bucket = expr;
+    arith_cache_size++;
+    return expr;
+}
+
+
+static Variable *find_variable(Variable *variables, const char *name){
+    for (Variable *var = variables; var != NULL; var = var->next){
+        if (strcmp(var->name, name) == 0){
+            return var;
+        }
+    }
+    return NULL;
+}
+
+
+// Unset and empty variables count as 0
+static int read_variable(Variable *variables, const char *name,
+                         int64_t *value){
+    Variable *var = find_variable(variables, name);
+    if (var == NULL){
+        *value = 0;
+        return 0;
+    }
+    const char *str = var->value;
+    while (isspace((unsigned char) *str)) str++;
+    if (*str == '\0'){
+        *value = 0;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoll(str, &end, 0);
+    while (isspace((unsigned char) *end)) end++;
+    if (errno != 0 || *end != '\0'){
+        ERR_PRINT(ERR_ARITH_VALUE, name, var->value);
+        return 1;
+    }
+    return 0;
+}
+
+
+// New variables are added at the tail so the head of the list stays put;
+// the first one into an empty list becomes its head
+static int write_variable(Variable **variables, const char *name,
+                          int64_t value){
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long) value);
+
+    Variable **where = variables;
+    if (find_variable(*variables, name) == NULL){
+        while (*where != NULL) where = &(*where)->next;
+    }
+    return (set_variable(where, name, buf) == NULL) ? -1 : 0;
+}
+
+
+static int64_t apply_binary(ArithOp op, int64_t a, int64_t b){
+    uint64_t ua = (uint64_t) a, ub = (uint64_t) b;
+    switch (op){
+    case A_ADD: return (int64_t) (ua + ub);
+    case A_SUB: return (int64_t) (ua - ub);
+    case A_MUL: return (int64_t) (ua * ub);
+    case A_DIV: return (b == -1) ? (int64_t) (0 - ua) : a / b;
+    case A_MOD: return (b == -1) ? 0 : a % b;
+    case A_SHL: return (int64_t) (ua << (b & 63));
+    case A_SHR: return a >> (b & 63);
+    case A_LT: return a < b;
+    case A_LE: return a <= b;
+    case A_GT: return a > b;
+    case A_GE: return a >= b;
+    case A_EQ: return a == b;
+    case A_NE: return a != b;
+    case A_BAND: return a & b;
+    case A_BXOR: return a ^ b;
+    case A_BOR: return a | b;
+    default: return b;
+    }
+}
+
+
+static int eval_node(ArithExpr *expr, int32_t index, Variable **variables,
+                     int64_t *result){
+    ArithNode *node = &expr->nodes[index];
+    int64_t a, b;
+    int error;
+
+    switch (node->kind){
+    case A_NUM:
+        *result = node->num;
+        return 0;
+
+    case A_VAR:
+        return read_variable(*variables, node->name, result);
+
+    case A_UNARY:
+        if ((error = eval_node(expr, node->a, variables, &a)) != 0){
+            return error;
+        }
+        *result = (node->op == A_NEG) ? (int64_t) (0 - (uint64_t) a)
+                : (node->op == A_NOT) ? !a
+                : (node->op == A_BNOT) ? ~a : a;
+        return 0;
+
+    case A_AND:
+    case A_OR:
+        if ((error = eval_node(expr, node->a, variables, &a)) != 0){
+            return error;
+        }
+        // short circuit, so side effects on the right may not happen
+        if ((node->kind == A_AND) ? !a : a){
+            *result = (node->kind == A_OR);
+            return 0;
+        }
+        if ((error = eval_node(expr, node->b, variables, &b)) != 0){
+            return error;
+        }
+        *result = (b != 0);
+        return 0;
+
+    case A_COND:
+        if ((error = eval_node(expr, node->a, variables, &a)) != 0){
+            return error;
+        }
+        return eval_node(expr, a ? node->b : node->c, variables, result);
+
+    case A_BINARY:
+    case A_ASSIGN:
+        if (node->kind == A_ASSIGN){
+            a = 0;
+            if (node->op != A_NONE &&
+                (error = read_variable(*variables, node->name, &a)) != 0){
+                return error;
+            }
+            if ((error = eval_node(expr, node->a, variables, &b)) != 0){
+                return error;
+            }
+        }
+        else if ((error = eval_node(expr, node->a, variables, &a)) != 0 ||
+                 (error = eval_node(expr, node->b, variables, &b)) != 0){
+            return error;
+        }
+
+        if ((node->op == A_DIV || node->op == A_MOD) && b == 0){
+            ERR_PRINT(ERR_ARITH_ZERO, expr->text);
+            return 1;
+        }
+        *result = apply_binary(node->op, a, b);
+        if (node->kind == A_ASSIGN){
+            return write_variable(variables, node->name, *result);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+
+int arith_eval(ArithExpr *expr, Variable **variables, int64_t *result){
+    return eval_node(expr, expr->root, variables, result);
+}
+
+
+const char *arith_find_end(const char *expr_start){
+    int depth = 0;
+    for (const char *pos = expr_start; *pos != '\0'; pos++){
+        if (*pos == '('){
+            depth++;
+        }
+        else if (*pos == ')'){
+            if (depth == 0){
+                return (pos[1] == ')') ? pos : NULL;
+            }
+            depth--;
+        }
+    }
+    return NULL;
+}
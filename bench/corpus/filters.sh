@@ -0,0 +1,16 @@
+seq 1 20 > numbers
+tail -n +8 numbers
+tail -n+15 numbers
+tail +18 numbers
+head -n -17 numbers
+head -n 3 numbers
+tail -3 numbers
+mkdir bin
+cp /bin/echo bin/head
+cp /bin/echo bin/cat
+./bin/head -n 3 numbers
+seq 1 5 | ./bin/cat numbers
+/bin/head -n 2 numbers
+/usr/bin/tail -n 2 numbers
+cat numbers . missing numbers
+echo $?
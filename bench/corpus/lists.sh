@@ -0,0 +1,49 @@
+/bin/true && echo and-top
+/bin/false && echo not-printed
+/bin/false || echo or-top
+/bin/true || echo not-printed; echo after-semi
+echo "a;b" | tr -d \"
+echo 'x && y' | tr -d \'
+X=old
+/bin/true; X=new
+echo X is $X
+Y=1
+/bin/false || Y=2
+echo Y is $Y
+for i in 1 2; do /bin/true && echo and-$i; done
+for i in 1 2; do /bin/true || echo not-printed-$i; done
+for i in 1 2; do /bin/false || echo or-$i; done
+for i in a b; do echo x | tr x y && echo piped-$i; done
+for i in 1 2 3; do [ $i -gt 1 ] && [ $i -lt 3 ] && echo middle-$i; done
+N=0
+while [ $N -lt 3 ] && /bin/true; do N=$((N + 1)); done
+echo N is $N
+if /bin/false || [ $N -eq 3 ]; then echo if-or; else echo if-else; fi
+if /bin/true && /bin/false; then echo not-printed; else echo if-and-else; fi
+check() { [ $1 -gt 2 ] || return 1; echo big-$1; }
+check 5
+check 1 || echo small-1
+for i in 1 2; do echo "in;quotes" | tr -d \"; done
+/bin/false && echo skipped || echo chained
+for i in 1 2
+do
+false
+echo $?
+true && echo $?
+false || echo $?
+X=1
+echo $?
+done
+f() {
+false
+echo in f $?
+return 3
+}
+f
+echo $?
+if false
+then
+echo no
+else
+echo else $?
+fi
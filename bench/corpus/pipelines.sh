@@ -0,0 +1,16 @@
+seq 1 5000 | grep 7 | wc -l
+seq 1 2000 | sort -r | head -n 5
+seq 1 300 | tr 0123456789 abcdefghij | sort | tail -n 3
+seq 1 100 | cat | cat | cat | wc -c
+seq 1 64 | paste -s -d + -
+seq 1 1000 | grep -v 1 | grep -v 2 | grep -v 3 | wc -l
+seq 1 400 | sort -n | uniq | tail -n 1
+seq 2 400 | sort -n | uniq | tail -n 1
+seq 3 400 | sort -n | uniq | tail -n 1
+seq 4 400 | sort -n | uniq | tail -n 1
+seq 5 400 | sort -n | uniq | tail -n 1
+seq 6 400 | sort -n | uniq | tail -n 1
+seq 7 400 | sort -n | uniq | tail -n 1
+seq 8 400 | sort -n | uniq | tail -n 1
+seq 9 400 | sort -n | uniq | tail -n 1
+seq 10 400 | sort -n | uniq | tail -n 1
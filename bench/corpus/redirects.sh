@@ -0,0 +1,11 @@
+echo first > out.txt
+echo second >> out.txt
+seq 1 50 > numbers.txt
+wc -l < numbers.txt
+sort -r < numbers.txt > reversed.txt
+head -n 3 < reversed.txt >> out.txt
+cat out.txt
+for N in 1 2 3 4 5 6 7 8 9 10; do echo line $N >> loop.txt; done
+wc -l < loop.txt
+cat numbers.txt | grep 5 > fives.txt
+cat fives.txt
@@ -0,0 +1,121 @@
+echo straight line 1 of the corpus
+echo straight line 2 of the corpus
+echo straight line 3 of the corpus
+echo straight line 4 of the corpus
+echo straight line 5 of the corpus
+echo straight line 6 of the corpus
+echo straight line 7 of the corpus
+echo straight line 8 of the corpus
+echo straight line 9 of the corpus
+echo straight line 10 of the corpus
+echo straight line 11 of the corpus
+echo straight line 12 of the corpus
+echo straight line 13 of the corpus
+echo straight line 14 of the corpus
+echo straight line 15 of the corpus
+echo straight line 16 of the corpus
+echo straight line 17 of the corpus
+echo straight line 18 of the corpus
+echo straight line 19 of the corpus
+echo straight line 20 of the corpus
+echo straight line 21 of the corpus
+echo straight line 22 of the corpus
+echo straight line 23 of the corpus
+echo straight line 24 of the corpus
+echo straight line 25 of the corpus
+echo straight line 26 of the corpus
+echo straight line 27 of the corpus
+echo straight line 28 of the corpus
+echo straight line 29 of the corpus
+echo straight line 30 of the corpus
+echo straight line 31 of the corpus
+echo straight line 32 of the corpus
+echo straight line 33 of the corpus
+echo straight line 34 of the corpus
+echo straight line 35 of the corpus
+echo straight line 36 of the corpus
+echo straight line 37 of the corpus
+echo straight line 38 of the corpus
+echo straight line 39 of the corpus
+echo straight line 40 of the corpus
+echo straight line 41 of the corpus
+echo straight line 42 of the corpus
+echo straight line 43 of the corpus
+echo straight line 44 of the corpus
+echo straight line 45 of the corpus
+echo straight line 46 of the corpus
+echo straight line 47 of the corpus
+echo straight line 48 of the corpus
+echo straight line 49 of the corpus
+echo straight line 50 of the corpus
+echo straight line 51 of the corpus
+echo straight line 52 of the corpus
+echo straight line 53 of the corpus
+echo straight line 54 of the corpus
+echo straight line 55 of the corpus
+echo straight line 56 of the corpus
+echo straight line 57 of the corpus
+echo straight line 58 of the corpus
+echo straight line 59 of the corpus
+echo straight line 60 of the corpus
+echo straight line 61 of the corpus
+echo straight line 62 of the corpus
+echo straight line 63 of the corpus
+echo straight line 64 of the corpus
+echo straight line 65 of the corpus
+echo straight line 66 of the corpus
+echo straight line 67 of the corpus
+echo straight line 68 of the corpus
+echo straight line 69 of the corpus
+echo straight line 70 of the corpus
+echo straight line 71 of the corpus
+echo straight line 72 of the corpus
+echo straight line 73 of the corpus
+echo straight line 74 of the corpus
+echo straight line 75 of the corpus
+echo straight line 76 of the corpus
+echo straight line 77 of the corpus
+echo straight line 78 of the corpus
+echo straight line 79 of the corpus
+echo straight line 80 of the corpus
+echo straight line 81 of the corpus
+echo straight line 82 of the corpus
+echo straight line 83 of the corpus
+echo straight line 84 of the corpus
+echo straight line 85 of the corpus
+echo straight line 86 of the corpus
+echo straight line 87 of the corpus
+echo straight line 88 of the corpus
+echo straight line 89 of the corpus
+echo straight line 90 of the corpus
+echo straight line 91 of the corpus
+echo straight line 92 of the corpus
+echo straight line 93 of the corpus
+echo straight line 94 of the corpus
+echo straight line 95 of the corpus
+echo straight line 96 of the corpus
+echo straight line 97 of the corpus
+echo straight line 98 of the corpus
+echo straight line 99 of the corpus
+echo straight line 100 of the corpus
+echo straight line 101 of the corpus
+echo straight line 102 of the corpus
+echo straight line 103 of the corpus
+echo straight line 104 of the corpus
+echo straight line 105 of the corpus
+echo straight line 106 of the corpus
+echo straight line 107 of the corpus
+echo straight line 108 of the corpus
+echo straight line 109 of the corpus
+echo straight line 110 of the corpus
+echo straight line 111 of the corpus
+echo straight line 112 of the corpus
+echo straight line 113 of the corpus
+echo straight line 114 of the corpus
+echo straight line 115 of the corpus
+echo straight line 116 of the corpus
+echo straight line 117 of the corpus
+echo straight line 118 of the corpus
+echo straight line 119 of the corpus
+echo straight line 120 of the corpus
+true
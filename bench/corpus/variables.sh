@@ -0,0 +1,13 @@
+GREETING=hello
+TARGET=world
+echo $GREETING $TARGET
+I=0
+while [ $I -lt 200 ]; do I=$((I + 1)); done
+echo counted $I
+TOTAL=0
+for N in 1 2 3 4 5 6 7 8 9 10; do TOTAL=$((TOTAL + N * N)); done
+echo sum of squares $TOTAL
+PREFIX=item
+for N in a b c d; do echo ${PREFIX}_$N; done
+if [ $TOTAL -gt 100 ]; then echo big; else echo small; fi
+echo $((TOTAL / 7)) $((TOTAL % 7)) $((1 << 10))
@@ -0,0 +1,174 @@
+/*
+** probe: runs one command and reports what it cost.
+**
+** Usage: probe COMMAND [ARGS]...
+**
+** The command runs under ptrace so that every process created in its
+** tree (fork, vfork or posix_spawn, but not threads) is counted. stdin, stdout and stderr are passed
+** through unchanged; a single line is written to the file named by
+** $PROBE_OUT (or stderr if unset):
+**
+**   wall_ns=<n> forks=<n> maxrss_kb=<n> exit=<n>
+**
+** maxrss_kb is the peak resident set of the top-level process only, so
+** it measures the shell rather than the programs it starts. If ptrace
+** is not permitted the command still runs and forks is reported as -1.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_OPTIONS (PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | \
+                       PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL)
+
+
+static int64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Waits for the untraced child and fills in its status and usage
+static int wait_plain(pid_t child, int *exit_code, struct rusage *usage){
+    int status;
+    if (wait4(child, &status, 0, usage) < 0){
+        perror("wait4");
+        return -1;
+    }
+    *exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                   : 128 + WTERMSIG(status);
+    return 0;
+}
+
+
+// Drives every traced process until the top-level child exits
+static int wait_traced(pid_t child, int *exit_code, struct rusage *usage,
+                       long *forks){
+    for (;;){
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, __WALL, &ru);
+        if (pid < 0){
+            if (errno == EINTR) continue;
+            perror("wait4");
+            return -1;
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)){
+            if (pid == child){
+                *usage = ru;
+                *exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                               : 128 + WTERMSIG(status);
+                return 0;
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status)){
+            continue;
+        }
+
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        int deliver = 0;
+        // threads are followed but show up as clones, not forks
+        if (sig == SIGTRAP && (event == PTRACE_EVENT_FORK ||
+                               event == PTRACE_EVENT_VFORK)){
+            (*forks)++;
+        }
+        // new children start with a SIGSTOP that is not theirs to see
+        else if (sig != SIGTRAP && !(sig == SIGSTOP && event == 0)){
+            deliver = sig;
+        }
+        ptrace(PTRACE_CONT, pid, NULL, (void *) (long) deliver);
+    }
+}
+
+
+int main(int argc, char *argv[]){
+    if (argc < 2){
+        fprintf(stderr, "Usage: probe COMMAND [ARGS]...\n");
+        return 2;
+    }
+
+    // the child tells us through this pipe whether PTRACE_TRACEME worked
+    int sync_pipe[2];
+    if (pipe(sync_pipe) < 0){
+        perror("pipe");
+        return 2;
+    }
+
+    int64_t start = now_ns();
+    pid_t child = fork();
+    if (child < 0){
+        perror("fork");
+        return 2;
+    }
+    if (child == 0){
+        close(sync_pipe[0]);
+        char traced = ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0;
+        if (write(sync_pipe[1], &traced, 1) != 1){
+            _exit(127);
+        }
+        close(sync_pipe[1]);
+        if (traced){
+            raise(SIGSTOP);
+        }
+        execvp(argv[1], argv + 1);
+        perror("execvp");
+        _exit(127);
+    }
+
+    close(sync_pipe[1]);
+    char traced = 0;
+    if (read(sync_pipe[0], &traced, 1) != 1){
+        traced = 0;
+    }
+    close(sync_pipe[0]);
+
+    long forks = -1;
+    int exit_code = 0;
+    struct rusage usage;
+    int error;
+    if (traced){
+        int status;
+        if (waitpid(child, &status, 0) < 0 ||
+            ptrace(PTRACE_SETOPTIONS, child, NULL, (void *) TRACE_OPTIONS) < 0 ||
+            ptrace(PTRACE_CONT, child, NULL, NULL) < 0){
+            perror("ptrace");
+            kill(child, SIGKILL);
+            return 2;
+        }
+        forks = 0;
+        error = wait_traced(child, &exit_code, &usage, &forks);
+    }
+    else {
+        error = wait_plain(child, &exit_code, &usage);
+    }
+    int64_t elapsed = now_ns() - start;
+    if (error < 0){
+        return 2;
+    }
+
+    FILE *out = stderr;
+    const char *out_path = getenv("PROBE_OUT");
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL){
+        perror(out_path);
+        return 2;
+    }
+    fprintf(out, "wall_ns=%lld forks=%ld maxrss_kb=%ld exit=%d\n",
+            (long long) elapsed, forks, usage.ru_maxrss, exit_code);
+    if (out != stderr){
+        fclose(out);
+    }
+    return exit_code;
+}
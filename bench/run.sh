@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# Differential benchmark: runs every script in bench/corpus through
+# cscshell and the reference shells, checks that they agree, and reports
+# lines/sec, forks and peak RSS for each.
+#
+# Usage: bench/run.sh [--runs=N] [--threshold=PCT] [--baseline=FILE]
+#                     [--save] [--shells="cscshell dash bash"]
+#
+# A script passes when stdout, every file it leaves in its working
+# directory, and its exit code match the first reference shell. With a
+# baseline present, cscshell also fails if lines/sec drops, or forks or
+# peak RSS grow, by more than PCT percent. --save writes the current
+# numbers as the new baseline instead of comparing.
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(dirname "$BENCH_DIR")
+CSCSHELL="$REPO_DIR/cscshell"
+PROBE="$BENCH_DIR/probe"
+
+RUNS=5
+THRESHOLD=20
+BASELINE="$BENCH_DIR/baseline.txt"
+SAVE=0
+SHELLS="cscshell dash bash"
+
+for arg in "$@"; do
+    case "$arg" in
+        --runs=*) RUNS=${arg#*=} ;;
+        --threshold=*) THRESHOLD=${arg#*=} ;;
+        --baseline=*) BASELINE=${arg#*=} ;;
+        --save) SAVE=1 ;;
+        --shells=*) SHELLS=${arg#*=} ;;
+        -h|--help) sed -n '2,15s/^# \{0,1\}//p' "$0"; exit 0 ;;
+        *) echo "Unknown argument: $arg" >&2; exit 2 ;;
+    esac
+done
+
+if [ ! -x "$CSCSHELL" ]; then
+    echo "Build cscshell first (make)" >&2
+    exit 2
+fi
+if [ ! -x "$PROBE" ] || [ "$BENCH_DIR/probe.c" -nt "$PROBE" ]; then
+    ${CC:-cc} -O2 -Wall -std=gnu99 -o "$PROBE" "$BENCH_DIR/probe.c" || exit 2
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cscbench.XXXXXX") || exit 2
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+# cscshell needs PATH at the head of its init file
+printf 'PATH=%s\n' "$PATH" > "$WORK/init"
+
+RESULTS="$WORK/results"
+: > "$RESULTS"
+failed=0
+
+# Runs script $2 under shell $1 once in a fresh directory $3;
+# the probe line goes to $3.probe and stdout to $3.stdout.
+run_once() {
+    rm -rf "$3"
+    mkdir "$3"
+    case "$1" in
+        cscshell) set -- "$3" "$CSCSHELL" -i "$WORK/init" "$2" ;;
+        *) set -- "$3" "$1" "$2" ;;
+    esac
+    dir=$1
+    shift
+    (cd "$dir" && PROBE_OUT="$dir.probe" "$PROBE" "$@" > "$dir.stdout" 2> "$dir.stderr")
+}
+
+field() {
+    sed -n "s/.*$1=\([-0-9]*\).*/\1/p" "$2"
+}
+
+for script in "$BENCH_DIR"/corpus/*.sh; do
+    name=$(basename "$script" .sh)
+    lines=$(grep -c . "$script")
+    reference=""
+
+    for sh in $SHELLS; do
+        if [ "$sh" != cscshell ] && ! command -v "$sh" > /dev/null; then
+            continue
+        fi
+        out="$WORK/$name.$sh"
+
+        best_ns=""
+        i=0
+        while [ "$i" -lt "$RUNS" ]; do
+            run_once "$sh" "$script" "$out"
+            ns=$(field wall_ns "$out.probe")
+            if [ -z "$best_ns" ] || [ "$ns" -lt "$best_ns" ]; then
+                best_ns=$ns
+            fi
+            i=$((i + 1))
+        done
+        forks=$(field forks "$out.probe")
+        rss=$(field maxrss_kb "$out.probe")
+        code=$(field exit "$out.probe")
+        lps=$(awk -v l="$lines" -v ns="$best_ns" 'BEGIN { printf "%d", l / (ns / 1e9) }')
+        echo "$name $sh $lps $forks $rss" >> "$RESULTS"
+
+        # the first non-cscshell shell is the one everyone must agree with
+        if [ "$sh" != cscshell ] && [ -z "$reference" ]; then
+            reference=$sh
+            echo "$code" > "$WORK/$name.reference.exit"
+        fi
+    done
+
+    if [ -z "$reference" ]; then
+        echo "$name: no reference shell available" >&2
+        failed=1
+        continue
+    fi
+    ref="$WORK/$name.$reference"
+    for sh in $SHELLS; do
+        out="$WORK/$name.$sh"
+        if [ "$sh" = "$reference" ] || [ ! -f "$out.probe" ]; then
+            continue
+        fi
+        if ! cmp -s "$ref.stdout" "$out.stdout"; then
+            echo "$name: stdout of $sh differs from $reference" >&2
+            diff "$ref.stdout" "$out.stdout" | head -n 10 >&2
+            failed=1
+        fi
+        if ! diff -r "$ref" "$out" > /dev/null; then
+            echo "$name: files written by $sh differ from $reference" >&2
+            diff -r "$ref" "$out" | head -n 10 >&2
+            failed=1
+        fi
+        if [ "$(field exit "$out.probe")" != "$(cat "$WORK/$name.reference.exit")" ]; then
+            echo "$name: exit code of $sh differs from $reference" >&2
+            failed=1
+        fi
+    done
+done
+
+printf '%-16s %-10s %12s %7s %10s\n' script shell lines/sec forks maxrss_kb
+while read -r name sh lps forks rss; do
+    printf '%-16s %-10s %12s %7s %10s\n' "$name" "$sh" "$lps" "$forks" "$rss"
+done < "$RESULTS"
+
+if [ "$SAVE" -eq 1 ]; then
+    grep ' cscshell ' "$RESULTS" > "$BASELINE"
+    echo "Saved baseline to $BASELINE"
+elif [ -f "$BASELINE" ]; then
+    # lines/sec may not fall, forks and RSS may not rise, past THRESHOLD%
+    awk -v pct="$THRESHOLD" '
+        NR == FNR { lps[$1] = $3; forks[$1] = $4; rss[$1] = $5; next }
+        $2 != "cscshell" || !($1 in lps) { next }
+        {
+            if ($3 < lps[$1] * (1 - pct / 100)) {
+                printf "%s: lines/sec regressed %d -> %d\n", $1, lps[$1], $3
+                bad = 1
+            }
+            if (forks[$1] >= 0 && $4 > forks[$1] * (1 + pct / 100)) {
+                printf "%s: forks regressed %d -> %d\n", $1, forks[$1], $4
+                bad = 1
+            }
+            if ($5 > rss[$1] * (1 + pct / 100)) {
+                printf "%s: maxrss_kb regressed %d -> %d\n", $1, rss[$1], $5
+                bad = 1
+            }
+        }
+        END { exit bad }
+    ' "$BASELINE" "$RESULTS" >&2 || failed=1
+fi
+
+exit "$failed"
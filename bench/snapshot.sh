@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Init snapshot test: starts cscshell twice on each of a few init files
+# and checks which ones are snapshotted. A purely declarative init file
+# gets a .snap file that the second start loads; one whose lines run a
+# $(...) or $((...)) must be run again on every start, so its commands'
+# output and side effects are never frozen from the first run.
+#
+# Usage: bench/snapshot.sh [CSCSHELL]
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(dirname "$BENCH_DIR")
+CSCSHELL="$REPO_DIR/cscshell"
+
+for arg in "$@"; do
+    case "$arg" in
+        -h|--help) sed -n '2,9s/^# \{0,1\}//p' "$0"; exit 0 ;;
+        -*) echo "Unknown argument: $arg" >&2; exit 2 ;;
+        *) CSCSHELL=$arg ;;
+    esac
+done
+
+if [ ! -x "$CSCSHELL" ]; then
+    echo "Build cscshell first (make)" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cscsnap.XXXXXX") || exit 2
+trap 'rm -rf "$WORK"' EXIT INT TERM
+failed=0
+
+fail() {
+    echo "$1" >&2
+    failed=1
+}
+
+# Runs script $2 with init file $1 from $WORK, printing its stdout
+start() {
+    (cd "$WORK" && "$CSCSHELL" -i "$1" "$2")
+}
+
+# cscshell refuses PATH directories that do not exist, and warns unless
+# the head of its variable list sorts no later than PATH, hence NOW
+INIT_PATH=/usr/bin:/bin
+printf 'echo $NOW\n' > "$WORK/show.sh"
+
+# declarative: snapshotted on the first start, loaded on the second
+printf 'PATH=%s\nNOW=plain\n' "$INIT_PATH" > "$WORK/plain"
+first=$(start "$WORK/plain" "$WORK/show.sh")
+[ -f "$WORK/plain.snap" ] || fail "plain: no snapshot written"
+second=$(start "$WORK/plain" "$WORK/show.sh")
+[ "$first" = plain ] && [ "$second" = plain ] ||
+    fail "plain: printed '$first' then '$second'"
+
+# $(...) output: a new value on every start
+printf 'PATH=%s\nNOW=$(date +%%s%%N)\n' "$INIT_PATH" > "$WORK/subst"
+first=$(start "$WORK/subst" "$WORK/show.sh")
+second=$(start "$WORK/subst" "$WORK/show.sh")
+[ ! -f "$WORK/subst.snap" ] || fail "subst: snapshot written"
+[ -n "$first" ] && [ "$first" != "$second" ] ||
+    fail "subst: printed '$first' both times"
+
+# $(...) side effects: the file is made again on every start
+printf 'PATH=%s\nNOW=$(touch made)\n' "$INIT_PATH" > "$WORK/effect"
+start "$WORK/effect" "$WORK/show.sh" > /dev/null
+rm -f "$WORK/made"
+start "$WORK/effect" "$WORK/show.sh" > /dev/null
+[ -f "$WORK/made" ] || fail "effect: command not run on the second start"
+
+# $((...)) is left out too
+printf 'PATH=%s\nNOW=$((6 * 7))\n' "$INIT_PATH" > "$WORK/arith"
+start "$WORK/arith" "$WORK/show.sh" > /dev/null
+value=$(start "$WORK/arith" "$WORK/show.sh")
+[ ! -f "$WORK/arith.snap" ] || fail "arith: snapshot written"
+[ "$value" = 42 ] || fail "arith: printed '$value'"
+
+# so is an export of one
+printf 'PATH=%s\nexport NOW=$(echo exported)\n' "$INIT_PATH" > "$WORK/export"
+start "$WORK/export" "$WORK/show.sh" > /dev/null
+value=$(start "$WORK/export" "$WORK/show.sh")
+[ ! -f "$WORK/export.snap" ] || fail "export: snapshot written"
+[ "$value" = exported ] || fail "export: printed '$value'"
+
+# a bare export takes the inherited value, which may differ next start
+printf 'PATH=%s\nexport NOW\n' "$INIT_PATH" > "$WORK/inherit"
+NOW=first start "$WORK/inherit" "$WORK/show.sh" > /dev/null
+value=$(NOW=second start "$WORK/inherit" "$WORK/show.sh")
+[ ! -f "$WORK/inherit.snap" ] || fail "inherit: snapshot written"
+[ "$value" = second ] || fail "inherit: printed '$value'"
+
+[ "$failed" -eq 0 ] && echo "snapshot: ok"
+exit "$failed"
@@ -0,0 +1,126 @@
+#!/bin/sh
+#
+# Soak test: runs cscshell on a generated script of a million lines mixing
+# assignments, arithmetic, $(...), builtin filters, redirects, function
+# calls, blocks and cd, taking a memstats snapshot every --check lines.
+# Fails if the heap grew by more than --slack bytes between the first
+# snapshot after warm-up and the last one.
+#
+# Usage: bench/soak.sh [--lines=N] [--check=N] [--slack=BYTES] [CSCSHELL]
+#
+# A make memstats build reports exact live bytes per source file (see the
+# mem.*.txt files kept with --keep); other builds report the allocator's
+# bytes in use.
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(dirname "$BENCH_DIR")
+CSCSHELL="$REPO_DIR/cscshell"
+
+LINES=1000000
+CHECK=50000
+SLACK=65536
+KEEP=0
+
+for arg in "$@"; do
+    case "$arg" in
+        --lines=*) LINES=${arg#*=} ;;
+        --check=*) CHECK=${arg#*=} ;;
+        --slack=*) SLACK=${arg#*=} ;;
+        --keep) KEEP=1 ;;
+        -h|--help) sed -n '2,13s/^# \{0,1\}//p' "$0"; exit 0 ;;
+        -*) echo "Unknown argument: $arg" >&2; exit 2 ;;
+        *) CSCSHELL=$arg ;;
+    esac
+done
+
+if [ ! -x "$CSCSHELL" ]; then
+    echo "Build cscshell first (make, or make memstats)" >&2
+    exit 2
+fi
+CSCSHELL=$(cd "$(dirname "$CSCSHELL")" && pwd)/$(basename "$CSCSHELL")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cscsoak.XXXXXX") || exit 2
+if [ "$KEEP" -eq 0 ]; then
+    trap 'rm -rf "$WORK"' EXIT INT TERM
+fi
+
+printf 'PATH=%s\n' "$PATH" > "$WORK/init"
+seq 1 200 > "$WORK/data.txt"
+
+# Twenty lines per round, none of which forks once the shell is warm,
+# so a million lines take minutes rather than hours
+awk -v lines="$LINES" -v check="$CHECK" '
+BEGIN {
+    print "count() { local N=$1; R=$((N + 1)); }"
+    print "I=0"
+    n = 2
+    while (n < lines) {
+        print "I=$((I + 1))"
+        print "A=round$I"
+        print "B=$A.$I"
+        print "export C=$B"
+        print "S=$(echo $A $B)"
+        print "T=$(wc -l < data.txt)"
+        print "wc -l < data.txt > out.txt"
+        print "head -n 3 data.txt > out.txt"
+        print "tail -n 2 data.txt >> out.txt"
+        print "cat data.txt | grep 1 | wc -l > out.txt"
+        print "cut -d 0 -f 1 < data.txt | tr 1 x > out.txt"
+        print "count $I"
+        print "for J in 1 2 3; do K=$J; done"
+        print "G=$((I * 2))"
+        print "cd ."
+        print "D=$(($I % 7))"
+        print "E=$(cat out.txt | head -n 1)"
+        print "F=$C$D$E"
+        print "unused=$F"
+        n += 19
+        if (int(n / check) != int((n - 19) / check)) {
+            print "memstats > mem." int(n / check) ".txt"
+            n++
+        }
+    }
+}' > "$WORK/soak.sh"
+
+start=$(date +%s)
+(cd "$WORK" && "$CSCSHELL" -i "$WORK/init" "$WORK/soak.sh") > "$WORK/out" 2>&1
+code=$?
+elapsed=$(( $(date +%s) - start ))
+
+if [ "$code" -ne 0 ]; then
+    echo "FAIL: soak script exited $code" >&2
+    tail -n 5 "$WORK/out" >&2
+    exit 1
+fi
+
+# live bytes of every snapshot, in order
+printf '%10s %14s\n' line live_bytes
+first=""
+last=""
+index=1
+while [ -f "$WORK/mem.$index.txt" ]; do
+    bytes=$(awk '$1 == "total" { print $4 }' "$WORK/mem.$index.txt")
+    printf '%10s %14s\n' $((index * CHECK)) "$bytes"
+    # the first snapshot still includes warm-up growth (caches, buffers)
+    if [ "$index" -ge 2 ] && [ -z "$first" ]; then
+        first=$bytes
+    fi
+    last=$bytes
+    index=$((index + 1))
+done
+
+if [ -z "$first" ]; then
+    echo "FAIL: fewer than two snapshots; lower --check" >&2
+    exit 1
+fi
+growth=$((last - first))
+if [ "$growth" -gt "$SLACK" ]; then
+    echo "FAIL: heap grew by $growth bytes over $LINES lines (slack $SLACK)" >&2
+    [ "$KEEP" -eq 1 ] && echo "kept $WORK" >&2
+    exit 1
+fi
+echo "OK: heap grew by $growth bytes over $LINES lines in ${elapsed}s"
+[ "$KEEP" -eq 1 ] && echo "kept $WORK"
+exit 0
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Compares two cscshell builds: startup time (an init file and a
+# one-line script, no commands run) and throughput (lines/sec over
+# bench/corpus, best of N runs). A positive change is an improvement.
+# Used by make pgo to report what the optimised build gained over the
+# plain one.
+#
+# Usage: bench/speedup.sh [--runs=N] [--starts=N] BASELINE_BIN NEW_BIN
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+RUNS=5
+STARTS=200
+BINS=""
+
+for arg in "$@"; do
+    case "$arg" in
+        --runs=*) RUNS=${arg#*=} ;;
+        --starts=*) STARTS=${arg#*=} ;;
+        -h|--help) sed -n '2,9s/^# \{0,1\}//p' "$0"; exit 0 ;;
+        *) BINS="$BINS $arg" ;;
+    esac
+done
+
+set -- $BINS
+if [ $# -ne 2 ]; then
+    echo "Usage: bench/speedup.sh [--runs=N] [--starts=N] BASELINE_BIN NEW_BIN" >&2
+    exit 2
+fi
+OLD=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+NEW=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/cscspeedup.XXXXXX") || exit 2
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+printf 'PATH=%s\n' "$PATH" > "$WORK/init"
+echo 'X=1' > "$WORK/start.sh"
+
+now_ns() {
+    date +%s%N
+}
+
+# Mean microseconds for one start of binary $1
+startup_us() {
+    start=$(now_ns)
+    i=0
+    while [ "$i" -lt "$STARTS" ]; do
+        "$1" -i "$WORK/init" "$WORK/start.sh" > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    echo $(( ($(now_ns) - start) / STARTS / 1000 ))
+}
+
+# Lines/sec of binary $1 over the whole corpus, taking each script's
+# best run
+throughput() {
+    total_lines=0
+    total_ns=0
+    for script in "$BENCH_DIR"/corpus/*.sh; do
+        best=""
+        i=0
+        while [ "$i" -lt "$RUNS" ]; do
+            rm -rf "$WORK/run"
+            mkdir "$WORK/run"
+            start=$(now_ns)
+            (cd "$WORK/run" && "$1" -i "$WORK/init" "$script" > /dev/null 2>&1)
+            ns=$(( $(now_ns) - start ))
+            if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+                best=$ns
+            fi
+            i=$((i + 1))
+        done
+        total_lines=$((total_lines + $(grep -c . "$script")))
+        total_ns=$((total_ns + best))
+    done
+    echo $((total_lines * 1000000000 / total_ns))
+}
+
+old_start=$(startup_us "$OLD")
+new_start=$(startup_us "$NEW")
+old_lps=$(throughput "$OLD")
+new_lps=$(throughput "$NEW")
+
+printf '%-12s %14s %14s %9s\n' metric baseline new change
+printf '%-12s %14s %14s %8s%%\n' startup_us "$old_start" "$new_start" \
+    "$(awk -v a="$old_start" -v b="$new_start" 'BEGIN { printf "%+.1f", (a - b) / a * 100 }')"
+printf '%-12s %14s %14s %8s%%\n' lines/sec "$old_lps" "$new_lps" \
+    "$(awk -v a="$old_lps" -v b="$new_lps" 'BEGIN { printf "%+.1f", (b - a) / a * 100 }')"
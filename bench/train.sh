@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# PGO training run: executes every script in bench/training with the
+# given cscshell binary (an instrumented build, from make pgo), each in a
+# fresh directory, so the profile covers parsing, variable and $(...)
+# expansion, PATH resolution and pipeline execution.
+#
+# Usage: bench/train.sh [--runs=N] [CSCSHELL]
+
+set -u
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(dirname "$BENCH_DIR")
+CSCSHELL="$REPO_DIR/cscshell"
+RUNS=3
+
+for arg in "$@"; do
+    case "$arg" in
+        --runs=*) RUNS=${arg#*=} ;;
+        -h|--help) sed -n '2,8s/^# \{0,1\}//p' "$0"; exit 0 ;;
+        *) CSCSHELL=$arg ;;
+    esac
+done
+
+# the scripts run in their own directory
+CSCSHELL=$(cd "$(dirname "$CSCSHELL")" && pwd)/$(basename "$CSCSHELL")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/csctrain.XXXXXX") || exit 2
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+printf 'PATH=%s\n' "$PATH" > "$WORK/init"
+
+failed=0
+for script in "$BENCH_DIR"/training/*.sh; do
+    name=$(basename "$script" .sh)
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        rm -rf "$WORK/run"
+        mkdir "$WORK/run"
+        if ! (cd "$WORK/run" &&
+              "$CSCSHELL" -i "$WORK/init" "$script" > /dev/null 2>&1); then
+            echo "$name: training run failed" >&2
+            failed=1
+        fi
+        i=$((i + 1))
+    done
+done
+exit "$failed"
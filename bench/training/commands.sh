@@ -0,0 +1,24 @@
+seq 2000 > numbers.txt
+cat numbers.txt | grep 7 | wc -l
+head -n 20 numbers.txt | tail -n 5
+cut -c 1-2 numbers.txt | sort | uniq -c | head -n 3
+tr 0-9 a-j < numbers.txt > letters.txt
+wc letters.txt
+grep -c 1 numbers.txt
+for F in 1 2 3 4 5 6 7 8 9 10; do echo line $F >> log.txt; done
+cat log.txt | tr a-z A-Z | tail -n 2
+ls numbers.txt letters.txt log.txt
+N=0
+while [ $N -lt 40 ]; do N=$((N + 1)); true; done
+echo ran $N
+COUNT=$(wc -l < numbers.txt)
+echo counted $COUNT
+FIRST=$(head -n 1 letters.txt)
+echo first $FIRST
+for W in alpha beta gamma delta; do echo $W | tr a-z A-Z; done
+sort -r numbers.txt | head -n 3
+basename /usr/bin/env
+dirname /usr/bin/env
+date +%Y > year.txt
+test -s year.txt
+echo done
@@ -0,0 +1,26 @@
+NAME=world
+GREETING=hello
+SEP=-
+PREFIX=item
+I=0
+while [ $I -lt 300 ]; do I=$((I + 1)); LABEL=${PREFIX}$SEP$I$SEP$NAME; done
+echo $GREETING $NAME $LABEL
+TOTAL=0
+for N in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do TOTAL=$((TOTAL + N * N - N / 2)); done
+echo total $TOTAL
+label() {
+    local base=$1
+    OUT=${base}_${2}_$3
+}
+for N in a b c d e f g h i j; do label $PREFIX $N $TOTAL; done
+echo last $OUT
+export GREETING
+export NAME=planet
+A=$GREETING$SEP$NAME$SEP$PREFIX$SEP$TOTAL
+B=${A}${A}
+C=$B$B$B
+echo $C
+WORDS=$(echo one two three four five six)
+echo $WORDS
+if [ $TOTAL -gt 1000 ]; then echo large; else echo small; fi
+echo $((TOTAL * 3 % 17)) $((1 << 12)) $((TOTAL > 100 && TOTAL < 5000))
@@ -0,0 +1,36 @@
+true
+echo start
+echo one two three four five six seven eight nine ten
+echo the quick brown fox jumps over the lazy dog
+true
+false
+env > env.txt
+wc -l env.txt
+echo a > a.txt
+echo b >> a.txt
+echo c >> a.txt
+cat a.txt
+cat < a.txt
+cat a.txt | wc -c
+head -n 1 a.txt
+tail -n 1 a.txt
+grep b a.txt
+cut -c 1 a.txt
+tr a-c x-z < a.txt
+uname > /dev/null
+id -u > /dev/null
+pwd > /dev/null
+ls > /dev/null
+ls -a / > listing.txt
+wc -w listing.txt
+mkdir sub
+cd sub
+pwd > /dev/null
+cd ..
+rmdir sub
+touch t1 t2 t3
+ls t*
+rm t1 t2 t3
+seq 5 | sort -r | head -n 2
+seq 100 | paste -sd+
+echo done
@@ -7,6 +7,17 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
+    printf("  --metrics-shm[=NAME]\t\tKeep metrics in shared memory NAME. Default is /cscshell.<pid>\n");
+    printf("  --metrics-file=FILE\t\tWrite metrics to FILE in Prometheus text format\n");
+    printf("  --metrics-interval=SECS\tHow often to rewrite the metrics file. Default is 15\n");
+    printf("  --server=SOCKET\t\tServe the shell on Unix socket SOCKET instead of running a script\n");
+    printf("  --connect=SOCKET\t\tRun the script, or stdin, on the server at SOCKET\n");
+    printf("  --record=FILE\t\t\tLog every line run, with its timings, to FILE\n");
+    printf("  --replay=FILE\t\t\tRun the lines logged in FILE instead of a script\n");
+    printf("  --replay-speed=SPEED\t\t'max' (default) or 'original' to keep the logged pace\n");
+    printf("  --no-optimize\t\t\tRun pipelines as written, without folding cat stages into redirects\n");
+    printf("  --dump-pipelines\t\tPrint each pipeline before and after optimizing to stderr\n");
+    printf("  --history=FILE\t\tKeep interactive history in FILE and FILE.idx. Default is ~/.cscshell_history\n");
     printf("If no script file is given, cscshell will run in interactive mode\n");
 }
 
@@ -24,8 +35,16 @@ char *prompt(char *line, size_t line_length){
         return (char *) -1;
     }
 
-    printf("%s@<%s> %s", user_buff, cwd_buff, PROMPT_STR);
-    return fgets(line, line_length, stdin);
+    char prompt_buff[MAX_PATH_STR + MAX_USER_BUF + 16];
+    snprintf(prompt_buff, sizeof(prompt_buff), "%s@<%s> %s", user_buff,
+             cwd_buff, PROMPT_STR);
+    return line_edit(prompt_buff, line, line_length);
+}
+
+
+// Reads the following lines of a block that spans several lines
+char *read_continuation(char *line, int line_length, void *ctx){
+    return line_edit(CONTINUATION_PROMPT_STR, line, line_length);
 }
 
 
@@ -41,20 +60,26 @@ int run_interactive(Variable **root){
         // kill the newline
         line[strlen(line) - 1] = '\0';
 
-        Command *commands = parse_line(line, root);
-        if (commands == (Command *) -1){
+        int status;
+        record_begin(line);
+        if (vm_starts_block(line)){
+            RecordSource source = {read_continuation, NULL};
+            status = vm_run_block(line, record_read, &source, root);
+        }
+        else {
+            status = run_cached_line(line, root);
+        }
+        record_end(status);
+
+        metrics_tick();
+        if (status == RUN_PARSE_FAILED){
             ERR_PRINT(ERR_PARSING_LINE);
             continue;
         }
-        if (commands == NULL) continue;
-
-        int *last_ret_code_pt = execute_line(commands);
-        if (last_ret_code_pt == (int *) -1){
+        if (status < 0){
             ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
             return -1;
         }
-        free(last_ret_code_pt);
     }
     printf("\n");
 
@@ -67,10 +92,55 @@ int run_interactive(Variable **root){
 }
 
 
+// Opens the history at path, or ~/.cscshell_history if it is NULL
+static void open_history(const char *path){
+    if (path != NULL){
+        history_open(path);
+        return;
+    }
+    const char *home = getenv("HOME");
+    if (home == NULL){
+        return;
+    }
+    char default_path[strlen(home) + strlen(HISTORY_FILE_NAME) + 2];
+    sprintf(default_path, "%s/%s", home, HISTORY_FILE_NAME);
+    history_open(default_path);
+}
+
+
+// Takes the value of an argument given as ARG=VALUE or ARG VALUE.
+// Returns NULL if it is missing.
+static char *value_arg(int argc, char *argv[], int *i, int *num_args_parsed){
+    char *equals = strchr(argv[*i], '=');
+    (*num_args_parsed)++;
+    if (equals != NULL){
+        return equals + 1;
+    }
+    if (*i + 1 < argc){
+        (*i)++;
+        (*num_args_parsed)++;
+        return argv[*i];
+    }
+    fprintf(stderr, ERR_VALUE_MISSING, argv[*i]);
+    return NULL;
+}
+
+
 int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    bool use_metrics_shm = false;
+    char *metrics_shm = NULL;
+    char *metrics_file = NULL;
+    int metrics_interval = METRICS_FILE_INTERVAL;
+    char *server_socket = NULL;
+    char *connect_socket = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    bool replay_original_speed = false;
+    char *history_file = NULL;
+    metrics_init();
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -91,36 +161,151 @@ int main(int argc, char *argv[]){
             }
         }
 
-        else if (strncmp(argv[1], LONG_INIT_ARG,
+        else if (strncmp(argv[i], LONG_INIT_ARG,
                          strlen(LONG_INIT_ARG)) == 0){
             num_args_parsed++;
-            init_file = strchr(argv[1], '=') + 1;
+            init_file = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_METRICS_SHM_ARG,
+                         strlen(LONG_METRICS_SHM_ARG)) == 0){
+            num_args_parsed++;
+            char *equals = strchr(argv[i], '=');
+            metrics_shm = (equals != NULL) ? equals + 1 : NULL;
+            use_metrics_shm = true;
+        }
+
+        else if (strncmp(argv[i], LONG_METRICS_FILE_ARG,
+                         strlen(LONG_METRICS_FILE_ARG)) == 0){
+            num_args_parsed++;
+            metrics_file = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_METRICS_INTERVAL_ARG,
+                         strlen(LONG_METRICS_INTERVAL_ARG)) == 0){
+            num_args_parsed++;
+            metrics_interval = atoi(strchr(argv[i], '=') + 1);
+        }
+
+        else if (strncmp(argv[i], LONG_SERVER_ARG,
+                         strlen(LONG_SERVER_ARG)) == 0){
+            server_socket = value_arg(argc, argv, &i, &num_args_parsed);
+            if (server_socket == NULL){
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_CONNECT_ARG,
+                         strlen(LONG_CONNECT_ARG)) == 0){
+            connect_socket = value_arg(argc, argv, &i, &num_args_parsed);
+            if (connect_socket == NULL){
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_REPLAY_SPEED_ARG,
+                         strlen(LONG_REPLAY_SPEED_ARG)) == 0){
+            num_args_parsed++;
+            replay_original_speed = strcmp(strchr(argv[i], '=') + 1,
+                                           REPLAY_SPEED_ORIGINAL) == 0;
+        }
+
+        else if (strncmp(argv[i], LONG_HISTORY_ARG,
+                         strlen(LONG_HISTORY_ARG)) == 0){
+            num_args_parsed++;
+            history_file = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strcmp(argv[i], LONG_NO_OPTIMIZE_ARG) == 0){
+            num_args_parsed++;
+            optimize_enabled = false;
+        }
+
+        else if (strcmp(argv[i], LONG_DUMP_PIPELINES_ARG) == 0){
+            num_args_parsed++;
+            optimize_dump = true;
+        }
+
+        else if (strncmp(argv[i], LONG_RECORD_ARG,
+                         strlen(LONG_RECORD_ARG)) == 0){
+            record_path = value_arg(argc, argv, &i, &num_args_parsed);
+            if (record_path == NULL){
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_REPLAY_ARG,
+                         strlen(LONG_REPLAY_ARG)) == 0){
+            replay_path = value_arg(argc, argv, &i, &num_args_parsed);
+            if (replay_path == NULL){
+                return -1;
+            }
         }
     }
 
+    // the client only forwards lines; the server has the shell's state
+    if (connect_socket != NULL){
+        char *script = (num_args_parsed < argc-1) ? argv[argc-1] : NULL;
+        return server_connect(connect_socket, script);
+    }
+
+    if (use_metrics_shm && metrics_open_shm(metrics_shm) < 0){
+        return -1;
+    }
+    if (metrics_file != NULL){
+        metrics_set_file(metrics_file, metrics_interval);
+    }
+
     #ifdef DEBUG
     printf("Using init file at: %s\n", init_file);
     #endif
 
     Variable *start_of_vars = NULL;
-    if (run_script(init_file, &start_of_vars) < 0){
+    int snapshot_loaded = snapshot_load(init_file, &start_of_vars);
+    if (snapshot_loaded < 0){
         ERR_PRINT(ERR_INIT_SCRIPT, init_file);
         return -1;
     }
+    if (!snapshot_loaded){
+        if (run_script(init_file, &start_of_vars) < 0){
+            ERR_PRINT(ERR_INIT_SCRIPT, init_file);
+            return -1;
+        }
+        snapshot_save(init_file, start_of_vars);
+    }
 
     if ((start_of_vars == NULL) ||
         strcmp(start_of_vars->name, PATH_VAR_NAME) > 0) {
         ERR_PRINT(ERR_PATH_INIT, init_file);
     }
 
+    // the init script is not part of the session
+    if (record_path != NULL && record_open(record_path) < 0){
+        return -1;
+    }
+
     int ret_code;
-    if (num_args_parsed < argc-1){
+    if (replay_path != NULL){
+        ret_code = replay_run(replay_path, replay_original_speed,
+                              &start_of_vars);
+    }
+    else if (server_socket != NULL){
+        ret_code = server_run(server_socket, &start_of_vars);
+    }
+    else if (num_args_parsed < argc-1){
         ret_code = run_script(argv[argc-1], &start_of_vars);
     }
     else{
+        // without its history the prompt still edits lines
+        open_history(history_file);
         ret_code = run_interactive(&start_of_vars);
+        history_close();
     }
 
     free_variable(start_of_vars, NON_ZERO_BYTE);
+    parse_cache_free();
+    suggest_free();
+    record_close();
+    metrics_close();
     return ret_code;
 }
@@ -1,6 +1,9 @@
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+// for pipe2 and memmem
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,10 +20,23 @@
 #include <dirent.h>
 #include <pwd.h>
 #include <errno.h>
+#include <time.h>
 
 // Arg help
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
+#define LONG_METRICS_SHM_ARG "--metrics-shm"
+#define LONG_METRICS_FILE_ARG "--metrics-file="
+#define LONG_METRICS_INTERVAL_ARG "--metrics-interval="
+#define LONG_SERVER_ARG "--server"
+#define LONG_CONNECT_ARG "--connect"
+#define LONG_RECORD_ARG "--record"
+#define LONG_REPLAY_ARG "--replay"
+#define LONG_REPLAY_SPEED_ARG "--replay-speed="
+#define LONG_NO_OPTIMIZE_ARG "--no-optimize"
+#define LONG_DUMP_PIPELINES_ARG "--dump-pipelines"
+#define LONG_HISTORY_ARG "--history="
+#define REPLAY_SPEED_ORIGINAL "original"
 #define DEFAULT_INIT "~/.cscshell_init"
 
 // Buffer sizes
@@ -34,16 +50,169 @@
 // other strings and values
 #define PATH_VAR_NAME "PATH"
 #define CD "cd"
+#define EXPORT "export"
 #define VARIABLE_PARSE_MARKER '$'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
 #define NON_ZERO_BYTE 0x42
+#define RUN_PARSE_FAILED -2
+#define EXEC_FAILED_STATUS 127
+
+// memo prefix config
+#define MEMO "memo"
+#define MEMO_INPUT_FLAG "-i"
+#define MEMO_DIR_NAME ".cscshell_memo"
+#define MEMO_MAGIC "CSCMEMO1"
+#define MEMO_MAX_BYTES (64 * 1024 * 1024)
+#define COPY_BUF_SIZE 65536
+
+// watch prefix config
+#define WATCH "watch"
+#define WATCH_INPUT_FLAG "-i"
+#define WATCH_DEBOUNCE_FLAG "-d"
+#define WATCH_RUNS_FLAG "-n"
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_EVENT_BUF 4096
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+// timeout prefix config
+#define TIMEOUT "timeout"
+#define TIMEOUT_KILL_FLAG "-k"
+#define TIMEOUT_VAR_NAME "CMD_TIMEOUT"
+#define TIMEOUT_GRACE_NS (2 * 1000000000LL)
+#define TIMEOUT_STATUS 124
+
+// pipeline optimizer config
+#define OPTIMIZE_CAT "cat"
+#define OPTIMIZE_WC "wc"
+#define OPTIMIZE_DUMP_BEFORE "pipeline"
+#define OPTIMIZE_DUMP_AFTER "optimized"
+
+// block keywords compiled by the bytecode VM
+#define KW_FOR "for"
+#define KW_IN "in"
+#define KW_WHILE "while"
+#define KW_IF "if"
+#define KW_DO "do"
+#define KW_DONE "done"
+#define KW_THEN "then"
+#define KW_ELIF "elif"
+#define KW_ELSE "else"
+#define KW_FI "fi"
+#define KW_BRACE_OPEN "{"
+#define KW_BRACE_CLOSE "}"
+#define KW_RETURN "return"
+#define KW_LOCAL "local"
+#define CONTINUATION_PROMPT_STR "> "
+
+// command substitution config
+#define SUBST_START "$("
+#define SUBST_END ")"
+#define ECHO "echo"
+#define SUBST_BUF_SIZE 4096
+
+// shell function config
+#define FUNCTION_TABLE_SIZE 64
+#define FUNCTION_MAX_DEPTH 256
+#define FUNCTION_ALL_ARGS "@"
+
+// arithmetic expansion config
+#define ARITH_START "$(("
+#define ARITH_END "))"
+#define ARITH_CACHE_SIZE 256
+
+// command list config
+#define LIST_SEQ ";"
+#define LIST_AND "&&"
+#define LIST_OR "||"
+#define LIST_OP_SEQ 0
+#define LIST_OP_AND 1
+#define LIST_OP_OR 2
+#define LAST_STATUS_VAR "$?"
+
+// glob config
+#define GLOB_MAGIC_CHARS "*?["
+#define GETDENTS_BUF_SIZE 65536
+
+// script lookahead config
+#define LOOKAHEAD_DEPTH 8
+
+// builtin filter config; FILTER_RING_SIZE must be a power of two
+#define FILTER_RING_SIZE (256 * 1024)
+#define FILTER_BUF_SIZE 65536
+#define FILTER_TRANSFER_CHUNK (1 << 20)
+
+// PATH resolution cache config
+#define PATH_CACHE_SIZE 64
+
+// metrics config
+#define METRICS_MAGIC "CSCMETR1"
+#define METRICS_VERSION 2
+#define METRICS_BUCKETS 20
+#define METRICS_SHM_FORMAT "/cscshell.%d"
+#define METRICS_FILE_INTERVAL 15
+
+// --server config
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_EVENTS 64
+#define SERVER_BUF_SIZE (2 * MAX_SINGLE_LINE)
+// how long the server waits for the rest of a block a client is sending
+#define SERVER_BLOCK_WAIT_MS 5000
+
+// --record / --replay config
+#define RECORD_MAGIC "CSCREC01"
+#define RECORD_VERSION 1
+
+// allocation accounting config (make memstats)
+#define MEMSTATS_BUILTIN "memstats"
+#define MEM_MAX_SUBSYSTEMS 32
+#define MEM_MAGIC 0x4d454d53
+#define MEM_REPORT_SIZE 4096
+
+// line editor and history config
+#define HISTORY_FILE_NAME ".cscshell_history"
+#define HISTORY_INDEX_SUFFIX ".idx"
+#define HISTORY_TMP_SUFFIX ".tmp"
+#define HISTORY_MAGIC "CSCHIST1"
+#define HISTORY_VERSION 2
+#define HISTORY_SIGNATURE_WORDS 4
+#define HISTORY_MAX_BYTES (32 * 1024 * 1024)
+#define HISTORY_KEEP_BYTES (HISTORY_MAX_BYTES / 2)
+#define LINE_EDIT_ESC_MS 50
+#define LINE_EDIT_SEARCH_PROMPT "(reverse-i-search)`%.*s': "
+#define LINE_EDIT_FAILED_PROMPT "(failed reverse-i-search)`%.*s': "
+
+// interactive parse cache config
+#define PARSE_CACHE_SIZE 32
+#define PARSE_CACHE_BUILTIN "parsecache"
+#define PARSE_CACHE_REPORT_SIZE 256
+
+// command suggestion config
+#define SUGGEST_BUILTIN "suggest"
+#define SUGGEST_MAX 3
+#define SUGGEST_MAX_DISTANCE 2
+#define SUGGEST_SHORT_NAME 4
+#define SUGGEST_INITIAL_NAMES 1024
+#define SUGGEST_SEPARATOR ", "
+#define SUGGEST_REPORT_SIZE 1024
+
+// init snapshot config
+#define SNAPSHOT_SUFFIX ".snap"
+#define SNAPSHOT_MAGIC "CSCSNAP2"
+
+// FNV-1a, used for cache keys and snapshot validation
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
 #define ERR_PATH_INIT "PATH not defined in init file %s, or not at the head \
 of the variable list."
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
+#define ERR_HISTORY_FORMAT "Not a cscshell history index: %s\n"
+#define ERR_LIST_SYNTAX "Missing command in list: %s\n"
+#define ERR_LIST_BLOCK "Blocks cannot be part of a list: %s\n"
 #define ERR_EXECUTE_LINE "Could not execute line.\n"
 #define ERR_INIT_SCRIPT "Failed to run init script: %s\n"
 #define ERR_VAR_START "Assignment cannot start with '=' character.\n"
@@ -52,11 +221,42 @@ of the variable list."
 #define ERR_NOT_PATH "Variable used for PATH is not correctly named.\n"
 #define ERR_BAD_PATH "PATH directory %s invalid.\n"
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
+#define ERR_NO_EXECU_SUGGEST "Could not resolve executable [%s]; did you mean %s?\n"
+#define ERR_SUGGEST_USAGE "usage: suggest NAME\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_BLOCK_EOF "Missing '%s' before end of input.\n"
+#define ERR_BLOCK_SYNTAX "Syntax error near '%s'.\n"
+#define ERR_FUNC_ONLY "'%s' is only valid inside a function.\n"
+#define ERR_FUNC_RETURN "return: numeric argument required: %s\n"
+#define ERR_FUNC_DEPTH "Function %s nested too deeply.\n"
+#define ERR_ARITH_SYNTAX "Syntax error in arithmetic expression: %s\n"
+#define ERR_ARITH_VALUE "Variable %s is not an integer: %s\n"
+#define ERR_ARITH_ZERO "Division by zero in: %s\n"
+#define ERR_MEMO_USAGE "Usage: memo [-i FILE]... COMMAND [ARGS]...\n"
+#define ERR_MEMO_DIR "Could not use memo cache directory %s\n"
+#define ERR_WATCH_USAGE "Usage: watch [-d MS] [-n RUNS] [-i PATH]... COMMAND [ARGS]...\n"
+#define ERR_WATCH_PATH "watch: cannot watch %s\n"
+#define ERR_WATCH_NOTHING "watch: nothing to watch; redirect input or give -i PATH\n"
+#define ERR_TIMEOUT_USAGE "Usage: timeout [-k GRACE] DURATION COMMAND [ARGS]...\n"
+#define ERR_TIMEOUT_VAR "Ignoring CMD_TIMEOUT, not a duration: %s\n"
+#define ERR_TIMEOUT "%s timed out.\n"
+#define ERR_VALUE_MISSING "Missing value after argument: '%s'\n"
+#define ERR_SERVER_PATH "Socket path too long: %s\n"
+#define ERR_SERVER_FDS "Client sent a line before its file descriptors.\n"
+#define ERR_SERVER_LINE "Client line too long.\n"
+#define ERR_SERVER_GONE "Lost the connection to the server.\n"
+#define ERR_REPLAY_FORMAT "Not a cscshell recording, or truncated: %s\n"
+
+// While errors_muted is non-zero, errors are only counted
+extern int errors_muted;
+extern int errors_suppressed;
+extern int errors_printed;
 
-#define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
-    fprintf(stderr, __VA_ARGS__);
+#define ERR_PRINT(...) if (errors_muted) { errors_suppressed++; } else {\
+    errors_printed++;\
+    fprintf(stderr, "ERROR: ");\
+    fprintf(stderr, __VA_ARGS__); }
 
 /*
 ** Two structures for maintaining a singly-linked list of:
@@ -72,9 +272,30 @@ of the variable list."
 typedef struct Variable{
     char *name;
     char *value;
+    uint8_t exported;
     struct Variable *next;
 } Variable;
 
+/*
+** Directory listings read while expanding the globs of one line, so
+** that several patterns over the same directory only scan it once.
+*/
+typedef struct DirListing {
+    char *path;
+    char **names;
+    size_t num_names;
+} DirListing;
+
+typedef struct DirCache {
+    DirListing *listings;
+    size_t num_listings;
+} DirCache;
+
+typedef struct ArithExpr ArithExpr;
+typedef struct Filter Filter;
+typedef struct Function Function;
+typedef struct WatchSpec WatchSpec;
+
 typedef struct Command {
     char *exec_path;
     char **args;
@@ -84,8 +305,97 @@ typedef struct Command {
     char *redir_in_path;
     char *redir_out_path;
     uint8_t redir_append;
+    uint8_t memo;
+    char **memo_inputs;
+    WatchSpec *watch;
+    int64_t timeout_ns;         // 0 for no deadline
+    int64_t timeout_grace_ns;   // from SIGTERM to SIGKILL
 } Command;
 
+/*
+** A line of `;`, `&&` and `||` separated elements, each kept as text
+** until it runs. ops[i] joins elements[i] to the one before it.
+*/
+typedef struct CommandList {
+    int count;
+    char **elements;
+    uint8_t *ops;       // LIST_OP_*; ops[0] is LIST_OP_SEQ
+} CommandList;
+
+/*
+** Counters kept by the shell. With --metrics-shm this block is the
+** contents of a POSIX shared memory object (/cscshell.<pid> by default)
+** that other processes can map read-only while the shell runs. Every
+** field is only written by the shell, with relaxed atomic adds.
+**
+** Histogram bucket i counts durations of at most 2^i microseconds; the
+** last bucket counts everything longer.
+*/
+typedef struct MetricsHistogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+} MetricsHistogram;
+
+typedef struct MetricsBlock {
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    uint64_t lines_parsed;
+    uint64_t parse_errors;
+    uint64_t commands_spawned;
+    uint64_t path_cache_hits;
+    uint64_t path_cache_misses;
+    uint64_t bytes_redirected;
+    uint64_t stages_optimized;
+    MetricsHistogram fork_exec;
+    MetricsHistogram wait;
+} MetricsBlock;
+
+extern MetricsBlock *metrics;
+// Set when metrics are exported, so the costlier timings are taken
+extern bool metrics_timed;
+
+#define METRIC_ADD(block, field, n) \
+    __atomic_fetch_add(&(block).field, (n), __ATOMIC_RELAXED)
+
+/*
+** A line of commands that start_line has started and finish_line has
+** yet to wait for.
+*/
+typedef struct LineJob {
+    Command *head;
+    Command *tail;
+    int num_commands;
+    pid_t *pids;        // 0 for stages running as filters
+    Filter **filters;
+    off_t out_size;     // of the output file before the line ran
+    int64_t wait_start;
+    int64_t deadline;   // metrics_now() time to stop the line at, or 0
+    int64_t grace_ns;
+} LineJob;
+
+/*
+** Lines of a script read ahead of the one running, in a ring. Each is
+** parsed early when nothing before it can change the result.
+*/
+typedef struct LookaheadLine {
+    char text[MAX_SINGLE_LINE];
+    bool checked;
+    bool changes_state;
+    Command *prepared;  // NULL if the line must be parsed at its turn
+    uint64_t path_generation;   // when it was prepared
+} LookaheadLine;
+
+typedef struct Lookahead {
+    FILE *file;
+    Variable **root;
+    LookaheadLine lines[LOOKAHEAD_DEPTH];
+    int first;
+    int count;
+    bool eof;
+} Lookahead;
+
 
 /*
 ** The following functions are provided for you in _shell.c
@@ -115,6 +425,14 @@ typedef struct Command {
 */
 Command *parse_line(char *line, Variable **variables);
 
+/*
+** The second half of parse_line: parses a line whose variables have
+** already been replaced into a list of commands. line is not freed.
+**
+** Same return values as parse_line.
+*/
+Command *parse_expanded_line(char *line, Variable **variables);
+
 /*
 ** WARNING: this is a challenging string parsing task.
 **
@@ -125,7 +443,7 @@ Command *parse_line(char *line, Variable **variables);
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line,
-                                Variable *variables);
+                                Variable **variables);
 
 /*
 ** This function is provided for you and should not be modified.
@@ -153,6 +471,18 @@ int cd_cscshell(const char *target_dir);
 */
 char *resolve_executable(const char *command_name, Variable *path);
 
+// Bumped whenever the PATH cache is emptied, to tell stale parses apart
+extern uint64_t path_generation;
+
+/*
+** True if every command in head that was found by a PATH search would
+** still be found there: no directory of the PATH last searched, up to and
+** including its own, has changed since path_generation was generation. A
+** change means a command installed there may now come first, so it also
+** empties the PATH cache and bumps path_generation.
+*/
+bool path_lookups_current(const Command *head, uint64_t generation);
+
 /*
 ** Executes a single "line" of commands (through pipes)
 ** If a command fails, the rest of the line should not be executed.
@@ -166,15 +496,130 @@ char *resolve_executable(const char *command_name, Variable *path);
 */
 int *execute_line(Command *head);
 
+/*
+** The two halves of execute_line for a line that is not cd or memo:
+** start_line sets up the pipes and redirects and starts every command
+** without waiting, so the caller can read what they write meanwhile.
+** finish_line waits for them and frees the line.
+**
+** If notify_fd is not -1, every stage run as a filter adds 1 to that
+** eventfd when it is done, so an event loop can tell when finish_line
+** will not block; the other stages can be watched through their pids.
+**
+** start_line returns 0 on success or -1 on error, when it has already
+** stopped whatever it started and freed the line; finish_line has the
+** same return values as execute_line.
+*/
+int start_line(Command *head, LineJob *job, int notify_fd);
+int *finish_line(LineJob *job);
+
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
 **
 ** Parent process returns -1 on error.
-** Any child processes should not return.
+** Any child processes should not return; one that cannot exec exits
+** with EXEC_FAILED_STATUS.
 */
 int run_command(Command *command);
 
+/*
+** Parses and executes a single line.
+**
+** Returns the exit status of the line (0 if nothing was executed),
+** RUN_PARSE_FAILED if the line could not be parsed, or -1 if it
+** could not be executed and the shell needs to exit.
+*/
+int run_line(char *line, Variable **root);
+
+/*
+** run_line for lines typed at the prompt, parsed through the parse
+** cache (see parsecache.c).
+*/
+int run_cached_line(char *line, Variable **root);
+
+// The exit status of the last line run, which $? expands to
+extern int last_status;
+
+/*
+** True if line holds a `;`, `&&` or `||` outside any quotes or $(...).
+*/
+bool line_is_list(const char *line);
+
+/*
+** If pos starts a quoted string, a $(...) or a backslash escape, returns
+** its last character, or NULL if it is never closed. Otherwise returns
+** pos.
+*/
+const char *list_skip_quoted(const char *pos);
+
+/*
+** Splits line into the elements of its list (see list.c).
+**
+** Returns NULL if line is a single pipeline, or (CommandList *) -1 if
+** memory could not be allocated. If the list is malformed an error is
+** printed and the list returned is empty.
+*/
+CommandList *list_parse(const char *line);
+
+void list_free(CommandList *list);
+
+/*
+** Executes the result of parse_line (or parse_expanded_line).
+**
+** Same return values as run_line.
+*/
+int run_parsed_line(Command *commands);
+
+/*
+** Reads the next line of input into buf, fgets style. Used when a
+** construct spans several lines.
+*/
+typedef char *(*LineSource)(char *buf, int size, void *ctx);
+
+/*
+** Returns true if line opens a `for`, `while` or `if` block, or a
+** function definition `name() { ... }`.
+*/
+bool vm_starts_block(const char *line);
+
+/*
+** Compiles the block opened by first_line, reading the rest of it
+** from next_line, into bytecode and runs it. The statements of the
+** block are lexed once at compile time, and variable references are
+** resolved to slots, so loop iterations only substitute values.
+**
+** Returns the exit status of the block, 1 if it could not be
+** compiled, or -1 if the shell needs to exit.
+*/
+int vm_run_block(char *first_line, LineSource next_line, void *ctx,
+                 Variable **root);
+
+/*
+** Reads the rest of the block opened by first_line from next_line, as
+** vm_run_block would, without running it; for a client that has to
+** send a block whole. Returns 0, 1 if it does not compile (the input
+** may have ended first), or -1 on system errors.
+*/
+int vm_read_block(char *first_line, LineSource next_line, void *ctx);
+
+/*
+** Returns the function named by the first word of line, or NULL if there
+** is none or the line pipes or redirects (calls run in the shell itself).
+*/
+Function *vm_find_function(const char *line);
+
+/*
+** Calls function in the shell with the rest of line, which must already
+** be expanded, as $1..$N (and all of it as $@). Arguments and `local`
+** variables shadow globals until the call returns; other assignments
+** change the globals.
+**
+** Returns the status of the last command or of `return N`, or -1 if
+** the shell needs to exit.
+*/
+int vm_call(Function *function, const char *line, Variable **root);
+
 /*
 ** Executes an entire script line-by-line.
 ** Stops and indicates an error as soon as any line fails.
@@ -183,6 +628,396 @@ int run_command(Command *command);
 */
 int run_script(char *file_path, Variable **root);
 
+void lookahead_init(Lookahead *ahead, FILE *file, Variable **root);
+
+/*
+** True if line can change how the lines after it expand or resolve:
+** assignments, cd, function calls and the like. Lines after it are not
+** parsed early, neither before it runs nor while it does.
+*/
+bool changes_shell_state(const char *line);
+
+/*
+** Reads up to LOOKAHEAD_DEPTH lines past the current one and parses
+** those that are safe to parse early. Nothing is printed; a line that
+** fails is simply left for its turn.
+*/
+void lookahead_fill(Lookahead *ahead);
+
+/*
+** Takes the next script line, fgets style, from the lookahead window or
+** the file. *prepared gets its parsed commands if it was parsed early and
+** its PATH lookups still hold, otherwise NULL.
+*/
+char *lookahead_next(Lookahead *ahead, char *buf, int size,
+                     Command **prepared);
+
+/*
+** LineSource over a Lookahead, for blocks spanning several lines.
+*/
+char *lookahead_read(char *buf, int size, void *ahead);
+
+/*
+** Frees ahead and any lines it parsed that never ran.
+*/
+void lookahead_free(Lookahead *ahead);
+
+/*
+** Returns a filter that runs command (cat, head, tail, grep, wc, cut or
+** tr) on a thread, or NULL if it is not one of those or uses options the
+** builtin does not have. Returns (Filter *) -1 if allocation fails.
+** Regular file input is mapped rather than read, and cat and head hand
+** it to the output with sendfile (or splice from a pipe) where they can.
+*/
+Filter *filter_prepare(Command *command);
+
+/*
+** Joins two adjacent filters with a ring buffer.
+** Returns 0 on success, -1 on error.
+*/
+int filter_connect(Filter *from, Filter *to);
+
+/*
+** Sets the fds used on whichever sides are not rings. The filter closes
+** them (other than stdin and stdout) when it finishes.
+*/
+void filter_set_fds(Filter *filter, int in_fd, int out_fd);
+
+/*
+** Has the filter add 1 to the eventfd notify_fd when it finishes.
+*/
+void filter_set_notify(Filter *filter, int notify_fd);
+
+/*
+** Starts the filter's thread. Returns 0 on success, -1 on error.
+*/
+int filter_start(Filter *filter);
+
+/*
+** Waits for the filter, frees it and returns its exit status. Filters
+** must be waited for in pipeline order.
+*/
+int filter_wait(Filter *filter);
+
+/*
+** For a filter that was prepared but will never start: filter_abandon
+** ends its sides of any rings, so started neighbours finish, and
+** filter_discard frees it once those have been waited for. Neither
+** closes the fds it was given.
+*/
+void filter_abandon(Filter *filter);
+void filter_discard(Filter *filter);
+
+/*
+** Stamps the metrics block; call once at startup.
+*/
+void metrics_init();
+
+/*
+** Moves the metrics into a shared memory object called name, or
+** /cscshell.<pid> if name is NULL. Returns 0 on success, -1 on error.
+*/
+int metrics_open_shm(const char *name);
+
+/*
+** Writes the metrics in Prometheus text format to path every
+** interval_sec seconds (checked between lines) and at exit.
+*/
+void metrics_set_file(const char *path, int interval_sec);
+
+/*
+** Adds one duration to hist.
+*/
+void metrics_observe(MetricsHistogram *hist, int64_t ns);
+
+/*
+** Monotonic clock in nanoseconds.
+*/
+int64_t metrics_now();
+
+/*
+** Rewrites the metrics file if its interval has passed.
+*/
+void metrics_tick();
+
+/*
+** Writes the final metrics file and removes the shared memory object.
+*/
+void metrics_close();
+
+/*
+** Strips a leading `memo [-i FILE]...` prefix from line.
+**
+** Returns a pointer to the rest of the line and stores a heap,
+** NULL-terminated array of the declared input files in *inputs.
+** Returns NULL if line has no memo prefix (or the prefix is malformed,
+** after printing an error), or (char *) -1 if system calls fail.
+*/
+char *memo_parse_prefix(char *line, char ***inputs);
+
+/*
+** Runs a line marked with the memo prefix. The key is a hash of every
+** command's exec_path and args, the redirected input, the declared
+** inputs, the working directory and the environment the line would run
+** with. On a hit the
+** stored stdout and exit code are replayed without forking; on a miss
+** the line is executed and its output stored.
+**
+** Same return values as execute_line.
+*/
+int *memo_execute_line(Command *head);
+
+/*
+** Strips a leading `watch [-d MS] [-n RUNS] [-i PATH]...` prefix from
+** line, storing the options and the rest of the line, which is parsed
+** again for every run, in *spec.
+**
+** Returns a pointer to the rest of the line, or NULL if line has no
+** watch prefix. If the prefix is malformed, an error is printed and
+** *spec is left NULL. Returns (char *) -1 if system calls fail.
+*/
+char *watch_parse_prefix(char *line, Variable **variables, WatchSpec **spec);
+
+/*
+** Runs a line marked with the watch prefix, then runs it again each
+** time a watched path changes (see watch.c), until it has run RUNS
+** times or SIGINT arrives.
+**
+** Same return values as execute_line, for the last run.
+*/
+int *watch_execute_line(Command *head);
+
+/*
+** Strips a leading `timeout [-k GRACE] DURATION` prefix from line,
+** storing the deadline and grace period in nanoseconds. Without the
+** prefix, the CMD_TIMEOUT variable in variables, if set, is the
+** deadline.
+**
+** Returns a pointer to the rest of the line, or NULL if line has no
+** timeout prefix. If the prefix is malformed, an error is printed and
+** *timeout_ns is set to -1.
+*/
+char *timeout_parse_prefix(char *line, Variable *variables,
+                           int64_t *timeout_ns, int64_t *grace_ns);
+
+/*
+** Waits for the processes of a line with a deadline, sending them
+** SIGTERM at the deadline and SIGKILL a grace period later. They are
+** left for the caller to reap.
+**
+** Returns 1 if the line was signalled, 0 if it finished in time, or -1
+** if pidfds or timerfds are unavailable, leaving the line running.
+*/
+int timeout_wait(LineJob *job);
+
+// Cleared by --no-optimize and set by --dump-pipelines
+extern bool optimize_enabled;
+extern bool optimize_dump;
+
+/*
+** Removes the cat stages of a freshly parsed pipeline that only copy a
+** file into the next stage or the previous stage into a file, turning
+** them into redirects (see optimize.c).
+**
+** Returns the new first command of the pipeline.
+*/
+Command *optimize_pipeline(Command *head);
+
+/*
+** Frees what watch_parse_prefix stored; spec may be NULL.
+*/
+void watch_free(WatchSpec *spec);
+
+/*
+** Sets name to value in the variable list, adding a new variable at
+** the head of the list if it does not exist yet.
+**
+** Returns the variable, or NULL if memory could not be allocated.
+*/
+Variable *set_variable(Variable **variables, const char *name,
+                       const char *value);
+
+/*
+** Returns true if name is a legal variable name.
+*/
+bool valid_variable_name(const char *name);
+
+/*
+** The environment passed to children is the shell's startup environ
+** plus every exported variable. It is cached as a prebuilt envp array
+** and only rebuilt when env_mark_dirty has been called since the last
+** build, so launching a command costs nothing extra.
+*/
+void env_mark_dirty();
+
+/*
+** Rebuilds the cached envp from variables if it is out of date.
+** Returns 0 on success, -1 if memory could not be allocated.
+*/
+int env_refresh(Variable *variables);
+
+/*
+** Returns the envp array to pass to execve.
+*/
+char **env_current();
+
+/*
+** Returns a pointer to the "))" closing the $(( expression that
+** starts at expr_start, or NULL if it is not closed.
+*/
+const char *arith_find_end(const char *expr_start);
+
+/*
+** Parses the len chars of text as an arithmetic expression.
+**
+** Returns the parsed expression, to be released with arith_free,
+** NULL on syntax errors, or (ArithExpr *) -1 if system calls fail.
+*/
+ArithExpr *arith_compile(const char *text, size_t len);
+
+/*
+** Like arith_compile, but the result is kept in a cache keyed by
+** text and owned by it. Only valid until the next call.
+*/
+ArithExpr *arith_lookup(const char *text, size_t len);
+
+void arith_free(ArithExpr *expr);
+
+/*
+** Evaluates expr with 64-bit integers. Variables read as numbers, with
+** unset or empty ones reading 0; assignments (=, +=, ...) update the
+** variable list, adding new variables at its tail (or as its head, if it
+** is empty).
+**
+** Returns 0 on success, 1 on evaluation errors, -1 if system calls fail.
+*/
+int arith_eval(ArithExpr *expr, Variable **variables, int64_t *result);
+
+/*
+** Returns a pointer to the ')' closing the $( substitution whose command
+** starts at start, or NULL if it is not closed.
+*/
+const char *subst_find_end(const char *start);
+
+/*
+** Runs the len chars of text as a pipeline and returns what it wrote to
+** stdout, without trailing newlines, as a heap string. Pipelines of
+** builtin filters run without forking, and a plain `echo` without
+** running anything.
+**
+** Returns NULL if the pipeline could not be parsed (after printing an
+** error), or (char *) -1 if system calls fail.
+*/
+char *subst_run(const char *text, size_t len, Variable **variables);
+
+/*
+** Returns true if word contains any of '*', '?' or '['.
+*/
+bool glob_has_magic(const char *word);
+
+/*
+** Expands the glob pattern against the file system. Wildcards are
+** supported in the last path component; the directory part is taken
+** literally. Names starting with '.' only match an explicit '.'.
+**
+** On success *matches is a heap array of heap strings in byte order.
+** Returns the number of matches (0 if none), or -1 on system errors.
+*/
+int glob_expand(const char *pattern, DirCache *cache, char ***matches);
+
+/*
+** Frees every listing held by cache.
+*/
+void dir_cache_free(DirCache *cache);
+
+/*
+** Folds len bytes of data into an FNV-1a hash. Start from FNV_OFFSET.
+*/
+uint64_t fnv_bytes(uint64_t hash, const void *data, size_t len);
+
+/*
+** Restores the variable list saved for init_file by snapshot_save,
+** if the snapshot still matches the init file's mtime, size and hash.
+**
+** Returns 1 if *root was filled from the snapshot, 0 if there is no
+** valid snapshot (the init script must be run), -1 on system errors.
+*/
+int snapshot_load(const char *init_file, Variable **root);
+
+/*
+** Writes the variable list produced by init_file to a binary snapshot
+** next to it. Only done for init files made purely of assignments,
+** NAME=VALUE exports and comments, since skipping the script must not skip
+** any commands, nor freeze a value a bare `export NAME` inherited.
+** Failing to write the snapshot is not an error.
+*/
+void snapshot_save(const char *init_file, Variable *root);
+
+/*
+** Serves the shell over a Unix socket at socket_path (replacing a stale
+** socket left there) until SIGINT or SIGTERM, then removes it. Each
+** client passes its stdin, stdout and stderr with its first line and is
+** answered with one "STATUS\n" line per line, run_line style, or per
+** block, which comes whole: all its lines together. Lines of different
+** clients run concurrently.
+**
+** Returns 0 once stopped, or -1 if the socket could not be set up.
+*/
+int server_run(const char *socket_path, Variable **root);
+
+/*
+** Runs script_path (stdin if NULL) on the server at socket_path, a line
+** or a whole block at a time, stopping at a line that does not parse,
+** like run_script.
+**
+** Returns 0 on success, or -1 on errors.
+*/
+int server_connect(const char *socket_path, const char *script_path);
+
+/*
+** Starts recording every line the shell runs to path (see record.c for
+** the format). Returns 0 on success, or -1 if path cannot be written.
+*/
+int record_open(const char *path);
+
+/*
+** Bracket one top-level line, or block, and log it with its timings and
+** status. No-ops unless recording.
+*/
+void record_begin(const char *line);
+void record_end(int status);
+
+/*
+** Adds a line of commands about to run to the current record: the
+** expanded text and the executables it resolved to. The first call also
+** ends the record's parse phase.
+*/
+void record_commands(Command *head);
+
+/*
+** A LineSource that reads through another one, adding the lines a block
+** reads to the current record.
+*/
+typedef struct RecordSource {
+    LineSource next_line;
+    void *ctx;
+} RecordSource;
+char *record_read(char *buf, int size, void *ctx);
+
+/*
+** Flushes and closes the recording, if any.
+*/
+void record_close();
+
+/*
+** Runs the lines of a recording, sleeping until each one's original
+** start time if original_speed is set, and prints how long they took
+** against the recording and how many exit statuses differed.
+**
+** Returns 0 on success, or -1 on errors, including a bad recording.
+*/
+int replay_run(const char *path, bool original_speed, Variable **root);
+
 /*
 ** Implement the following function that frees all the
 ** heap memory associated with a particular command.
@@ -196,4 +1031,141 @@ void free_command(Command *command);
 ** list starting at var, else just var.
  */
 void free_variable(Variable *var, uint8_t recursive);
+/*
+** Writes the memstats table into buf: per source file, the number of
+** allocations made, those still live, their bytes and the peak of those
+** bytes. Untracked builds report only the allocator's bytes in use.
+**
+** Returns the length written, truncated to fit size.
+*/
+size_t mem_report(char *buf, size_t size);
+
+/*
+** Prints prompt and reads a line into line like fgets, newline and all,
+** with the line editor when stdin and stdout are a terminal (see
+** lineedit.c). Lines typed there are added to the history.
+**
+** Returns line, or NULL at end of input.
+*/
+char *line_edit(const char *prompt, char *line, int size);
+
+/*
+** Opens the history kept at path and path.idx, creating them if needed
+** (see history.c). Without it, lines are edited but not remembered.
+**
+** Returns 0 on success or -1 if the files cannot be used.
+*/
+int history_open(const char *path);
+void history_close();
+
+/*
+** Maps lines other sessions have added since.
+*/
+void history_refresh();
+
+size_t history_count();
+
+/*
+** Returns entry index, 0 being the oldest, and stores its length in
+** *len; it is not terminated. Returns NULL past the newest.
+*/
+const char *history_entry(size_t index, size_t *len);
+
+/*
+** Returns the index of the newest entry before index before that holds
+** query, or -1 if none does.
+*/
+long history_search(const char *query, size_t query_len, size_t before);
+
+/*
+** Appends line, unless it repeats the newest entry, compacting the files
+** once they pass HISTORY_MAX_BYTES.
+**
+** Returns 0 on success or -1 on failure.
+*/
+int history_add(const char *line, size_t len);
+
+// Bumped by every change to a variable, to tell stale parses apart
+extern uint64_t variables_generation;
+// Set while parsing a line whose result depends on more than its text
+// and the variables: a glob or a $(...)
+extern bool parse_cache_skip;
+
+/*
+** parse_line, answered from the cache when line was parsed before with
+** the same variables. The result is the caller's to free either way.
+*/
+Command *parse_cache_line(char *line, Variable **variables);
+
+/*
+** Writes the parsecache builtin's report: entries in use, hits, misses
+** and the hit rate.
+**
+** Returns the length written, truncated to fit size.
+*/
+size_t parse_cache_report(char *buf, size_t size);
+
+/*
+** Frees every cached parse.
+*/
+void parse_cache_free();
+
+/*
+** Writes the commands in the directories of path closest to name by
+** edit distance, at most SUGGEST_MAX of them, best first and joined by
+** sep (see suggest.c). Nothing is written for names with a slash.
+**
+** Returns the length written, truncated to fit size; 0 if none is close.
+*/
+size_t suggest_commands(const char *name, const char *path, const char *sep,
+                        char *buf, size_t size);
+
+/*
+** The modification time of each of the first max_dirs directories in path,
+** in order, with a zero time for a missing one. *num_dirs is set to how
+** many were read. Used to tell when a PATH directory's contents change.
+**
+** Returns a malloc'd array, or NULL if out of memory.
+*/
+struct timespec *path_dir_mtimes(const char *path, int max_dirs,
+                                 int *num_dirs);
+
+/*
+** Sets the PATH the suggest builtin looks in; called as the builtin is
+** parsed, since it runs where variables cannot be read.
+*/
+void suggest_set_path(const char *path);
+
+/*
+** Writes the suggest builtin's output for name: one candidate a line.
+**
+** Returns the length written, 0 if there are none.
+*/
+size_t suggest_builtin(const char *name, char *buf, size_t size);
+
+/*
+** Frees the index of PATH names.
+*/
+void suggest_free();
+
+/*
+** With MEMSTATS, the allocation functions are replaced by counting
+** versions for every file including this header (see mem.c).
+*/
+#ifdef MEMSTATS
+void *mem_malloc(size_t size, const char *file);
+void *mem_calloc(size_t count, size_t size, const char *file);
+void *mem_realloc(void *ptr, size_t size, const char *file);
+char *mem_strdup(const char *str, const char *file);
+char *mem_strndup(const char *str, size_t n, const char *file);
+void mem_free(void *ptr);
+
+#define malloc(size) mem_malloc((size), __FILE__)
+#define calloc(count, size) mem_calloc((count), (size), __FILE__)
+#define realloc(ptr, size) mem_realloc((ptr), (size), __FILE__)
+#define strdup(str) mem_strdup((str), __FILE__)
+#define strndup(str, n) mem_strndup((str), (n), __FILE__)
+#define free(ptr) mem_free(ptr)
+#endif
+
 #endif
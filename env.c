@@ -0,0 +1,84 @@
+#include "cscshell.h"
+
+extern char **environ;
+
+// envp_generation trails env_generation until the next rebuild
+static uint64_t env_generation = 1;
+static uint64_t envp_generation = 0;
+static char **envp_cache = NULL;
+static char *envp_strings = NULL;
+
+
+void env_mark_dirty(){
+    env_generation++;
+}
+
+
+// True if entry ("NAME=VALUE") is shadowed by an exported variable
+static bool env_shadowed(const char *entry, Variable *variables){
+    const char *equals = strchr(entry, '=');
+    size_t name_len = (equals != NULL) ? (size_t) (equals - entry)
+                                       : strlen(entry);
+    for (Variable *var = variables; var != NULL; var = var->next){
+        if (var->exported && strlen(var->name) == name_len &&
+            strncmp(var->name, entry, name_len) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int env_refresh(Variable *variables){
+    if (envp_generation == env_generation){
+        return 0;
+    }
+
+    size_t num_entries = 0, strings_size = 0;
+    for (char **entry = environ; *entry != NULL; entry++){
+        num_entries++;
+    }
+    for (Variable *var = variables; var != NULL; var = var->next){
+        if (var->exported){
+            num_entries++;
+            strings_size += strlen(var->name) + strlen(var->value) + 2;
+        }
+    }
+
+    char **envp = malloc((num_entries + 1) * sizeof(char *));
+    // one block for every "NAME=VALUE" we own
+    char *strings = malloc(strings_size + 1);
+    if (envp == NULL || strings == NULL){
+        perror("env_refresh");
+        free(envp);
+        free(strings);
+        return -1;
+    }
+
+    size_t i = 0;
+    for (char **entry = environ; *entry != NULL; entry++){
+        if (!env_shadowed(*entry, variables)){
+            envp[i++] = *entry;
+        }
+    }
+    char *pos = strings;
+    for (Variable *var = variables; var != NULL; var = var->next){
+        if (var->exported){
+            envp[i++] = pos;
+            pos += sprintf(pos, "%s=%s", var->name, var->value) + 1;
+        }
+    }
+    envp[i] = NULL;
+
+    free(envp_cache);
+    free(envp_strings);
+    envp_cache = envp;
+    envp_strings = strings;
+    envp_generation = env_generation;
+    return 0;
+}
+
+
+char **env_current(){
+    return (envp_cache != NULL) ? envp_cache : environ;
+}
@@ -0,0 +1,1369 @@
+#include "cscshell.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+/*
+** Single-producer/single-consumer byte ring joining two filter threads.
+** head and tail count every byte ever written and read (mod 2^32), so
+** head - tail is what is buffered. seq changes whenever anything else
+** does and is the futex word either side sleeps on.
+*/
+typedef struct Ring {
+    char *buf;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t seq;
+    uint32_t waiters;
+    uint32_t write_closed;
+    uint32_t read_closed;
+} Ring;
+
+typedef struct FieldRange {
+    long first;
+    long last;
+} FieldRange;
+
+struct Filter {
+    int (*run)(Filter *filter);
+    const char *name;
+    char **args;
+
+    // each side is a ring when the neighbour is a filter, else an fd
+    int in_fd;
+    int out_fd;
+    Ring *in_ring;
+    Ring *out_ring;
+
+    // in_buf is the whole file, mapped, when the input is a regular file
+    char *in_buf;
+    size_t in_capacity;
+    size_t in_start;
+    size_t in_end;
+    bool in_eof;
+    bool in_mapped;
+    bool map_tried;
+    char *out_buf;
+    size_t out_len;
+    bool out_failed;
+
+    // file operands (cat, or one for head, tail and wc)
+    char **files;
+    int num_files;
+    const char *in_name;    // the operand being read, for errors; "-" is stdin
+
+    // options, as each filter needs them
+    long count;
+    bool invert;
+    bool count_only;
+    bool suppress;
+    bool deleting;
+    int wc_flags;
+    char delim;
+    char *pattern;
+    size_t pattern_len;
+    uint8_t table[256];
+    FieldRange *ranges;
+    size_t num_ranges;
+
+    int status;
+    int notify_fd;  // an eventfd bumped once the filter is done, or -1
+    pthread_t thread;
+};
+
+#define WC_LINES 1
+#define WC_WORDS 2
+#define WC_BYTES 4
+
+
+static Ring *ring_new(){
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (ring == NULL){
+        return NULL;
+    }
+    ring->capacity = FILTER_RING_SIZE;
+    ring->buf = malloc(ring->capacity);
+    if (ring->buf == NULL){
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+
+static void ring_notify(Ring *ring){
+    __atomic_add_fetch(&ring->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) > 0){
+        syscall(SYS_futex, &ring->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+    }
+}
+
+
+// Sleeps until seq moves past seen; returns at once if it already has
+static void ring_wait(Ring *ring, uint32_t seen){
+    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ring->seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+
+// Returns -1 once the reader has gone, like EPIPE
+static int ring_write(Ring *ring, const char *data, size_t len){
+    while (len > 0){
+        uint32_t seen = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->read_closed, __ATOMIC_ACQUIRE)){
+            return -1;
+        }
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint32_t space = ring->capacity - (ring->head - tail);
+        if (space == 0){
+            ring_wait(ring, seen);
+            continue;
+        }
+
+        uint32_t n = (len < space) ? len : space;
+        uint32_t offset = ring->head & (ring->capacity - 1);
+        uint32_t first = ring->capacity - offset;
+        if (first > n) first = n;
+        memcpy(ring->buf + offset, data, first);
+        memcpy(ring->buf, data + first, n - first);
+        __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+        ring_notify(ring);
+
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Returns 0 at end of input
+static size_t ring_read(Ring *ring, char *data, size_t max){
+    for (;;){
+        uint32_t seen = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t avail = head - ring->tail;
+        if (avail == 0){
+            if (__atomic_load_n(&ring->write_closed, __ATOMIC_ACQUIRE)){
+                // the writer may have added more just before closing
+                if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+                    ring->tail){
+                    return 0;
+                }
+                continue;
+            }
+            ring_wait(ring, seen);
+            continue;
+        }
+
+        uint32_t n = (max < avail) ? max : avail;
+        uint32_t offset = ring->tail & (ring->capacity - 1);
+        uint32_t first = ring->capacity - offset;
+        if (first > n) first = n;
+        memcpy(data, ring->buf + offset, first);
+        memcpy(data + first, ring->buf, n - first);
+        __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+        ring_notify(ring);
+        return n;
+    }
+}
+
+
+static void ring_close(Ring *ring, uint32_t *side){
+    __atomic_store_n(side, 1, __ATOMIC_RELEASE);
+    ring_notify(ring);
+}
+
+
+static void ring_free(Ring *ring){
+    if (ring != NULL){
+        free(ring->buf);
+        free(ring);
+    }
+}
+
+
+/* ************************************************************** */
+/*                         Buffered input/output                  */
+/* ************************************************************** */
+
+// Maps a regular file input whole, so it is read without any copies
+static bool map_input(Filter *filter){
+    struct stat st;
+    if (filter->in_ring != NULL || fstat(filter->in_fd, &st) < 0 ||
+        !S_ISREG(st.st_mode) || st.st_size == 0){
+        return false;
+    }
+    off_t offset = lseek(filter->in_fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= st.st_size){
+        return false;
+    }
+    // private and writable, so filters like tr can work in place
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     filter->in_fd, 0);
+    if (map == MAP_FAILED){
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    free(filter->in_buf);
+    filter->in_buf = map;
+    filter->in_capacity = st.st_size;
+    filter->in_start = offset;
+    filter->in_end = st.st_size;
+    filter->in_eof = true;
+    filter->in_mapped = true;
+    return true;
+}
+
+
+// Forgets the current input, before switching to the next file operand
+static int reset_input(Filter *filter){
+    if (filter->in_mapped){
+        munmap(filter->in_buf, filter->in_capacity);
+        filter->in_mapped = false;
+        filter->in_capacity = FILTER_BUF_SIZE;
+        filter->in_buf = malloc(filter->in_capacity);
+        if (filter->in_buf == NULL){
+            perror("filter");
+            return -1;
+        }
+    }
+    filter->in_start = filter->in_end = 0;
+    filter->in_eof = false;
+    filter->map_tried = false;
+    return 0;
+}
+
+
+// Reads more input after in_end; returns 0 at end of input, -1 on error.
+// A read error is reported as the real program would.
+static ssize_t fill_input(Filter *filter){
+    if (!filter->map_tried){
+        filter->map_tried = true;
+        if (map_input(filter)){
+            return filter->in_end - filter->in_start;
+        }
+    }
+    if (filter->in_eof){
+        return 0;
+    }
+    if (filter->in_start > 0){
+        memmove(filter->in_buf, filter->in_buf + filter->in_start,
+                filter->in_end - filter->in_start);
+        filter->in_end -= filter->in_start;
+        filter->in_start = 0;
+    }
+    if (filter->in_end == filter->in_capacity){
+        char *grown = realloc(filter->in_buf, filter->in_capacity * 2);
+        if (grown == NULL){
+            perror("filter");
+            return -1;
+        }
+        filter->in_buf = grown;
+        filter->in_capacity *= 2;
+    }
+
+    char *dest = filter->in_buf + filter->in_end;
+    size_t room = filter->in_capacity - filter->in_end;
+    ssize_t num_read;
+    if (filter->in_ring != NULL){
+        num_read = ring_read(filter->in_ring, dest, room);
+    }
+    else {
+        while ((num_read = read(filter->in_fd, dest, room)) < 0 &&
+               errno == EINTR);
+    }
+    if (num_read <= 0){
+        filter->in_eof = true;
+        if (num_read < 0){
+            fprintf(stderr, "%s: %s: %s\n", filter->name, filter->in_name,
+                    strerror(errno));
+        }
+        return num_read;
+    }
+    filter->in_end += num_read;
+    return num_read;
+}
+
+
+// Points *line at the next line, newline included if it has one.
+// Returns its length, 0 at end of input, or -1 on error.
+static ssize_t next_line(Filter *filter, char **line){
+    size_t scanned = filter->in_start;
+    for (;;){
+        char *newline = memchr(filter->in_buf + scanned, '\n',
+                               filter->in_end - scanned);
+        if (newline != NULL){
+            *line = filter->in_buf + filter->in_start;
+            size_t len = newline + 1 - *line;
+            filter->in_start += len;
+            return len;
+        }
+        scanned = filter->in_end - filter->in_start;
+        ssize_t num_read = fill_input(filter);
+        if (num_read < 0){
+            return -1;
+        }
+        if (num_read == 0){
+            *line = filter->in_buf + filter->in_start;
+            size_t len = filter->in_end - filter->in_start;
+            filter->in_start = filter->in_end;
+            return len;
+        }
+        // fill_input moved the unread part to the front
+        scanned += filter->in_start;
+    }
+}
+
+
+static int write_output(Filter *filter, const char *data, size_t len){
+    if (filter->out_failed){
+        return -1;
+    }
+    if (filter->out_ring != NULL){
+        if (ring_write(filter->out_ring, data, len) < 0){
+            filter->out_failed = true;
+        }
+        return filter->out_failed ? -1 : 0;
+    }
+    while (len > 0){
+        ssize_t written = write(filter->out_fd, data, len);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            // EPIPE just means nobody wants the rest
+            if (errno != EPIPE) perror("filter");
+            filter->out_failed = true;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+static int flush_output(Filter *filter){
+    size_t len = filter->out_len;
+    filter->out_len = 0;
+    return write_output(filter, filter->out_buf, len);
+}
+
+
+static int emit(Filter *filter, const char *data, size_t len){
+    if (filter->out_len + len > FILTER_BUF_SIZE && flush_output(filter) < 0){
+        return -1;
+    }
+    // big pieces (a mapped file, say) go out without the extra copy
+    if (len >= FILTER_BUF_SIZE){
+        return write_output(filter, data, len);
+    }
+    memcpy(filter->out_buf + filter->out_len, data, len);
+    filter->out_len += len;
+    return filter->out_failed ? -1 : 0;
+}
+
+
+/* ************************************************************** */
+/*                       Newline search kernels                   */
+/* ************************************************************** */
+
+// Consumes up to *lines newlines of data, returning how many bytes that
+// took (len if it ran out first) and lowering *lines by the number seen
+static size_t skip_lines_scalar(const char *data, size_t len, long *lines){
+    const char *pos = data, *end = data + len;
+    while (*lines > 0 && (pos = memchr(pos, '\n', end - pos)) != NULL){
+        pos++;
+        (*lines)--;
+    }
+    return (*lines > 0) ? len : (size_t) (pos - data);
+}
+
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2,popcnt,bmi")))
+static size_t skip_lines_avx2(const char *data, size_t len, long *lines){
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len && *lines > 0; i += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        long found = __builtin_popcount(mask);
+        if (found < *lines){
+            *lines -= found;
+            continue;
+        }
+        // the one we want is in this block: drop the ones before it
+        for (long k = 1; k < *lines; k++){
+            mask &= mask - 1;
+        }
+        *lines = 0;
+        return i + __builtin_ctz(mask) + 1;
+    }
+    if (*lines == 0){
+        return i;
+    }
+    return i + skip_lines_scalar(data + i, len - i, lines);
+}
+#endif
+
+
+#ifdef HAVE_NEON_KERNELS
+static size_t skip_lines_neon(const char *data, size_t len, long *lines){
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len && *lines > 0; i += 16){
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) data + i), newline);
+        long found = vaddvq_u8(vshrq_n_u8(eq, 7));
+        if (found < *lines){
+            *lines -= found;
+            continue;
+        }
+        size_t used = skip_lines_scalar(data + i, 16, lines);
+        return i + used;
+    }
+    if (*lines == 0){
+        return i;
+    }
+    return i + skip_lines_scalar(data + i, len - i, lines);
+}
+#endif
+
+
+static size_t skip_lines(const char *data, size_t len, long *lines){
+    #ifdef HAVE_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2")){
+        return skip_lines_avx2(data, len, lines);
+    }
+    #endif
+    #ifdef HAVE_NEON_KERNELS
+    return skip_lines_neon(data, len, lines);
+    #endif
+    return skip_lines_scalar(data, len, lines);
+}
+
+
+static unsigned long count_newlines(const char *data, size_t len){
+    long lines = LONG_MAX;
+    skip_lines(data, len, &lines);
+    return LONG_MAX - lines;
+}
+
+
+/* ************************************************************** */
+/*                         Whole-file transfer                    */
+/* ************************************************************** */
+
+// Copies in_fd to out_fd inside the kernel: sendfile from a regular
+// file, splice from a pipe. Returns 0 when done, 1 if neither applies
+// (nothing has been copied then), -1 on error.
+static int transfer_input(Filter *filter){
+    struct stat st;
+    if (filter->in_ring != NULL || filter->out_ring != NULL ||
+        fstat(filter->in_fd, &st) < 0){
+        return 1;
+    }
+    if (flush_output(filter) < 0){
+        return -1;
+    }
+
+    bool copied = false;
+    for (;;){
+        ssize_t sent;
+        if (S_ISREG(st.st_mode)){
+            sent = sendfile(filter->out_fd, filter->in_fd, NULL,
+                            FILTER_TRANSFER_CHUNK);
+        }
+        else if (S_ISFIFO(st.st_mode)){
+            sent = splice(filter->in_fd, NULL, filter->out_fd, NULL,
+                          FILTER_TRANSFER_CHUNK, SPLICE_F_MOVE);
+        }
+        else {
+            return 1;
+        }
+
+        if (sent == 0){
+            return 0;
+        }
+        if (sent > 0){
+            copied = true;
+            continue;
+        }
+        if (errno == EINTR){
+            continue;
+        }
+        if (!copied && (errno == EINVAL || errno == ENOSYS)){
+            return 1;
+        }
+        if (errno != EPIPE){
+            perror("filter");
+        }
+        filter->out_failed = true;
+        return -1;
+    }
+}
+
+
+// Sends len bytes of a mapped input starting at offset, without copying
+// them through user space when the output is an fd
+static int send_range(Filter *filter, size_t offset, size_t len){
+    if (filter->in_mapped && filter->out_ring == NULL &&
+        flush_output(filter) == 0){
+        off_t pos = offset;
+        while (len > 0){
+            ssize_t sent = sendfile(filter->out_fd, filter->in_fd, &pos, len);
+            if (sent <= 0){
+                break;
+            }
+            offset += sent;
+            len -= sent;
+        }
+        if (len == 0){
+            return 0;
+        }
+    }
+    return emit(filter, filter->in_buf + offset, len);
+}
+
+
+// Opens the file operand named path in place of the current input.
+// Returns its fd, or -1 after reporting the error as name would.
+static int open_operand(Filter *filter, const char *name, const char *path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        fprintf(stderr, "%s: %s: %s\n", name, path, strerror(errno));
+        return -1;
+    }
+    if (reset_input(filter) < 0){
+        close(fd);
+        return -1;
+    }
+    filter->in_fd = fd;
+    filter->in_name = path;
+    return fd;
+}
+
+
+// Switches back to the filter's own input once a file operand is done
+static void close_operand(Filter *filter, int fd, int stdin_fd){
+    reset_input(filter);
+    close(fd);
+    filter->in_fd = stdin_fd;
+    filter->in_name = "-";
+}
+
+
+/* ************************************************************** */
+/*                             Filters                            */
+/* ************************************************************** */
+
+static int run_head(Filter *filter){
+    long remaining = filter->count;
+    while (remaining > 0){
+        if (filter->in_start == filter->in_end){
+            ssize_t num_read = fill_input(filter);
+            if (num_read < 0){
+                return 1;
+            }
+            if (num_read == 0){
+                break;
+            }
+        }
+        size_t start = filter->in_start;
+        size_t used = skip_lines(filter->in_buf + start,
+                                 filter->in_end - start, &remaining);
+        filter->in_start += used;
+        if (send_range(filter, start, used) < 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int run_cat(Filter *filter){
+    int status = 0;
+    int stdin_fd = filter->in_fd;
+    for (int i = 0; i < filter->num_files || i == 0; i++){
+        int fd = -1;
+        if (filter->num_files > 0 && strcmp(filter->files[i], "-") != 0){
+            fd = open_operand(filter, "cat", filter->files[i]);
+            if (fd < 0){
+                status = 1;
+                continue;
+            }
+        }
+
+        int transferred = transfer_input(filter);
+        ssize_t num_read = 0;
+        if (transferred > 0){
+            while ((num_read = fill_input(filter)) > 0){
+                size_t start = filter->in_start;
+                filter->in_start = filter->in_end;
+                if (send_range(filter, start, num_read) < 0){
+                    break;
+                }
+            }
+        }
+
+        if (fd >= 0){
+            close_operand(filter, fd, stdin_fd);
+        }
+        if (transferred < 0 || filter->out_failed){
+            return 1;
+        }
+        // a read error, already reported; the other operands still go
+        if (num_read < 0){
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+// The memstats builtin: the allocation counters, as a table
+static int run_memstats(Filter *filter){
+    char report[MEM_REPORT_SIZE];
+    size_t len = mem_report(report, sizeof(report));
+    return (emit(filter, report, len) < 0) ? 1 : 0;
+}
+
+
+// The parsecache builtin: how often interactive lines skipped parsing
+static int run_parsecache(Filter *filter){
+    char report[PARSE_CACHE_REPORT_SIZE];
+    size_t len = parse_cache_report(report, sizeof(report));
+    return (emit(filter, report, len) < 0) ? 1 : 0;
+}
+
+
+// The suggest builtin: the commands in PATH closest to its name. Like
+// grep, it fails when there is nothing to print.
+static int run_suggest(Filter *filter){
+    if (filter->args[1] == NULL || filter->args[2] != NULL){
+        fprintf(stderr, ERR_SUGGEST_USAGE);
+        return 2;
+    }
+    char report[SUGGEST_REPORT_SIZE];
+    size_t len = suggest_builtin(filter->args[1], report, sizeof(report));
+    if (len == 0){
+        return 1;
+    }
+    return (emit(filter, report, len) < 0) ? 1 : 0;
+}
+
+
+static int run_tail(Filter *filter){
+    if (filter->count == 0){
+        return 0;
+    }
+    // the last count lines, oldest at kept[next % count]
+    size_t capacity = 64;
+    char **kept = calloc(capacity, sizeof(char *));
+    size_t *lens = calloc(capacity, sizeof(size_t));
+    size_t num_kept = 0, next = 0;
+    int status = 1;
+    if (kept == NULL || lens == NULL){
+        perror("tail");
+        goto tail_done;
+    }
+
+    char *line;
+    ssize_t len;
+    while ((len = next_line(filter, &line)) > 0){
+        if (num_kept < (size_t) filter->count){
+            if (num_kept == capacity){
+                capacity *= 2;
+                char **grown_kept = realloc(kept, capacity * sizeof(char *));
+                if (grown_kept != NULL) kept = grown_kept;
+                size_t *grown_lens = realloc(lens, capacity * sizeof(size_t));
+                if (grown_lens != NULL) lens = grown_lens;
+                if (grown_kept == NULL || grown_lens == NULL){
+                    perror("tail");
+                    goto tail_done;
+                }
+            }
+            next = num_kept++;
+        }
+        else {
+            next = (next + 1) % num_kept;
+            free(kept[next]);
+        }
+        kept[next] = malloc(len);
+        if (kept[next] == NULL){
+            perror("tail");
+            goto tail_done;
+        }
+        memcpy(kept[next], line, len);
+        lens[next] = len;
+    }
+    if (len < 0){
+        goto tail_done;
+    }
+
+    status = 0;
+    for (size_t i = 1; i <= num_kept; i++){
+        size_t j = (next + i) % num_kept;
+        if (emit(filter, kept[j], lens[j]) < 0){
+            break;
+        }
+    }
+
+tail_done:
+    for (size_t i = 0; i < num_kept; i++){
+        free(kept[i]);
+    }
+    free(kept);
+    free(lens);
+    return status;
+}
+
+
+static int run_grep(Filter *filter){
+    long matches = 0;
+    char *line;
+    ssize_t len;
+    while ((len = next_line(filter, &line)) > 0){
+        size_t text_len = (line[len - 1] == '\n') ? len - 1 : len;
+        bool found = memmem(line, text_len, filter->pattern,
+                            filter->pattern_len) != NULL;
+        if (found == filter->invert){
+            continue;
+        }
+        matches++;
+        if (filter->count_only){
+            continue;
+        }
+        if (emit(filter, line, text_len) < 0 || emit(filter, "\n", 1) < 0){
+            break;
+        }
+    }
+    if (len < 0){
+        return 2;
+    }
+    if (filter->count_only){
+        char number[32];
+        int n = snprintf(number, sizeof(number), "%ld\n", matches);
+        emit(filter, number, n);
+    }
+    return (matches > 0) ? 0 : 1;
+}
+
+
+static int run_wc(Filter *filter){
+    unsigned long counts[3] = {0, 0, 0};
+    bool in_word = false;
+    ssize_t num_read = 0;
+
+    // regular files are sized, not read, for -c; their size also sets
+    // the column width, as it does for wc itself
+    struct stat st;
+    bool regular = filter->in_ring == NULL &&
+        fstat(filter->in_fd, &st) == 0 && S_ISREG(st.st_mode);
+    off_t offset = regular ? lseek(filter->in_fd, 0, SEEK_CUR) : -1;
+    if (filter->wc_flags == WC_BYTES && offset >= 0){
+        counts[2] = (st.st_size > offset) ? st.st_size - offset : 0;
+    }
+    else while ((num_read = fill_input(filter)) > 0){
+        const char *data = filter->in_buf + filter->in_start;
+        size_t len = filter->in_end - filter->in_start;
+        counts[2] += len;
+        filter->in_start = filter->in_end;
+
+        if (filter->wc_flags == WC_BYTES){
+            continue;
+        }
+        if (filter->wc_flags == WC_LINES){
+            counts[0] += count_newlines(data, len);
+            continue;
+        }
+        for (size_t i = 0; i < len; i++){
+            if (data[i] == '\n'){
+                counts[0]++;
+            }
+            bool space = isspace((unsigned char) data[i]);
+            if (!space && !in_word){
+                counts[1]++;
+            }
+            in_word = !space;
+        }
+    }
+    if (num_read < 0){
+        return 1;
+    }
+
+    // one count is printed bare, several line up in columns
+    int flags = filter->wc_flags;
+    int width = 1;
+    if (flags & (flags - 1)){
+        width = 7;
+        if (regular){
+            width = snprintf(NULL, 0, "%lld", (long long) st.st_size);
+        }
+    }
+    char out[MAX_PATH_STR + 128];
+    int n = 0;
+    for (int i = 0; i < 3; i++){
+        if (flags & (1 << i)){
+            n += snprintf(out + n, sizeof(out) - n, "%s%*lu",
+                          (n > 0) ? " " : "", width, counts[i]);
+        }
+    }
+    if (filter->num_files > 0){
+        n += snprintf(out + n, sizeof(out) - n, " %s", filter->files[0]);
+    }
+    n += snprintf(out + n, sizeof(out) - n, "\n");
+    emit(filter, out, n);
+    return 0;
+}
+
+
+static bool field_selected(Filter *filter, long field){
+    for (size_t i = 0; i < filter->num_ranges; i++){
+        if (filter->ranges[i].first <= field && field <= filter->ranges[i].last){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int run_cut(Filter *filter){
+    char *line;
+    ssize_t len;
+    while ((len = next_line(filter, &line)) > 0){
+        size_t text_len = (line[len - 1] == '\n') ? len - 1 : len;
+        if (memchr(line, filter->delim, text_len) == NULL){
+            if (!filter->suppress &&
+                (emit(filter, line, text_len) < 0 || emit(filter, "\n", 1) < 0)){
+                break;
+            }
+            continue;
+        }
+
+        bool first_out = true;
+        long field = 1;
+        const char *start = line, *end = line + text_len;
+        while (start <= end){
+            const char *stop = memchr(start, filter->delim, end - start);
+            if (stop == NULL) stop = end;
+            if (field_selected(filter, field)){
+                if (!first_out) emit(filter, &filter->delim, 1);
+                emit(filter, start, stop - start);
+                first_out = false;
+            }
+            start = stop + 1;
+            field++;
+        }
+        if (emit(filter, "\n", 1) < 0){
+            break;
+        }
+    }
+    return (len < 0) ? 1 : 0;
+}
+
+
+static int run_tr(Filter *filter){
+    ssize_t num_read;
+    while ((num_read = fill_input(filter)) > 0){
+        char *data = filter->in_buf + filter->in_start;
+        size_t len = filter->in_end - filter->in_start;
+        size_t out_len = 0;
+        for (size_t i = 0; i < len; i++){
+            unsigned char c = data[i];
+            if (filter->deleting){
+                if (!filter->table[c]) data[out_len++] = c;
+            }
+            else {
+                data[out_len++] = filter->table[c];
+            }
+        }
+        filter->in_start = filter->in_end;
+        if (emit(filter, data, out_len) < 0){
+            break;
+        }
+    }
+    return (num_read < 0) ? 1 : 0;
+}
+
+
+/* ************************************************************** */
+/*                         Argument parsing                       */
+/* ************************************************************** */
+
+// A plain decimal count. "+N" (tail from line N), "-N" (head all but the
+// last N) and anything else strtol would take are left to the real
+// program.
+static bool parse_count(const char *text, long *count){
+    if (!isdigit((unsigned char) text[0])){
+        return false;
+    }
+    char *end;
+    errno = 0;
+    *count = strtol(text, &end, 10);
+    return errno == 0 && end != text && *end == '\0' && *count >= 0;
+}
+
+
+// Sets files to the rest of args if there is at most max of them
+static bool take_operands(Filter *filter, char **args, int max){
+    filter->files = args;
+    while (args[filter->num_files] != NULL){
+        filter->num_files++;
+    }
+    return filter->num_files <= max;
+}
+
+
+// Accepts "-n N", "-nN" or "-N", then at most one file
+static bool parse_line_count(Filter *filter, char **args){
+    filter->count = 10;
+    if (args[0] != NULL && strcmp(args[0], "-n") == 0){
+        if (args[1] == NULL || !parse_count(args[1], &filter->count)){
+            return false;
+        }
+        args += 2;
+    }
+    else if (args[0] != NULL && strncmp(args[0], "-n", 2) == 0){
+        if (!parse_count(args[0] + 2, &filter->count)){
+            return false;
+        }
+        args++;
+    }
+    else if (args[0] != NULL && args[0][0] == '-' && args[0][1] != '\0'){
+        if (!parse_count(args[0] + 1, &filter->count)){
+            return false;
+        }
+        args++;
+    }
+    return take_operands(filter, args, 1);
+}
+
+
+// memstats and parsecache take no arguments, and ignore any they are
+// given; suggest checks its own
+static bool parse_no_args(Filter *filter, char **args){
+    return true;
+}
+
+
+// Takes no options; every argument is a file, "-" being stdin
+static bool parse_cat(Filter *filter, char **args){
+    for (char **arg = args; *arg != NULL; arg++){
+        if ((*arg)[0] == '-' && (*arg)[1] != '\0'){
+            return false;
+        }
+    }
+    return take_operands(filter, args, INT_MAX);
+}
+
+
+static bool parse_grep(Filter *filter, char **args){
+    bool fixed = false;
+    for (; *args != NULL && (*args)[0] == '-' && (*args)[1] != '\0'; args++){
+        for (const char *c = *args + 1; *c != '\0'; c++){
+            if (*c == 'F') fixed = true;
+            else if (*c == 'v') filter->invert = true;
+            else if (*c == 'c') filter->count_only = true;
+            else return false;
+        }
+    }
+    // one pattern and no files
+    if (args[0] == NULL || args[1] != NULL){
+        return false;
+    }
+    // without -F, only patterns that mean the same as a fixed string
+    if (!fixed && strpbrk(args[0], ".[]*^$\\") != NULL){
+        return false;
+    }
+    filter->pattern = args[0];
+    filter->pattern_len = strlen(args[0]);
+    return filter->pattern_len > 0;
+}
+
+
+static bool parse_wc(Filter *filter, char **args){
+    for (; *args != NULL && (*args)[0] == '-' && (*args)[1] != '\0'; args++){
+        for (const char *c = *args + 1; *c != '\0'; c++){
+            if (*c == 'l') filter->wc_flags |= WC_LINES;
+            else if (*c == 'w') filter->wc_flags |= WC_WORDS;
+            else if (*c == 'c') filter->wc_flags |= WC_BYTES;
+            else return false;
+        }
+    }
+    if (filter->wc_flags == 0){
+        filter->wc_flags = WC_LINES | WC_WORDS | WC_BYTES;
+    }
+    return take_operands(filter, args, 1);
+}
+
+
+static bool parse_field_list(Filter *filter, const char *list){
+    size_t capacity = 4;
+    filter->ranges = malloc(capacity * sizeof(FieldRange));
+    if (filter->ranges == NULL){
+        return false;
+    }
+    while (*list != '\0'){
+        FieldRange range = {1, LONG_MAX};
+        char *end;
+        if (*list != '-'){
+            range.first = strtol(list, &end, 10);
+            if (end == list || range.first < 1) return false;
+            list = end;
+            range.last = range.first;
+        }
+        if (*list == '-'){
+            list++;
+            range.last = LONG_MAX;
+            if (isdigit((unsigned char) *list)){
+                range.last = strtol(list, &end, 10);
+                list = end;
+            }
+            if (range.last < range.first) return false;
+        }
+        if (*list == ','){
+            list++;
+        }
+        else if (*list != '\0'){
+            return false;
+        }
+
+        if (filter->num_ranges == capacity){
+            capacity *= 2;
+            FieldRange *grown = realloc(filter->ranges,
+                                        capacity * sizeof(FieldRange));
+            if (grown == NULL) return false;
+            filter->ranges = grown;
+        }
+        filter->ranges[filter->num_ranges++] = range;
+    }
+    return filter->num_ranges > 0;
+}
+
+
+static bool parse_cut(Filter *filter, char **args){
+    const char *fields = NULL;
+    filter->delim = '\t';
+    for (; *args != NULL; args++){
+        char *arg = *args;
+        if (strncmp(arg, "-d", 2) == 0){
+            const char *delim = (arg[2] != '\0') ? arg + 2 : *++args;
+            if (delim == NULL || strlen(delim) != 1) return false;
+            filter->delim = delim[0];
+        }
+        else if (strncmp(arg, "-f", 2) == 0){
+            fields = (arg[2] != '\0') ? arg + 2 : *++args;
+            if (fields == NULL) return false;
+        }
+        else if (strcmp(arg, "-s") == 0){
+            filter->suppress = true;
+        }
+        else {
+            return false;
+        }
+    }
+    return fields != NULL && parse_field_list(filter, fields);
+}
+
+
+// Expands a tr set (characters, \n-style escapes and a-z ranges) into
+// set; returns its length or -1 for anything we leave to tr itself
+static int expand_tr_set(const char *text, unsigned char *set){
+    int len = 0;
+    while (*text != '\0'){
+        unsigned char c = *text++;
+        if (c == '[' || (c == '\\' && *text == '\0')){
+            return -1;
+        }
+        if (c == '\\'){
+            switch (*text++){
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '\\': c = '\\'; break;
+                case '-': c = '-'; break;
+                default: return -1;
+            }
+        }
+        if (text[0] == '-' && text[1] != '\0'){
+            unsigned char last = text[1];
+            if (last == '\\' || last < c) return -1;
+            text += 2;
+            for (int r = c; r <= last; r++){
+                if (len == 256) return -1;
+                set[len++] = r;
+            }
+            continue;
+        }
+        if (len == 256) return -1;
+        set[len++] = c;
+    }
+    return len;
+}
+
+
+static bool parse_tr(Filter *filter, char **args){
+    unsigned char from[256], to[256];
+    if (args[0] != NULL && strcmp(args[0], "-d") == 0){
+        if (args[1] == NULL || args[2] != NULL) return false;
+        int from_len = expand_tr_set(args[1], from);
+        if (from_len < 0) return false;
+        filter->deleting = true;
+        for (int i = 0; i < from_len; i++){
+            filter->table[from[i]] = 1;
+        }
+        return true;
+    }
+
+    if (args[0] == NULL || args[1] == NULL || args[2] != NULL ||
+        args[0][0] == '-'){
+        return false;
+    }
+    int from_len = expand_tr_set(args[0], from);
+    int to_len = expand_tr_set(args[1], to);
+    if (from_len < 0 || to_len <= 0){
+        return false;
+    }
+    for (int i = 0; i < 256; i++){
+        filter->table[i] = i;
+    }
+    // a short second set repeats its last character
+    for (int i = 0; i < from_len; i++){
+        filter->table[from[i]] = to[(i < to_len) ? i : to_len - 1];
+    }
+    return true;
+}
+
+
+typedef struct FilterSpec {
+    const char *name;
+    bool (*parse)(Filter *filter, char **args);
+    int (*run)(Filter *filter);
+} FilterSpec;
+
+static const FilterSpec filter_specs[] = {
+    {"cat", parse_cat, run_cat},
+    {"head", parse_line_count, run_head},
+    {"tail", parse_line_count, run_tail},
+    {"grep", parse_grep, run_grep},
+    {"wc", parse_wc, run_wc},
+    {"cut", parse_cut, run_cut},
+    {"tr", parse_tr, run_tr},
+    {MEMSTATS_BUILTIN, parse_no_args, run_memstats},
+    {PARSE_CACHE_BUILTIN, parse_no_args, run_parsecache},
+    {SUGGEST_BUILTIN, parse_no_args, run_suggest},
+};
+
+
+// The filters stand in for the system's own programs only; one of the
+// same name anywhere else may do something else entirely
+static const char *const filter_system_dirs[] = {"/bin", "/usr/bin"};
+
+
+// True if exec_path is a builtin's bare name, or name in a system directory
+static bool replaces_system_program(const char *exec_path, const char *name){
+    size_t dir_len = name - exec_path;
+    if (dir_len == 0){
+        return true;
+    }
+    while (dir_len > 1 && exec_path[dir_len - 1] == '/'){
+        dir_len--;
+    }
+    size_t num_dirs = sizeof(filter_system_dirs) / sizeof(filter_system_dirs[0]);
+    for (size_t i = 0; i < num_dirs; i++){
+        if (strlen(filter_system_dirs[i]) == dir_len &&
+            strncmp(exec_path, filter_system_dirs[i], dir_len) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void filter_free(Filter *filter){
+    free(filter->ranges);
+    if (filter->in_mapped){
+        munmap(filter->in_buf, filter->in_capacity);
+    }
+    else {
+        free(filter->in_buf);
+    }
+    free(filter->out_buf);
+    free(filter);
+}
+
+
+Filter *filter_prepare(Command *command){
+    const char *slash = strrchr(command->exec_path, '/');
+    const char *name = (slash != NULL) ? slash + 1 : command->exec_path;
+
+    const FilterSpec *spec = NULL;
+    for (size_t i = 0; i < sizeof(filter_specs) / sizeof(filter_specs[0]); i++){
+        if (strcmp(name, filter_specs[i].name) == 0){
+            spec = &filter_specs[i];
+            break;
+        }
+    }
+    if (spec == NULL || !replaces_system_program(command->exec_path, name)){
+        return NULL;
+    }
+
+    Filter *filter = calloc(1, sizeof(Filter));
+    if (filter == NULL){
+        perror("filter_prepare");
+        return (Filter *) -1;
+    }
+    filter->run = spec->run;
+    filter->name = spec->name;
+    filter->args = command->args;
+    filter->in_fd = STDIN_FILENO;
+    filter->in_name = "-";
+    filter->out_fd = STDOUT_FILENO;
+    filter->notify_fd = -1;
+    // options we do not handle leave the command to the real program
+    if (!spec->parse(filter, command->args + 1)){
+        filter_free(filter);
+        return NULL;
+    }
+
+    filter->in_capacity = FILTER_BUF_SIZE;
+    filter->in_buf = malloc(filter->in_capacity);
+    filter->out_buf = malloc(FILTER_BUF_SIZE);
+    if (filter->in_buf == NULL || filter->out_buf == NULL){
+        perror("filter_prepare");
+        filter_free(filter);
+        return (Filter *) -1;
+    }
+    return filter;
+}
+
+
+int filter_connect(Filter *from, Filter *to){
+    Ring *ring = ring_new();
+    if (ring == NULL){
+        perror("filter_connect");
+        return -1;
+    }
+    from->out_ring = ring;
+    to->in_ring = ring;
+    return 0;
+}
+
+
+void filter_set_fds(Filter *filter, int in_fd, int out_fd){
+    filter->in_fd = in_fd;
+    filter->out_fd = out_fd;
+}
+
+
+void filter_set_notify(Filter *filter, int notify_fd){
+    filter->notify_fd = notify_fd;
+}
+
+
+static void *filter_thread(void *arg){
+    Filter *filter = arg;
+
+    // a closed pipe should end this filter, not the shell
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    // cat walks its own list of files; the rest take at most one
+    int stdin_fd = filter->in_fd;
+    int fd = -1;
+    if (filter->num_files == 1 && filter->run != run_cat){
+        fd = open_operand(filter, filter->name, filter->files[0]);
+    }
+    if (filter->num_files == 1 && filter->run != run_cat && fd < 0){
+        filter->status = 1;
+    }
+    else {
+        filter->status = filter->run(filter);
+    }
+    flush_output(filter);
+
+    if (fd >= 0){
+        close_operand(filter, fd, stdin_fd);
+    }
+    // leave a mapped input where a program reading it would have
+    else if (filter->in_mapped){
+        lseek(filter->in_fd, filter->in_start, SEEK_SET);
+    }
+
+    // closing the input tells an upstream writer to stop early
+    if (filter->in_ring != NULL){
+        ring_close(filter->in_ring, &filter->in_ring->read_closed);
+    }
+    else if (filter->in_fd != STDIN_FILENO){
+        close(filter->in_fd);
+    }
+    if (filter->out_ring != NULL){
+        ring_close(filter->out_ring, &filter->out_ring->write_closed);
+    }
+    else if (filter->out_fd != STDOUT_FILENO){
+        close(filter->out_fd);
+    }
+    if (filter->notify_fd >= 0){
+        uint64_t done = 1;
+        if (write(filter->notify_fd, &done, sizeof(done)) < 0){
+            perror("filter");
+        }
+    }
+    return NULL;
+}
+
+
+int filter_start(Filter *filter){
+    int error = pthread_create(&filter->thread, NULL, filter_thread, filter);
+    if (error != 0){
+        errno = error;
+        perror("filter_start");
+        return -1;
+    }
+    return 0;
+}
+
+
+int filter_wait(Filter *filter){
+    pthread_join(filter->thread, NULL);
+    // the writer on the other side of in_ring was joined before us
+    ring_free(filter->in_ring);
+    int status = filter->status;
+    filter_free(filter);
+    return status;
+}
+
+
+void filter_abandon(Filter *filter){
+    // a started writer sees the reader go, a started reader the end
+    if (filter->in_ring != NULL){
+        ring_close(filter->in_ring, &filter->in_ring->read_closed);
+    }
+    if (filter->out_ring != NULL){
+        ring_close(filter->out_ring, &filter->out_ring->write_closed);
+    }
+}
+
+
+void filter_discard(Filter *filter){
+    ring_free(filter->in_ring);
+    filter_free(filter);
+}
@@ -0,0 +1,337 @@
+#include "cscshell.h"
+
+#include <sys/syscall.h>
+
+// buckets smaller than this are finished with insertion sort
+#define RADIX_CUTOFF 32
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+
+bool glob_has_magic(const char *word){
+    return strpbrk(word, GLOB_MAGIC_CHARS) != NULL;
+}
+
+
+// Matches one [...] class at *pat against c, advancing *pat past it.
+// Returns -1 if the class is unterminated, so '[' is taken literally.
+static int match_class(const char **pat, unsigned char c){
+    const char *p = *pat + 1;
+    bool negate = false, matched = false;
+
+    if (*p == '!' || *p == '^'){
+        negate = true;
+        p++;
+    }
+    // a ']' right after the opening bracket is a literal
+    const char *first = p;
+    while (*p != '\0' && (*p != ']' || p == first)){
+        unsigned char low = *p, high = *p;
+        if (p[1] == '-' && p[2] != '\0' && p[2] != ']'){
+            high = p[2];
+            p += 2;
+        }
+        if (low <= c && c <= high){
+            matched = true;
+        }
+        p++;
+    }
+    if (*p != ']'){
+        return -1;
+    }
+    *pat = p + 1;
+    return matched != negate;
+}
+
+
+static bool glob_match(const char *pat, const char *name){
+    const char *star_pat = NULL, *star_name = NULL;
+
+    // names starting with '.' must be matched explicitly
+    if (name[0] == '.' && pat[0] != '.'){
+        return false;
+    }
+
+    while (*name != '\0'){
+        if (*pat == '*'){
+            star_pat = ++pat;
+            star_name = name;
+            continue;
+        }
+
+        bool matched;
+        const char *next_pat = pat + 1;
+        if (*pat == '?'){
+            matched = true;
+        }
+        else if (*pat == '['){
+            const char *class_end = pat;
+            int result = match_class(&class_end, (unsigned char) *name);
+            if (result < 0){
+                matched = (*name == '[');
+            }
+            else {
+                matched = result;
+                next_pat = class_end;
+            }
+        }
+        else {
+            matched = (*pat != '\0' && *pat == *name);
+        }
+
+        if (matched){
+            pat = next_pat;
+            name++;
+        }
+        else if (star_pat != NULL){
+            // let the last '*' swallow one more character
+            pat = star_pat;
+            name = ++star_name;
+        }
+        else {
+            return false;
+        }
+    }
+
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
+
+
+static void insertion_sort(char **strs, size_t n, size_t depth){
+    for (size_t i = 1; i < n; i++){
+        char *key = strs[i];
+        size_t j = i;
+        while (j > 0 && strcmp(strs[j-1] + depth, key + depth) > 0){
+            strs[j] = strs[j-1];
+            j--;
+        }
+        strs[j] = key;
+    }
+}
+
+
+// MSD radix sort in byte order; every string in strs shares its first
+// depth bytes, none of which are the terminator.
+static void radix_sort(char **strs, char **aux, size_t n, size_t depth){
+    if (n < RADIX_CUTOFF){
+        insertion_sort(strs, n, depth);
+        return;
+    }
+
+    size_t count[256 + 1] = {0};
+    for (size_t i = 0; i < n; i++){
+        count[(unsigned char) strs[i][depth] + 1]++;
+    }
+    for (int b = 0; b < 256; b++){
+        count[b + 1] += count[b];
+    }
+    // count[b] is now where bucket b starts
+    size_t starts[256];
+    memcpy(starts, count, sizeof(starts));
+    for (size_t i = 0; i < n; i++){
+        aux[count[(unsigned char) strs[i][depth]]++] = strs[i];
+    }
+    memcpy(strs, aux, n * sizeof(char *));
+
+    // bucket 0 holds strings that ended here, already in order
+    for (int b = 1; b < 256; b++){
+        size_t bucket_len = count[b] - starts[b];
+        if (bucket_len > 1){
+            radix_sort(strs + starts[b], aux, bucket_len, depth + 1);
+        }
+    }
+}
+
+
+static void free_names(char **names, size_t num_names){
+    for (size_t i = 0; i < num_names; i++){
+        free(names[i]);
+    }
+    free(names);
+}
+
+
+// Reads every name in dir_path with getdents64
+static int read_dir_names(const char *dir_path, DirListing *listing){
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0){
+        return (errno == ENOENT || errno == ENOTDIR || errno == EACCES) ? 0 : -1;
+    }
+
+    char *buf = malloc(GETDENTS_BUF_SIZE);
+    size_t capacity = 64;
+    char **names = malloc(capacity * sizeof(char *));
+    size_t num_names = 0;
+    if (buf == NULL || names == NULL){
+        goto read_dir_error;
+    }
+
+    long num_read;
+    while ((num_read = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE)) > 0){
+        for (long pos = 0; pos < num_read;){
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *) (buf + pos);
+            pos += dirent->d_reclen;
+
+            if (strcmp(dirent->d_name, ".") == 0 ||
+                strcmp(dirent->d_name, "..") == 0){
+                continue;
+            }
+            if (num_names == capacity){
+                capacity *= 2;
+                char **grown = realloc(names, capacity * sizeof(char *));
+                if (grown == NULL){
+                    goto read_dir_error;
+                }
+                names = grown;
+            }
+            names[num_names] = strdup(dirent->d_name);
+            if (names[num_names] == NULL){
+                goto read_dir_error;
+            }
+            num_names++;
+        }
+    }
+    if (num_read < 0){
+        goto read_dir_error;
+    }
+
+    free(buf);
+    close(fd);
+    listing->names = names;
+    listing->num_names = num_names;
+    return 0;
+
+read_dir_error:
+    perror("glob_expand");
+    if (names != NULL){
+        free_names(names, num_names);
+    }
+    free(buf);
+    close(fd);
+    return -1;
+}
+
+
+// Returns the cached listing of dir_path, reading it on first use
+static DirListing *dir_cache_get(DirCache *cache, const char *dir_path){
+    for (size_t i = 0; i < cache->num_listings; i++){
+        if (strcmp(cache->listings[i].path, dir_path) == 0){
+            return &cache->listings[i];
+        }
+    }
+
+    DirListing *grown = realloc(cache->listings,
+        (cache->num_listings + 1) * sizeof(DirListing));
+    if (grown == NULL){
+        perror("glob_expand");
+        return NULL;
+    }
+    cache->listings = grown;
+
+    DirListing *listing = &cache->listings[cache->num_listings];
+    listing->names = NULL;
+    listing->num_names = 0;
+    listing->path = strdup(dir_path);
+    if (listing->path == NULL){
+        perror("glob_expand");
+        return NULL;
+    }
+    if (read_dir_names(dir_path, listing) < 0){
+        free(listing->path);
+        return NULL;
+    }
+    cache->num_listings++;
+    return listing;
+}
+
+
+int glob_expand(const char *pattern, DirCache *cache, char ***matches){
+    const char *slash = strrchr(pattern, '/');
+    const char *base = (slash != NULL) ? slash + 1 : pattern;
+    size_t prefix_len = base - pattern;
+
+    char dir_path[MAX_PATH_STR];
+    if (slash == NULL){
+        strcpy(dir_path, ".");
+    }
+    else if (slash == pattern){
+        strcpy(dir_path, "/");
+    }
+    else if (prefix_len < MAX_PATH_STR){
+        memcpy(dir_path, pattern, prefix_len - 1);
+        dir_path[prefix_len - 1] = '\0';
+    }
+    else {
+        return 0;
+    }
+
+    // only the last component may hold wildcards
+    if (glob_has_magic(dir_path) || !glob_has_magic(base)){
+        return 0;
+    }
+
+    DirListing *listing = dir_cache_get(cache, dir_path);
+    if (listing == NULL){
+        return -1;
+    }
+
+    char **found = malloc((listing->num_names + 1) * sizeof(char *));
+    if (found == NULL){
+        perror("glob_expand");
+        return -1;
+    }
+    size_t num_found = 0;
+    for (size_t i = 0; i < listing->num_names; i++){
+        if (glob_match(base, listing->names[i])){
+            found[num_found++] = listing->names[i];
+        }
+    }
+    if (num_found == 0){
+        free(found);
+        return 0;
+    }
+
+    char **aux = malloc(num_found * sizeof(char *));
+    if (aux == NULL){
+        perror("glob_expand");
+        free(found);
+        return -1;
+    }
+    radix_sort(found, aux, num_found, 0);
+    free(aux);
+
+    // found still points into the listing, give the caller its own copies
+    for (size_t i = 0; i < num_found; i++){
+        size_t name_len = strlen(found[i]);
+        char *match = malloc(prefix_len + name_len + 1);
+        if (match == NULL){
+            perror("glob_expand");
+            free_names(found, i);
+            return -1;
+        }
+        memcpy(match, pattern, prefix_len);
+        memcpy(match + prefix_len, found[i], name_len + 1);
+        found[i] = match;
+    }
+
+    *matches = found;
+    return (int) num_found;
+}
+
+
+void dir_cache_free(DirCache *cache){
+    for (size_t i = 0; i < cache->num_listings; i++){
+        free(cache->listings[i].path);
+        free_names(cache->listings[i].names, cache->listings[i].num_names);
+    }
+    free(cache->listings);
+    cache->listings = NULL;
+    cache->num_listings = 0;
+}
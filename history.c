@@ -0,0 +1,446 @@
+#include "cscshell.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/*
+** Interactive history, kept in two append-only files that every session
+** maps read-only:
+**
+**   FILE        the lines themselves, one per line, readable with cat
+**   FILE.idx    a header, then one HistoryRecord per line: where it is
+**               in FILE, its length and a signature of the character
+**               pairs and triples in it
+**
+** Opening the history maps both files and reads only the header, so it
+** costs the same for ten lines as for ten million. Reverse search scans
+** the index backwards and only compares the text of lines whose
+** signature has every bit of the query's. The signature is 64 *
+** HISTORY_SIGNATURE_WORDS bits wide, so a typical line sets only a
+** fraction of them and a query of a few characters rules out nearly
+** every line that lacks it. An index written by an older version is
+** rebuilt from FILE when it is opened.
+**
+** Lines are appended under an flock of the index, so sessions share one
+** history. Once FILE passes HISTORY_MAX_BYTES the newest lines, up to
+** HISTORY_KEEP_BYTES, are copied into new files that are renamed over
+** the old ones; other sessions notice the new inode and reopen.
+*/
+
+typedef struct HistoryRecord {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t signature[HISTORY_SIGNATURE_WORDS];
+} HistoryRecord;
+
+typedef struct HistoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} HistoryHeader;
+
+static struct {
+    char *text_path;
+    char *index_path;
+    int text_fd;
+    int index_fd;
+    const char *text;
+    size_t text_size;
+    const HistoryRecord *records;
+    size_t index_size;      // mapped bytes of the index, header included
+    size_t count;
+} history = {.text_fd = -1, .index_fd = -1};
+
+
+static void set_signature_bit(uint64_t *signature, uint32_t gram){
+    // Fibonacci hashing: the top bits of the product pick the bit
+    uint32_t bit = (gram * 2654435761u) >>
+        (32 - __builtin_ctz(64 * HISTORY_SIGNATURE_WORDS));
+    signature[bit / 64] |= 1ull << (bit % 64);
+}
+
+
+// One bit per pair and one per triple of adjacent characters
+static void make_signature(const char *text, size_t len, uint64_t *signature){
+    memset(signature, 0, HISTORY_SIGNATURE_WORDS * sizeof(uint64_t));
+    const unsigned char *c = (const unsigned char *) text;
+    for (size_t i = 1; i < len; i++){
+        uint32_t pair = (uint32_t) c[i - 1] << 8 | c[i];
+        set_signature_bit(signature, pair);
+        if (i >= 2){
+            // the top byte keeps triples apart from pairs
+            set_signature_bit(signature,
+                              1u << 24 | (uint32_t) c[i - 2] << 16 | pair);
+        }
+    }
+}
+
+
+static bool has_signature(const HistoryRecord *record, const uint64_t *signature){
+    for (int i = 0; i < HISTORY_SIGNATURE_WORDS; i++){
+        if ((record->signature[i] & signature[i]) != signature[i]){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void unmap(){
+    if (history.text != NULL){
+        munmap((void *) history.text, history.text_size);
+    }
+    if (history.records != NULL){
+        munmap((void *) ((const char *) history.records - sizeof(HistoryHeader)),
+               history.index_size);
+    }
+    history.text = NULL;
+    history.records = NULL;
+    history.text_size = 0;
+    history.index_size = 0;
+    history.count = 0;
+}
+
+
+static void close_files(){
+    unmap();
+    if (history.text_fd >= 0) close(history.text_fd);
+    if (history.index_fd >= 0) close(history.index_fd);
+    history.text_fd = -1;
+    history.index_fd = -1;
+}
+
+
+// A new file at path, private like the history itself
+static FILE *tmp_file(const char *path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *file = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (fd >= 0 && file == NULL){
+        close(fd);
+    }
+    return file;
+}
+
+
+static bool write_header(FILE *index){
+    HistoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.record_size = sizeof(HistoryRecord);
+    return fwrite(&header, sizeof(header), 1, index) == 1;
+}
+
+
+// Writes an index of every line in the text file and renames it over the
+// old one, which an older version wrote. Called with the index locked.
+static int reindex(){
+    size_t path_len = strlen(history.index_path) + strlen(HISTORY_TMP_SUFFIX) + 1;
+    char index_tmp[path_len];
+    sprintf(index_tmp, "%s%s", history.index_path, HISTORY_TMP_SUFFIX);
+    FILE *text = fopen(history.text_path, "re");
+    FILE *index = tmp_file(index_tmp);
+    bool failed = (text == NULL || index == NULL || !write_header(index));
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    uint64_t offset = 0;
+    while (!failed && (len = getline(&line, &size, text)) > 0){
+        // a line cut short by a crash gets no record
+        if (line[len - 1] != '\n'){
+            break;
+        }
+        HistoryRecord record = {.offset = offset, .len = len - 1};
+        make_signature(line, len - 1, record.signature);
+        failed = fwrite(&record, sizeof(record), 1, index) != 1;
+        offset += len;
+    }
+    free(line);
+    if (text != NULL) fclose(text);
+    if (index != NULL && fclose(index) != 0) failed = true;
+
+    if (failed || rename(index_tmp, history.index_path) < 0){
+        perror("history");
+        unlink(index_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Opens both files, writing the index header if the index is new
+static int open_files(){
+    history.text_fd = open(history.text_path,
+                           O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    history.index_fd = open(history.index_path,
+                            O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history.text_fd < 0 || history.index_fd < 0){
+        close_files();
+        return -1;
+    }
+
+    HistoryHeader header;
+    flock(history.index_fd, LOCK_EX);
+    ssize_t num_read = pread(history.index_fd, &header, sizeof(header), 0);
+    int error = 0;
+    bool outdated = false;
+    if (num_read == 0){
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+        header.version = HISTORY_VERSION;
+        header.record_size = sizeof(HistoryRecord);
+        if (write(history.index_fd, &header, sizeof(header)) != sizeof(header)){
+            error = -1;
+        }
+    }
+    else if (num_read != sizeof(header) ||
+             memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)) != 0 ||
+             header.version > HISTORY_VERSION ||
+             (header.version == HISTORY_VERSION &&
+              header.record_size != sizeof(HistoryRecord))){
+        ERR_PRINT(ERR_HISTORY_FORMAT, history.index_path);
+        error = -1;
+    }
+    else if (header.version < HISTORY_VERSION){
+        outdated = true;
+        error = reindex();
+    }
+    flock(history.index_fd, LOCK_UN);
+    if (error < 0 || outdated){
+        close_files();
+    }
+    // the new index replaced the one we had open
+    return (error == 0 && outdated) ? open_files() : error;
+}
+
+
+// True if path no longer names the file open as fd
+static bool replaced(const char *path, int fd){
+    struct stat path_st, fd_st;
+    return stat(path, &path_st) != 0 || fstat(fd, &fd_st) != 0 ||
+           path_st.st_ino != fd_st.st_ino || path_st.st_dev != fd_st.st_dev;
+}
+
+
+// Maps whatever the files hold now. Called with the index locked.
+static int map_files(){
+    struct stat text_st, index_st;
+    if (fstat(history.text_fd, &text_st) < 0 ||
+        fstat(history.index_fd, &index_st) < 0){
+        return -1;
+    }
+    if ((size_t) text_st.st_size == history.text_size &&
+        (size_t) index_st.st_size == history.index_size){
+        return 0;
+    }
+    unmap();
+
+    // a record cut short by a crash is left out
+    size_t count = 0;
+    if ((size_t) index_st.st_size > sizeof(HistoryHeader)){
+        count = ((size_t) index_st.st_size - sizeof(HistoryHeader)) /
+                sizeof(HistoryRecord);
+    }
+    if (text_st.st_size > 0 && count > 0){
+        void *text = mmap(NULL, text_st.st_size, PROT_READ, MAP_SHARED,
+                          history.text_fd, 0);
+        void *index = mmap(NULL, index_st.st_size, PROT_READ, MAP_SHARED,
+                           history.index_fd, 0);
+        if (text == MAP_FAILED || index == MAP_FAILED){
+            if (text != MAP_FAILED) munmap(text, text_st.st_size);
+            if (index != MAP_FAILED) munmap(index, index_st.st_size);
+            return -1;
+        }
+        history.text = text;
+        history.text_size = text_st.st_size;
+        history.records = (const HistoryRecord *)
+            ((const char *) index + sizeof(HistoryHeader));
+        history.index_size = index_st.st_size;
+        history.count = count;
+    }
+    return 0;
+}
+
+
+// Locks the index of the files at the history's paths, reopening them
+// if another session has compacted them
+static int lock(int operation){
+    while (history.index_fd >= 0){
+        if (flock(history.index_fd, operation) < 0){
+            return -1;
+        }
+        if (!replaced(history.index_path, history.index_fd) &&
+            !replaced(history.text_path, history.text_fd)){
+            return 0;
+        }
+        close_files();
+        if (open_files() < 0){
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+int history_open(const char *path){
+    history.text_path = strdup(path);
+    history.index_path = malloc(strlen(path) + strlen(HISTORY_INDEX_SUFFIX) + 1);
+    if (history.text_path == NULL || history.index_path == NULL){
+        perror("history_open");
+        history_close();
+        return -1;
+    }
+    sprintf(history.index_path, "%s%s", path, HISTORY_INDEX_SUFFIX);
+    if (open_files() < 0){
+        history_close();
+        return -1;
+    }
+    history_refresh();
+    return 0;
+}
+
+
+void history_close(){
+    close_files();
+    free(history.text_path);
+    free(history.index_path);
+    history.text_path = NULL;
+    history.index_path = NULL;
+}
+
+
+void history_refresh(){
+    if (lock(LOCK_SH) == 0){
+        map_files();
+        flock(history.index_fd, LOCK_UN);
+    }
+}
+
+
+size_t history_count(){
+    return history.count;
+}
+
+
+const char *history_entry(size_t index, size_t *len){
+    if (index >= history.count){
+        return NULL;
+    }
+    const HistoryRecord *record = &history.records[index];
+    // the index may be ahead of, or after a crash beyond, the text
+    if (record->offset + record->len > history.text_size){
+        *len = 0;
+        return "";
+    }
+    *len = record->len;
+    return history.text + record->offset;
+}
+
+
+long history_search(const char *query, size_t query_len, size_t before){
+    uint64_t signature[HISTORY_SIGNATURE_WORDS];
+    make_signature(query, query_len, signature);
+    if (before > history.count){
+        before = history.count;
+    }
+    for (size_t i = before; i-- > 0; ){
+        const HistoryRecord *record = &history.records[i];
+        if (record->len < query_len || !has_signature(record, signature)){
+            continue;
+        }
+        size_t len = 0;
+        const char *text = history_entry(i, &len);
+        if (memmem(text, len, query, query_len) != NULL){
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+
+// Copies the newest lines, up to HISTORY_KEEP_BYTES of them, into new
+// files and renames those over the old ones. Called with the index locked.
+static void compact(){
+    size_t first = history.count;
+    size_t kept = 0;
+    while (first > 0){
+        size_t len = 0;
+        history_entry(first - 1, &len);
+        if (kept + len + 1 > HISTORY_KEEP_BYTES){
+            break;
+        }
+        kept += len + 1;
+        first--;
+    }
+
+    size_t path_len = strlen(history.index_path) + strlen(HISTORY_TMP_SUFFIX) + 1;
+    char text_tmp[path_len], index_tmp[path_len];
+    sprintf(text_tmp, "%s%s", history.text_path, HISTORY_TMP_SUFFIX);
+    sprintf(index_tmp, "%s%s", history.index_path, HISTORY_TMP_SUFFIX);
+    FILE *text = tmp_file(text_tmp);
+    FILE *index = tmp_file(index_tmp);
+    bool failed = (text == NULL || index == NULL);
+
+    failed = failed || !write_header(index);
+
+    uint64_t offset = 0;
+    for (size_t i = first; !failed && i < history.count; i++){
+        size_t len = 0;
+        const char *line = history_entry(i, &len);
+        HistoryRecord record = history.records[i];
+        record.offset = offset;
+        failed = fwrite(line, 1, len, text) != len || fputc('\n', text) == EOF ||
+                 fwrite(&record, sizeof(record), 1, index) != 1;
+        offset += len + 1;
+    }
+    if (text != NULL && fclose(text) != 0) failed = true;
+    if (index != NULL && fclose(index) != 0) failed = true;
+
+    // the text first: until the index follows, readers see old offsets
+    // into new text, which history_entry bounds
+    if (failed || rename(text_tmp, history.text_path) < 0 ||
+        rename(index_tmp, history.index_path) < 0){
+        perror("history");
+        unlink(text_tmp);
+        unlink(index_tmp);
+    }
+}
+
+
+int history_add(const char *line, size_t len){
+    if (len == 0 || lock(LOCK_EX) < 0){
+        return -1;
+    }
+    map_files();
+
+    // the same line twice in a row is kept once
+    size_t last_len;
+    const char *last = history_entry(history.count - 1, &last_len);
+    int error = 0;
+    if (last == NULL || last_len != len || memcmp(last, line, len) != 0){
+        struct stat text_st;
+        HistoryRecord record = {.len = len};
+        make_signature(line, len, record.signature);
+        error = fstat(history.text_fd, &text_st);
+        record.offset = text_st.st_size;
+        struct iovec parts[2] = {{(void *) line, len}, {"\n", 1}};
+        if (error == 0 && writev(history.text_fd, parts, 2) != (ssize_t) len + 1){
+            error = -1;
+        }
+        if (error == 0 &&
+            write(history.index_fd, &record, sizeof(record)) != sizeof(record)){
+            error = -1;
+        }
+        if (error == 0 && record.offset + len + 1 > HISTORY_MAX_BYTES){
+            map_files();
+            compact();
+        }
+    }
+    flock(history.index_fd, LOCK_UN);
+    // our own line, or the compacted files
+    history_refresh();
+    return error;
+}
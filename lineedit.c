@@ -0,0 +1,458 @@
+#include "cscshell.h"
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+/*
+** The line editor of the interactive prompt. The terminal is in raw
+** mode only while a line is being typed, so commands run with it as
+** they expect. Keys:
+**
+**   Left/Right, Ctrl-B/F     move a character     Home/End, Ctrl-A/E
+**   Backspace, Delete/Ctrl-D delete a character   Ctrl-K/U  kill to end/start
+**   Ctrl-W                   delete a word        Ctrl-L    clear the screen
+**   Up/Down, Ctrl-P/N        walk the history     Ctrl-C    drop the line
+**   Ctrl-R                   reverse search: type to narrow, Ctrl-R again
+**                            for older matches, Enter to run, Ctrl-G to leave
+**
+** Ctrl-D on an empty line is end of input. Lines wider than the terminal
+** scroll sideways. Without a terminal on both ends, lines are read with
+** fgets as before.
+*/
+
+enum {
+    KEY_CTRL_A = 1, KEY_CTRL_B = 2, KEY_CTRL_C = 3, KEY_CTRL_D = 4,
+    KEY_CTRL_E = 5, KEY_CTRL_F = 6, KEY_CTRL_G = 7, KEY_CTRL_H = 8,
+    KEY_TAB = 9, KEY_NEWLINE = 10, KEY_CTRL_K = 11, KEY_CTRL_L = 12, KEY_ENTER = 13,
+    KEY_CTRL_N = 14, KEY_CTRL_P = 16, KEY_CTRL_R = 18, KEY_CTRL_U = 21,
+    KEY_CTRL_W = 23, KEY_ESC = 27, KEY_BACKSPACE = 127,
+    // escape sequences, decoded
+    KEY_UP = 1000, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END,
+    KEY_DELETE,
+};
+
+typedef struct Editor {
+    const char *prompt;
+    char *buf;
+    size_t size;        // of buf, terminator included
+    size_t len;
+    size_t pos;
+    size_t history_pos; // history_count() while on the line being typed
+    char *typed;        // that line, kept while walking the history
+    bool searching;
+    bool failing;       // the query matches nothing before match
+    char query[MAX_SINGLE_LINE];
+    size_t query_len;
+    long match;
+} Editor;
+
+static struct termios cooked;
+static bool raw_mode = false;
+
+
+static void leave_raw_mode(){
+    if (raw_mode){
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+        raw_mode = false;
+    }
+}
+
+
+static int enter_raw_mode(){
+    static bool restore_registered = false;
+    if (tcgetattr(STDIN_FILENO, &cooked) < 0){
+        return -1;
+    }
+    if (!restore_registered){
+        atexit(leave_raw_mode);
+        restore_registered = true;
+    }
+    struct termios raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~OPOST;
+    raw.c_cflag |= CS8;
+    // Ctrl-C and Ctrl-Z are keys while editing
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0){
+        return -1;
+    }
+    raw_mode = true;
+    return 0;
+}
+
+
+static int columns(){
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0){
+        return 80;
+    }
+    return ws.ws_col;
+}
+
+
+// Screen columns taken by len bytes of UTF-8 text
+static size_t width(const char *text, size_t len){
+    size_t cols = 0;
+    for (size_t i = 0; i < len; i++){
+        if (((unsigned char) text[i] & 0xC0) != 0x80) cols++;
+    }
+    return cols;
+}
+
+
+static size_t prev_char(const Editor *ed, size_t pos){
+    while (pos > 0 && ((unsigned char) ed->buf[--pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+
+static size_t next_char(const Editor *ed, size_t pos){
+    while (pos < ed->len && ((unsigned char) ed->buf[++pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+
+// Reads one key, decoding the escape sequences of arrows and such
+static int read_key(){
+    unsigned char c;
+    ssize_t num_read;
+    while ((num_read = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+    if (num_read <= 0){
+        return -1;
+    }
+    if (c != KEY_ESC){
+        return c;
+    }
+
+    // a lone Escape sends nothing more
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    unsigned char seq[3];
+    if (poll(&pfd, 1, LINE_EDIT_ESC_MS) <= 0 || read(STDIN_FILENO, seq, 1) != 1 ||
+        poll(&pfd, 1, LINE_EDIT_ESC_MS) <= 0 || read(STDIN_FILENO, seq + 1, 1) != 1){
+        return KEY_ESC;
+    }
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9'){
+        if (read(STDIN_FILENO, seq + 2, 1) != 1 || seq[2] != '~'){
+            return KEY_ESC;
+        }
+        switch (seq[1]){
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '3': return KEY_DELETE;
+        }
+        return KEY_ESC;
+    }
+    if (seq[0] == '[' || seq[0] == 'O'){
+        switch (seq[1]){
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        }
+    }
+    return KEY_ESC;
+}
+
+
+// Redraws the line: prompt, then as much of the text as fits with the
+// cursor in view
+static void refresh(const Editor *ed){
+    char out[MAX_SINGLE_LINE * 2 + MAX_PATH_STR + 64];
+    size_t out_len = 0;
+    const char *prompt = ed->prompt;
+    char search_prompt[MAX_SINGLE_LINE + 32];
+    if (ed->searching){
+        snprintf(search_prompt, sizeof(search_prompt),
+                 ed->failing ? LINE_EDIT_FAILED_PROMPT : LINE_EDIT_SEARCH_PROMPT,
+                 (int) ed->query_len, ed->query);
+        prompt = search_prompt;
+    }
+
+    size_t prompt_cols = width(prompt, strlen(prompt));
+    size_t cols = columns();
+    const char *text = ed->buf;
+    size_t len = ed->len;
+    size_t pos = ed->pos;
+    // scroll so that the cursor stays on screen
+    while (prompt_cols + width(text, pos) >= cols && pos > 0){
+        size_t skip = 1;
+        while (skip < pos && ((unsigned char) text[skip] & 0xC0) == 0x80) skip++;
+        text += skip;
+        len -= skip;
+        pos -= skip;
+    }
+    size_t shown = len;
+    while (prompt_cols + width(text, shown) > cols && shown > pos){
+        shown--;
+    }
+
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "\r%s%.*s\x1b[0K\r",
+                        prompt, (int) shown, text);
+    size_t cursor = prompt_cols + width(text, pos);
+    if (cursor > 0 && out_len < sizeof(out)){
+        out_len += snprintf(out + out_len, sizeof(out) - out_len, "\x1b[%zuC",
+                            cursor);
+    }
+    if (out_len > sizeof(out)) out_len = sizeof(out);
+    if (write(STDOUT_FILENO, out, out_len) < 0){
+        // nothing to be done about a terminal that went away
+    }
+}
+
+
+static void set_text(Editor *ed, const char *text, size_t len){
+    if (len > ed->size - 1){
+        len = ed->size - 1;
+    }
+    memcpy(ed->buf, text, len);
+    ed->buf[len] = '\0';
+    ed->len = len;
+    ed->pos = len;
+}
+
+
+static void insert(Editor *ed, const char *text, size_t len){
+    if (ed->len + len > ed->size - 1){
+        return;
+    }
+    memmove(ed->buf + ed->pos + len, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    memcpy(ed->buf + ed->pos, text, len);
+    ed->len += len;
+    ed->pos += len;
+}
+
+
+// Removes the bytes from start to end
+static void erase(Editor *ed, size_t start, size_t end){
+    memmove(ed->buf + start, ed->buf + end, ed->len - end + 1);
+    ed->len -= end - start;
+    ed->pos = start;
+}
+
+
+// Moves to history entry index; history_count() is the typed line
+static void show_history(Editor *ed, size_t index){
+    size_t count = history_count();
+    if (index > count || index == ed->history_pos){
+        return;
+    }
+    if (ed->history_pos == count){
+        free(ed->typed);
+        ed->typed = strndup(ed->buf, ed->len);
+    }
+    ed->history_pos = index;
+    if (index == count){
+        set_text(ed, ed->typed != NULL ? ed->typed : "",
+                 ed->typed != NULL ? strlen(ed->typed) : 0);
+        return;
+    }
+    size_t len;
+    const char *entry = history_entry(index, &len);
+    set_text(ed, entry, len);
+}
+
+
+// Finds the newest match of the query older than before
+static void search(Editor *ed, size_t before){
+    long match = history_search(ed->query, ed->query_len, before);
+    ed->failing = (match < 0);
+    if (match < 0){
+        return;
+    }
+    ed->match = match;
+    size_t len;
+    const char *entry = history_entry(match, &len);
+    set_text(ed, entry, len);
+    const char *found = memmem(entry, len, ed->query, ed->query_len);
+    ed->pos = (found != NULL) ? (size_t) (found - entry) : len;
+}
+
+
+// Handles a key in reverse search. Returns true if it is used up, false
+// if it ends the search and is to be handled as a normal key.
+static bool search_key(Editor *ed, int key){
+    switch (key){
+    case KEY_CTRL_R:
+        search(ed, ed->match >= 0 ? (size_t) ed->match : history_count());
+        return true;
+    case KEY_BACKSPACE:
+    case KEY_CTRL_H:
+        if (ed->query_len > 0){
+            ed->query_len--;
+            ed->match = -1;
+            search(ed, history_count());
+        }
+        return true;
+    case KEY_CTRL_G:
+    case KEY_CTRL_C:
+        // back to the line as it was before the search
+        ed->searching = false;
+        set_text(ed, ed->typed != NULL ? ed->typed : "",
+                 ed->typed != NULL ? strlen(ed->typed) : 0);
+        return true;
+    }
+    if (key >= ' ' && key != KEY_BACKSPACE && key < 0x100){
+        if (ed->query_len < sizeof(ed->query) - 1){
+            ed->query[ed->query_len++] = key;
+            // the current match may still do
+            search(ed, ed->match >= 0 ? (size_t) ed->match + 1 : history_count());
+        }
+        return true;
+    }
+    ed->searching = false;
+    return false;
+}
+
+
+// Edits a line in raw mode; returns its length, or -1 at end of input
+static ssize_t edit(Editor *ed){
+    refresh(ed);
+    while (true){
+        int key = read_key();
+        if (key < 0){
+            return -1;
+        }
+        if (ed->searching && search_key(ed, key)){
+            refresh(ed);
+            continue;
+        }
+
+        switch (key){
+        case KEY_ENTER:
+        // keys typed ahead of raw mode had their Enter made a newline
+        case KEY_NEWLINE:
+            return ed->len;
+        case KEY_CTRL_C:
+            // drop the line and start another
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0) {}
+            set_text(ed, "", 0);
+            ed->history_pos = history_count();
+            break;
+        case KEY_CTRL_D:
+            if (ed->len == 0){
+                return -1;
+            }
+            // fall through
+        case KEY_DELETE:
+            if (ed->pos < ed->len){
+                size_t end = next_char(ed, ed->pos);
+                erase(ed, ed->pos, end);
+            }
+            break;
+        case KEY_BACKSPACE:
+        case KEY_CTRL_H:
+            if (ed->pos > 0){
+                erase(ed, prev_char(ed, ed->pos), ed->pos);
+            }
+            break;
+        case KEY_LEFT:
+        case KEY_CTRL_B:
+            ed->pos = prev_char(ed, ed->pos);
+            break;
+        case KEY_RIGHT:
+        case KEY_CTRL_F:
+            ed->pos = next_char(ed, ed->pos);
+            break;
+        case KEY_HOME:
+        case KEY_CTRL_A:
+            ed->pos = 0;
+            break;
+        case KEY_END:
+        case KEY_CTRL_E:
+            ed->pos = ed->len;
+            break;
+        case KEY_CTRL_K:
+            ed->buf[ed->pos] = '\0';
+            ed->len = ed->pos;
+            break;
+        case KEY_CTRL_U:
+            erase(ed, 0, ed->pos);
+            break;
+        case KEY_CTRL_W: {
+            size_t start = ed->pos;
+            while (start > 0 && ed->buf[start - 1] == ' ') start--;
+            while (start > 0 && ed->buf[start - 1] != ' ') start--;
+            erase(ed, start, ed->pos);
+            break;
+        }
+        case KEY_CTRL_L:
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0) {}
+            break;
+        case KEY_UP:
+        case KEY_CTRL_P:
+            if (ed->history_pos > 0){
+                show_history(ed, ed->history_pos - 1);
+            }
+            break;
+        case KEY_DOWN:
+        case KEY_CTRL_N:
+            show_history(ed, ed->history_pos + 1);
+            break;
+        case KEY_CTRL_R:
+            free(ed->typed);
+            ed->typed = strndup(ed->buf, ed->len);
+            ed->searching = true;
+            ed->failing = false;
+            ed->query_len = 0;
+            ed->match = -1;
+            break;
+        case KEY_TAB:
+            insert(ed, " ", 1);
+            break;
+        default:
+            if (key >= ' ' && key != KEY_BACKSPACE && key < 0x100){
+                char c = key;
+                insert(ed, &c, 1);
+            }
+            break;
+        }
+        refresh(ed);
+    }
+}
+
+
+char *line_edit(const char *prompt, char *line, int size){
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)){
+        printf("%s", prompt);
+        return fgets(line, size, stdin);
+    }
+
+    fflush(stdout);
+    history_refresh();
+    Editor ed = {
+        .prompt = prompt,
+        .buf = line,
+        // room for the newline fgets would have kept
+        .size = size - 1,
+        .history_pos = history_count(),
+        .match = -1,
+    };
+    line[0] = '\0';
+    if (enter_raw_mode() < 0){
+        printf("%s", prompt);
+        return fgets(line, size, stdin);
+    }
+    ssize_t len = edit(&ed);
+    leave_raw_mode();
+    free(ed.typed);
+    if (len < 0){
+        return NULL;
+    }
+
+    // show the line as run, then leave it
+    ed.searching = false;
+    ed.pos = ed.len;
+    refresh(&ed);
+    printf("\n");
+    if (len > 0 && line[strspn(line, " \t")] != '\0'){
+        history_add(line, len);
+    }
+    line[len] = '\n';
+    line[len + 1] = '\0';
+    return line;
+}
@@ -0,0 +1,159 @@
+#include "cscshell.h"
+
+/*
+** `a ; b`, `a && b` and `a || b` lists. The line is split into its
+** elements once, before anything in it is expanded, since an element
+** may assign a variable, cd, or read $? for the ones before it; each
+** element is then expanded and parsed when its turn comes to run (see
+** run_list). Operators inside quotes, $(...) and $((...)) belong to
+** those and are left alone, and a `#` ends the line as usual.
+**
+** && and || have the same precedence and group left to right, as in
+** sh: a skipped element leaves the status of the last one that ran.
+*/
+
+
+// The operator at pos, setting *len to its length, or -1 if none
+static int operator_at(const char *pos, size_t *len){
+    if (strncmp(pos, LIST_AND, strlen(LIST_AND)) == 0){
+        *len = strlen(LIST_AND);
+        return LIST_OP_AND;
+    }
+    if (strncmp(pos, LIST_OR, strlen(LIST_OR)) == 0){
+        *len = strlen(LIST_OR);
+        return LIST_OP_OR;
+    }
+    if (strncmp(pos, LIST_SEQ, strlen(LIST_SEQ)) == 0){
+        *len = strlen(LIST_SEQ);
+        return LIST_OP_SEQ;
+    }
+    return -1;
+}
+
+
+const char *list_skip_quoted(const char *pos){
+    // \" and \; are not quotes or operators
+    if (*pos == '\\' && pos[1] != '\0'){
+        return pos + 1;
+    }
+    if (*pos == '\'' || *pos == '"'){
+        // the tokenizer keeps quotes as they are, so nothing escapes them
+        return strchr(pos + 1, *pos);
+    }
+    if (strncmp(pos, SUBST_START, strlen(SUBST_START)) == 0){
+        return subst_find_end(pos + strlen(SUBST_START));
+    }
+    return pos;
+}
+
+
+// The next operator in line at or after pos, or NULL if there is none
+static const char *next_operator(const char *pos, int *op, size_t *len){
+    for (; *pos != '\0' && *pos != '#'; pos++){
+        if ((pos = list_skip_quoted(pos)) == NULL){
+            return NULL;
+        }
+        if ((*op = operator_at(pos, len)) >= 0){
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+
+bool line_is_list(const char *line){
+    int op;
+    size_t len;
+    return next_operator(line, &op, &len) != NULL;
+}
+
+
+void list_free(CommandList *list){
+    if (list == NULL){
+        return;
+    }
+    for (int i = 0; i < list->count; i++){
+        free(list->elements[i]);
+    }
+    free(list->elements);
+    free(list->ops);
+    free(list);
+}
+
+
+// True if text is nothing but blanks
+static bool is_blank(const char *text, size_t len){
+    return strspn(text, " \t\n") >= len;
+}
+
+
+CommandList *list_parse(const char *line){
+    int op;
+    size_t op_len;
+    const char *pos = next_operator(line, &op, &op_len);
+    if (pos == NULL){
+        return NULL;
+    }
+
+    // one more element than there are operators, at most
+    int max_elements = 2;
+    for (const char *next = pos + op_len;
+         (next = next_operator(next, &op, &op_len)) != NULL;
+         next += op_len){
+        max_elements++;
+    }
+    CommandList *list = calloc(1, sizeof(CommandList));
+    if (list != NULL){
+        list->elements = calloc(max_elements, sizeof(char *));
+        list->ops = calloc(max_elements, sizeof(uint8_t));
+    }
+    if (list == NULL || list->elements == NULL || list->ops == NULL){
+        perror("list_parse");
+        list_free(list);
+        return (CommandList *) -1;
+    }
+
+    const char *start = line;
+    int element_op = LIST_OP_SEQ;
+    bool syntax_error = false;
+    while (true){
+        pos = next_operator(start, &op, &op_len);
+        size_t len = (pos != NULL) ? (size_t) (pos - start) : strlen(start);
+        if (pos == NULL){
+            // a comment after the last element is not one of its own
+            len = strcspn(start, "#");
+        }
+
+        if (is_blank(start, len)){
+            // only a trailing ; may end the list, as in `a; b;`
+            if (pos != NULL || element_op != LIST_OP_SEQ || list->count == 0){
+                syntax_error = true;
+            }
+            break;
+        }
+        char *element = strndup(start, len);
+        if (element == NULL){
+            perror("list_parse");
+            list_free(list);
+            return (CommandList *) -1;
+        }
+        list->elements[list->count] = element;
+        list->ops[list->count] = element_op;
+        list->count++;
+
+        if (pos == NULL){
+            break;
+        }
+        element_op = op;
+        start = pos + op_len;
+    }
+
+    if (syntax_error){
+        ERR_PRINT(ERR_LIST_SYNTAX, line);
+        for (int i = 0; i < list->count; i++){
+            free(list->elements[i]);
+        }
+        list->count = 0;
+    }
+    return list;
+}
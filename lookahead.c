@@ -0,0 +1,157 @@
+#include "cscshell.h"
+
+int errors_muted = 0;
+int errors_suppressed = 0;
+int errors_printed = 0;
+
+
+void lookahead_init(Lookahead *ahead, FILE *file, Variable **root){
+    ahead->file = file;
+    ahead->root = root;
+    ahead->first = 0;
+    ahead->count = 0;
+    ahead->eof = false;
+}
+
+
+// True for anything that can change how later lines expand or resolve:
+// assignments, export, cd, memo, watch, blocks and function definitions,
+// function calls, $((...)) (which may assign), $(...) (which runs
+// commands while the line is parsed) and lines whose command word is a
+// variable; also lists and $?, which need the lines before them done
+bool changes_shell_state(const char *line){
+    line += strspn(line, " \t");
+    // the command word itself may expand to cd, memo, ...
+    if (*line == VARIABLE_PARSE_MARKER || vm_starts_block(line) ||
+        vm_find_function(line) != NULL){
+        return true;
+    }
+
+    size_t word_len = strcspn(line, " \t\n");
+    if (line[strcspn(line, "= \t\n")] == '='){
+        return true;
+    }
+    const char *words[] = {CD, EXPORT, MEMO, WATCH};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++){
+        if (word_len == strlen(words[i]) &&
+            strncmp(line, words[i], word_len) == 0){
+            return true;
+        }
+    }
+    // lists run element by element, and $? needs the line before done;
+    // an operator in quotes or $(...) costs only the early parse
+    if (strstr(line, LIST_SEQ) != NULL || strstr(line, LIST_AND) != NULL ||
+        strstr(line, LIST_OR) != NULL || strstr(line, LAST_STATUS_VAR) != NULL){
+        return true;
+    }
+    // "$(" also finds "$(("
+    return strstr(line, SUBST_START) != NULL;
+}
+
+
+// Parses line without printing anything; returns NULL unless it parsed
+// cleanly, so that failures are reported again when the line's turn comes
+static Command *prepare_line(const char *line, Variable **root){
+    // glob results depend on files the lines before may still create
+    if (glob_has_magic(line)){
+        return NULL;
+    }
+
+    char text[MAX_SINGLE_LINE];
+    strcpy(text, line);
+    text[strcspn(text, "\n")] = '\0';
+
+    errors_muted++;
+    errors_suppressed = 0;
+    Command *commands = parse_line(text, root);
+    errors_muted--;
+
+    if (commands == (Command *) -1){
+        return NULL;
+    }
+    if (commands != NULL && errors_suppressed > 0){
+        free_command(commands);
+        return NULL;
+    }
+    return commands;
+}
+
+
+void lookahead_fill(Lookahead *ahead){
+    while (ahead->count < LOOKAHEAD_DEPTH && !ahead->eof){
+        LookaheadLine *next = &ahead->lines[
+            (ahead->first + ahead->count) % LOOKAHEAD_DEPTH];
+        if (fgets(next->text, MAX_SINGLE_LINE, ahead->file) == NULL){
+            ahead->eof = true;
+            break;
+        }
+        next->checked = false;
+        next->changes_state = false;
+        next->prepared = NULL;
+        ahead->count++;
+    }
+
+    // Commands run in children and cannot touch our variables or cwd, so
+    // every line up to the first one that can is parsed exactly as it
+    // would be in order. A line's PATH lookups are checked again when its
+    // turn comes, since a command may install a binary ahead of them.
+    for (int i = 0; i < ahead->count; i++){
+        LookaheadLine *line = &ahead->lines[
+            (ahead->first + i) % LOOKAHEAD_DEPTH];
+        if (!line->checked){
+            line->checked = true;
+            line->changes_state = changes_shell_state(line->text);
+            if (!line->changes_state){
+                line->prepared = prepare_line(line->text, ahead->root);
+                line->path_generation = path_generation;
+            }
+        }
+        if (line->changes_state){
+            break;
+        }
+    }
+}
+
+
+char *lookahead_next(Lookahead *ahead, char *buf, int size,
+                     Command **prepared){
+    *prepared = NULL;
+    if (ahead->count == 0){
+        return fgets(buf, size, ahead->file);
+    }
+
+    LookaheadLine *line = &ahead->lines[ahead->first];
+    ahead->first = (ahead->first + 1) % LOOKAHEAD_DEPTH;
+    ahead->count--;
+
+    snprintf(buf, size, "%s", line->text);
+    if (line->prepared != NULL &&
+        !path_lookups_current(line->prepared, line->path_generation)){
+        free_command(line->prepared);
+        line->prepared = NULL;
+    }
+    *prepared = line->prepared;
+    return buf;
+}
+
+
+char *lookahead_read(char *buf, int size, void *ahead){
+    Command *prepared;
+    char *line = lookahead_next((Lookahead *) ahead, buf, size, &prepared);
+    if (prepared != NULL){
+        free_command(prepared);
+    }
+    return line;
+}
+
+
+void lookahead_free(Lookahead *ahead){
+    for (int i = 0; i < ahead->count; i++){
+        Command *prepared = ahead->lines[
+            (ahead->first + i) % LOOKAHEAD_DEPTH].prepared;
+        if (prepared != NULL){
+            free_command(prepared);
+        }
+    }
+    free(ahead);
+}
@@ -0,0 +1,219 @@
+#include "cscshell.h"
+
+// the calls in this file are to the real allocator
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef strndup
+#undef free
+
+#include <malloc.h>
+#include <pthread.h>
+
+/*
+** Allocation accounting. Built with make memstats (-DMEMSTATS), every
+** malloc, calloc, realloc, strdup, strndup and free in the shell goes
+** through the functions below, which keep a small header in front of
+** each block recording its size and the source file that allocated it.
+** Each source file is one subsystem, with counters kept by relaxed
+** atomic adds since filter threads allocate too.
+**
+** Without MEMSTATS none of this is compiled in and memstats reports
+** what the allocator says is in use, which is enough to see growth.
+*/
+
+#ifdef MEMSTATS
+
+typedef struct MemSubsystem {
+    const char *file;
+    uint64_t allocs;
+    uint64_t live;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+} MemSubsystem;
+
+// 16 bytes, so blocks keep malloc's alignment
+typedef struct MemHeader {
+    uint64_t size;
+    uint32_t subsystem;
+    uint32_t magic;
+} MemHeader;
+
+static MemSubsystem subsystems[MEM_MAX_SUBSYSTEMS];
+static int num_subsystems = 0;
+static pthread_mutex_t subsystems_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Index of file's subsystem, adding it the first time it allocates
+static uint32_t subsystem_of(const char *file){
+    int count = __atomic_load_n(&num_subsystems, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++){
+        if (subsystems[i].file == file){
+            return i;
+        }
+    }
+
+    pthread_mutex_lock(&subsystems_lock);
+    uint32_t index = num_subsystems;
+    for (int i = 0; i < num_subsystems; i++){
+        if (strcmp(subsystems[i].file, file) == 0){
+            index = i;
+            break;
+        }
+    }
+    // files past the table share its last slot
+    if (index == MEM_MAX_SUBSYSTEMS){
+        index = MEM_MAX_SUBSYSTEMS - 1;
+    }
+    else if (index == (uint32_t) num_subsystems){
+        subsystems[index].file = file;
+        __atomic_store_n(&num_subsystems, num_subsystems + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&subsystems_lock);
+    return index;
+}
+
+
+static void count_alloc(uint32_t index, uint64_t size){
+    MemSubsystem *sub = &subsystems[index];
+    __atomic_fetch_add(&sub->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sub->live, 1, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_add_fetch(&sub->live_bytes, size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&sub->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&sub->peak_bytes, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+static void count_free(MemHeader *header){
+    MemSubsystem *sub = &subsystems[header->subsystem];
+    __atomic_fetch_sub(&sub->live, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&sub->live_bytes, header->size, __ATOMIC_RELAXED);
+}
+
+
+static void *track(MemHeader *header, size_t size, const char *file){
+    if (header == NULL){
+        return NULL;
+    }
+    header->size = size;
+    header->subsystem = subsystem_of(file);
+    header->magic = MEM_MAGIC;
+    count_alloc(header->subsystem, size);
+    return header + 1;
+}
+
+
+void *mem_malloc(size_t size, const char *file){
+    return track(malloc(sizeof(MemHeader) + size), size, file);
+}
+
+
+void *mem_calloc(size_t count, size_t size, const char *file){
+    if (size != 0 && count > (SIZE_MAX - sizeof(MemHeader)) / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return track(calloc(1, sizeof(MemHeader) + count * size),
+                 count * size, file);
+}
+
+
+void *mem_realloc(void *ptr, size_t size, const char *file){
+    if (ptr == NULL){
+        return mem_malloc(size, file);
+    }
+    MemHeader *header = (MemHeader *) ptr - 1;
+    uint32_t index = header->subsystem;
+    uint64_t old_size = header->size;
+    MemHeader *grown = realloc(header, sizeof(MemHeader) + size);
+    if (grown == NULL){
+        return NULL;
+    }
+    // a block stays with the subsystem that first allocated it
+    MemSubsystem *sub = &subsystems[index];
+    __atomic_fetch_sub(&sub->live_bytes, old_size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&sub->live, 1, __ATOMIC_RELAXED);
+    grown->size = size;
+    count_alloc(index, size);
+    return grown + 1;
+}
+
+
+char *mem_strdup(const char *str, const char *file){
+    return mem_strndup(str, strlen(str), file);
+}
+
+
+char *mem_strndup(const char *str, size_t n, const char *file){
+    size_t len = strnlen(str, n);
+    char *copy = mem_malloc(len + 1, file);
+    if (copy != NULL){
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+
+void mem_free(void *ptr){
+    if (ptr == NULL){
+        return;
+    }
+    MemHeader *header = (MemHeader *) ptr - 1;
+    if (header->magic != MEM_MAGIC){
+        // a double free, or a block the shell did not allocate
+        abort();
+    }
+    header->magic = 0;
+    count_free(header);
+    free(header);
+}
+
+
+size_t mem_report(char *buf, size_t size){
+    size_t len = snprintf(buf, size, "%-14s %12s %10s %12s %12s\n",
+                          "subsystem", "allocs", "live", "live_bytes",
+                          "peak_bytes");
+    uint64_t allocs = 0, live = 0, live_bytes = 0;
+    int count = __atomic_load_n(&num_subsystems, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && len < size; i++){
+        MemSubsystem *sub = &subsystems[i];
+        const char *slash = strrchr(sub->file, '/');
+        len += snprintf(buf + len, size - len,
+                        "%-14s %12llu %10llu %12llu %12llu\n",
+                        slash != NULL ? slash + 1 : sub->file,
+                        (unsigned long long) sub->allocs,
+                        (unsigned long long) sub->live,
+                        (unsigned long long) sub->live_bytes,
+                        (unsigned long long) sub->peak_bytes);
+        allocs += sub->allocs;
+        live += sub->live;
+        live_bytes += sub->live_bytes;
+    }
+    if (len < size){
+        len += snprintf(buf + len, size - len,
+                        "%-14s %12llu %10llu %12llu %12s\n", "total",
+                        (unsigned long long) allocs, (unsigned long long) live,
+                        (unsigned long long) live_bytes, "-");
+    }
+    return (len < size) ? len : size - 1;
+}
+
+#else
+
+size_t mem_report(char *buf, size_t size){
+    struct mallinfo2 info = mallinfo2();
+    // untracked builds only know the allocator's total
+    size_t len = snprintf(buf, size,
+                          "%-14s %12s %10s %12s %12s\n"
+                          "%-14s %12s %10s %12zu %12s\n",
+                          "subsystem", "allocs", "live", "live_bytes",
+                          "peak_bytes", "total", "-", "-",
+                          info.uordblks + info.hblkhd, "-");
+    return (len < size) ? len : size - 1;
+}
+
+#endif
@@ -0,0 +1,407 @@
+#include "cscshell.h"
+
+typedef struct MemoHeader {
+    char magic[8];
+    int32_t exit_code;
+    uint32_t reserved;
+    uint64_t key;
+} MemoHeader;
+
+typedef struct MemoEntry {
+    char name[64];
+    off_t size;
+    struct timespec mtime;
+} MemoEntry;
+
+
+uint64_t fnv_bytes(uint64_t hash, const void *data, size_t len){
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++){
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Strings are hashed with their NULL terminator so "ab" "c" != "a" "bc"
+static uint64_t fnv_str(uint64_t hash, const char *str){
+    if (str == NULL){
+        return fnv_bytes(hash, "", 1);
+    }
+    return fnv_bytes(hash, str, strlen(str) + 1);
+}
+
+// Files are identified by inode, size and mtime, like make(1) would
+static uint64_t fnv_file(uint64_t hash, const char *path){
+    struct stat st;
+    hash = fnv_str(hash, path);
+    if (stat(path, &st) < 0){
+        // a missing input is still part of the key
+        return fnv_bytes(hash, "\xff", 1);
+    }
+    hash = fnv_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = fnv_bytes(hash, &st.st_size, sizeof(st.st_size));
+    hash = fnv_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+    return hash;
+}
+
+
+char *memo_parse_prefix(char *line, char ***inputs){
+    size_t prefix_len = strlen(MEMO);
+    if (strncmp(line, MEMO, prefix_len) != 0 ||
+        !isspace((unsigned char) line[prefix_len])){
+        return NULL;
+    }
+
+    // at most one input per remaining word, plus the NULL terminator
+    size_t max_inputs = 1;
+    for (char *c = line; *c != '\0'; c++){
+        if (isspace((unsigned char) *c)) max_inputs++;
+    }
+    char **declared = calloc(max_inputs, sizeof(char *));
+    if (declared == NULL){
+        perror("memo_parse_prefix");
+        return (char *) -1;
+    }
+
+    int num_inputs = 0;
+    char *rest = line + prefix_len;
+    while (true){
+        while (isspace((unsigned char) *rest)) rest++;
+
+        size_t flag_len = strlen(MEMO_INPUT_FLAG);
+        if (strncmp(rest, MEMO_INPUT_FLAG, flag_len) != 0 ||
+            !isspace((unsigned char) rest[flag_len])){
+            break;
+        }
+        rest += flag_len;
+        while (isspace((unsigned char) *rest)) rest++;
+
+        char *end = rest;
+        while (*end != '\0' && !isspace((unsigned char) *end)) end++;
+        if (end == rest){
+            break;
+        }
+        declared[num_inputs] = strndup(rest, end - rest);
+        if (declared[num_inputs] == NULL){
+            perror("memo_parse_prefix");
+            for (int i = 0; i < num_inputs; i++) free(declared[i]);
+            free(declared);
+            return (char *) -1;
+        }
+        num_inputs++;
+        rest = end;
+    }
+
+    if (*rest == '\0'){
+        ERR_PRINT(ERR_MEMO_USAGE);
+        for (int i = 0; i < num_inputs; i++) free(declared[i]);
+        free(declared);
+        return NULL;
+    }
+
+    *inputs = declared;
+    return rest;
+}
+
+
+static uint64_t memo_key(Command *head){
+    uint64_t hash = FNV_OFFSET;
+    // relative paths, and commands like ls, depend on where they run
+    char cwd[MAX_PATH_STR];
+    hash = fnv_str(hash, getcwd(cwd, sizeof(cwd)));
+    for (Command *curr = head; curr != NULL; curr = curr->next){
+        hash = fnv_str(hash, curr->exec_path);
+        for (int i = 1; curr->args[i] != NULL; i++){
+            hash = fnv_str(hash, curr->args[i]);
+        }
+        if (curr->redir_in_path != NULL){
+            hash = fnv_file(hash, curr->redir_in_path);
+        }
+        // separates the stages of the pipeline
+        hash = fnv_bytes(hash, "|", 1);
+    }
+    for (int i = 0; head->memo_inputs && head->memo_inputs[i]; i++){
+        hash = fnv_file(hash, head->memo_inputs[i]);
+    }
+    // the environment the line would run with, exports expanded
+    hash = fnv_bytes(hash, "|", 1);
+    for (char **entry = env_current(); *entry != NULL; entry++){
+        hash = fnv_str(hash, *entry);
+    }
+    return hash;
+}
+
+
+static char *memo_dir(){
+    const char *home = getenv("HOME");
+    if (home == NULL){
+        home = "/tmp";
+    }
+    char *dir = malloc(strlen(home) + strlen(MEMO_DIR_NAME) + 2);
+    if (dir == NULL){
+        perror("memo_dir");
+        return NULL;
+    }
+    sprintf(dir, "%s/%s", home, MEMO_DIR_NAME);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST){
+        ERR_PRINT(ERR_MEMO_DIR, dir);
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+
+static int copy_fd(int from, int to){
+    char buf[COPY_BUF_SIZE];
+    ssize_t num_read;
+    while ((num_read = read(from, buf, COPY_BUF_SIZE)) > 0){
+        char *pos = buf;
+        while (num_read > 0){
+            ssize_t num_written = write(to, pos, num_read);
+            if (num_written < 0){
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            pos += num_written;
+            num_read -= num_written;
+        }
+    }
+    return (num_read < 0) ? -1 : 0;
+}
+
+
+// Writes the cached stdout to where the tail of the line would have
+static int memo_replay(int entry_fd, const char *out_path, uint8_t append){
+    int out_fd = STDOUT_FILENO;
+    if (out_path != NULL){
+        int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        out_fd = open(out_path, flags, 0644);
+        if (out_fd < 0){
+            perror("open");
+            return -1;
+        }
+    }
+    fflush(stdout);
+    int error = copy_fd(entry_fd, out_fd);
+    if (error < 0){
+        perror("memo_replay");
+    }
+    if (out_fd != STDOUT_FILENO){
+        close(out_fd);
+    }
+    return error;
+}
+
+
+static int compare_entry_age(const void *a, const void *b){
+    const MemoEntry *first = a, *second = b;
+    if (first->mtime.tv_sec != second->mtime.tv_sec){
+        return (first->mtime.tv_sec < second->mtime.tv_sec) ? -1 : 1;
+    }
+    if (first->mtime.tv_nsec != second->mtime.tv_nsec){
+        return (first->mtime.tv_nsec < second->mtime.tv_nsec) ? -1 : 1;
+    }
+    return 0;
+}
+
+
+// Drops the least recently used entries until the cache fits its budget.
+// Hits touch their entry's mtime, so mtime order is LRU order.
+static void memo_evict(const char *dir_path){
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0){
+        return;
+    }
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL){
+        close(dir_fd);
+        return;
+    }
+
+    size_t num_entries = 0, capacity = 64;
+    MemoEntry *entries = malloc(capacity * sizeof(MemoEntry));
+    off_t total = 0;
+    struct dirent *dirent;
+
+    while (entries != NULL && (dirent = readdir(dir)) != NULL){
+        struct stat st;
+        if (dirent->d_name[0] == '.' ||
+            strlen(dirent->d_name) >= sizeof(entries->name) ||
+            fstatat(dir_fd, dirent->d_name, &st, 0) < 0 ||
+            !S_ISREG(st.st_mode)){
+            continue;
+        }
+        if (num_entries == capacity){
+            capacity *= 2;
+            MemoEntry *grown = realloc(entries, capacity * sizeof(MemoEntry));
+            if (grown == NULL){
+                break;
+            }
+            entries = grown;
+        }
+        strcpy(entries[num_entries].name, dirent->d_name);
+        entries[num_entries].size = st.st_size;
+        entries[num_entries].mtime = st.st_mtim;
+        total += st.st_size;
+        num_entries++;
+    }
+
+    if (entries != NULL && total > MEMO_MAX_BYTES){
+        qsort(entries, num_entries, sizeof(MemoEntry), compare_entry_age);
+        for (size_t i = 0; i < num_entries && total > MEMO_MAX_BYTES; i++){
+            if (unlinkat(dir_fd, entries[i].name, 0) == 0){
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+    closedir(dir);
+}
+
+
+int *memo_execute_line(Command *head){
+    Command *tail = head;
+    while (tail->next != NULL) tail = tail->next;
+
+    char *dir = memo_dir();
+    if (dir == NULL){
+        head->memo = 0;
+        return execute_line(head);
+    }
+
+    uint64_t key = memo_key(head);
+    char key_hex[17];
+    snprintf(key_hex, sizeof(key_hex), "%016llx", (unsigned long long) key);
+
+    char entry_path[MAX_PATH_STR];
+    char tmp_path[MAX_PATH_STR];
+    snprintf(entry_path, MAX_PATH_STR, "%s/%s", dir, key_hex);
+    snprintf(tmp_path, MAX_PATH_STR, "%s/.%s.%d", dir, key_hex, getpid());
+
+    // the tail's redirection is replayed by us, so keep our own copy
+    char *out_path = NULL;
+    if (tail->redir_out_path != NULL){
+        out_path = strdup(tail->redir_out_path);
+        if (out_path == NULL){
+            perror("memo_execute_line");
+            free(dir);
+            return (int *) -1;
+        }
+    }
+    uint8_t append = tail->redir_append;
+
+    int *ret = malloc(sizeof(int));
+    if (ret == NULL){
+        perror("memo_execute_line");
+        free(out_path);
+        free(dir);
+        return (int *) -1;
+    }
+
+    MemoHeader header;
+    int entry_fd = open(entry_path, O_RDONLY);
+    if (entry_fd >= 0){
+        if (read(entry_fd, &header, sizeof(header)) == sizeof(header) &&
+            memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic)) == 0 &&
+            header.key == key){
+            // cache hit: nothing is forked
+            futimens(entry_fd, NULL);
+            *ret = header.exit_code;
+            if (memo_replay(entry_fd, out_path, append) < 0){
+                free(ret);
+                ret = (int *) -1;
+            }
+            close(entry_fd);
+            free_command(head);
+            free(out_path);
+            free(dir);
+            return ret;
+        }
+        // truncated, foreign or someone else's entry, recompute it
+        close(entry_fd);
+    }
+
+    int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (tmp_fd < 0){
+        ERR_PRINT(ERR_MEMO_DIR, dir);
+        free(ret);
+        free(out_path);
+        free(dir);
+        head->memo = 0;
+        return execute_line(head);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+    header.key = key;
+    if (write(tmp_fd, &header, sizeof(header)) != sizeof(header)){
+        perror("memo_execute_line");
+        close(tmp_fd);
+        unlink(tmp_path);
+        free(ret);
+        free(out_path);
+        free(dir);
+        return (int *) -1;
+    }
+
+    // point the tail at the entry, appending after the header
+    free(tail->redir_out_path);
+    tail->redir_out_path = strdup(tmp_path);
+    tail->redir_append = NON_ZERO_BYTE;
+    head->memo = 0;
+    if (tail->redir_out_path == NULL){
+        perror("memo_execute_line");
+        close(tmp_fd);
+        unlink(tmp_path);
+        free(ret);
+        free(out_path);
+        free(dir);
+        return (int *) -1;
+    }
+
+    bool has_deadline = head->timeout_ns > 0;
+    int *status = execute_line(head);
+    if (status == NULL || status == (int *) -1 ||
+        (has_deadline && *status == TIMEOUT_STATUS)){
+        // killed by a signal, timed out or failed to start: nothing
+        // worth storing
+        close(tmp_fd);
+        unlink(tmp_path);
+        free(ret);
+        free(out_path);
+        free(dir);
+        return status;
+    }
+    header.exit_code = *status;
+    *ret = *status;
+    free(status);
+
+    bool stored = pwrite(tmp_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                  rename(tmp_path, entry_path) == 0;
+    if (!stored){
+        perror("memo_execute_line");
+    }
+    close(tmp_fd);
+
+    // an entry that could not be stored still holds the line's output
+    entry_fd = open(stored ? entry_path : tmp_path, O_RDONLY);
+    if (!stored){
+        unlink(tmp_path);
+    }
+    if (entry_fd < 0 ||
+        lseek(entry_fd, sizeof(header), SEEK_SET) < 0 ||
+        memo_replay(entry_fd, out_path, append) < 0){
+        free(ret);
+        ret = (int *) -1;
+    }
+    if (entry_fd >= 0){
+        close(entry_fd);
+    }
+
+    memo_evict(dir);
+    free(out_path);
+    free(dir);
+    return ret;
+}
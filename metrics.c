@@ -0,0 +1,205 @@
+#include "cscshell.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+static MetricsBlock local_metrics;
+MetricsBlock *metrics = &local_metrics;
+bool metrics_timed = false;
+
+static pid_t metrics_owner = 0;
+static char *shm_name = NULL;
+static char *file_path = NULL;
+static int64_t file_interval_ns = 0;
+static int64_t file_written_ns = 0;
+
+
+int64_t metrics_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void metrics_init(){
+    memcpy(metrics->magic, METRICS_MAGIC, sizeof(metrics->magic));
+    metrics->version = METRICS_VERSION;
+    metrics->pid = getpid();
+}
+
+
+void metrics_observe(MetricsHistogram *hist, int64_t ns){
+    // bucket i holds durations up to 2^i microseconds, the last the rest
+    int bucket = 0;
+    int64_t bound = 1000;
+    while (bucket < METRICS_BUCKETS - 1 && ns > bound){
+        bound <<= 1;
+        bucket++;
+    }
+    METRIC_ADD(*hist, buckets[bucket], 1);
+    METRIC_ADD(*hist, sum_ns, ns);
+    METRIC_ADD(*hist, count, 1);
+}
+
+
+int metrics_open_shm(const char *name){
+    char default_name[64];
+    if (name == NULL){
+        snprintf(default_name, sizeof(default_name), METRICS_SHM_FORMAT,
+                 (int) getpid());
+        name = default_name;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        perror("metrics_open_shm");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(MetricsBlock)) < 0){
+        perror("metrics_open_shm");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    MetricsBlock *block = mmap(NULL, sizeof(MetricsBlock),
+                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED){
+        perror("metrics_open_shm");
+        shm_unlink(name);
+        return -1;
+    }
+
+    shm_name = strdup(name);
+    if (shm_name == NULL){
+        perror("metrics_open_shm");
+        munmap(block, sizeof(MetricsBlock));
+        shm_unlink(name);
+        return -1;
+    }
+    // carry over anything counted before the segment existed
+    memcpy(block, metrics, sizeof(MetricsBlock));
+    metrics = block;
+    metrics_owner = getpid();
+    metrics_timed = true;
+    return 0;
+}
+
+
+void metrics_set_file(const char *path, int interval_sec){
+    file_path = (char *) path;
+    file_interval_ns = (int64_t) interval_sec * 1000000000;
+    metrics_owner = getpid();
+    metrics_timed = true;
+}
+
+
+static void write_counter(FILE *out, const char *name, const char *help,
+                          uint64_t value){
+    fprintf(out, "# HELP cscshell_%s %s\n", name, help);
+    fprintf(out, "# TYPE cscshell_%s counter\n", name);
+    fprintf(out, "cscshell_%s{pid=\"%u\"} %llu\n", name, metrics->pid,
+            (unsigned long long) value);
+}
+
+
+static void write_histogram(FILE *out, const char *name, const char *help,
+                            const MetricsHistogram *hist){
+    fprintf(out, "# HELP cscshell_%s %s\n", name, help);
+    fprintf(out, "# TYPE cscshell_%s histogram\n", name);
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++){
+        cumulative += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        fprintf(out, "cscshell_%s_bucket{pid=\"%u\",le=\"%g\"} %llu\n",
+                name, metrics->pid, (double) (1LL << i) / 1e6,
+                (unsigned long long) cumulative);
+    }
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    fprintf(out, "cscshell_%s_bucket{pid=\"%u\",le=\"+Inf\"} %llu\n",
+            name, metrics->pid, (unsigned long long) count);
+    fprintf(out, "cscshell_%s_sum{pid=\"%u\"} %.9f\n", name, metrics->pid,
+            (double) __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "cscshell_%s_count{pid=\"%u\"} %llu\n", name, metrics->pid,
+            (unsigned long long) count);
+}
+
+
+// Writes the Prometheus text file through a temporary, so a collector
+// never reads half of it
+static void write_metrics_file(){
+    char *tmp_path = malloc(strlen(file_path) + 16);
+    if (tmp_path == NULL){
+        perror("write_metrics_file");
+        return;
+    }
+    sprintf(tmp_path, "%s.%d", file_path, (int) getpid());
+
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL){
+        perror("write_metrics_file");
+        free(tmp_path);
+        return;
+    }
+    const MetricsBlock *m = metrics;
+    write_counter(out, "lines_parsed_total", "Lines parsed.",
+                  m->lines_parsed);
+    write_counter(out, "parse_errors_total", "Lines that failed to parse.",
+                  m->parse_errors);
+    write_counter(out, "commands_spawned_total", "Commands forked.",
+                  m->commands_spawned);
+    write_counter(out, "path_cache_hits_total",
+                  "Executables resolved from the PATH cache.",
+                  m->path_cache_hits);
+    write_counter(out, "path_cache_misses_total",
+                  "Executables resolved by searching PATH.",
+                  m->path_cache_misses);
+    write_counter(out, "redirected_bytes_total",
+                  "Bytes read from or written to redirected files.",
+                  m->bytes_redirected);
+    write_counter(out, "optimized_stages_total",
+                  "Pipeline stages replaced by redirects.",
+                  m->stages_optimized);
+    write_histogram(out, "fork_exec_seconds",
+                    "Time from fork until the child has exec'd.",
+                    &m->fork_exec);
+    write_histogram(out, "wait_seconds",
+                    "Time spent waiting for a line's commands.", &m->wait);
+
+    bool written = fclose(out) == 0;
+    if (!written || rename(tmp_path, file_path) < 0){
+        perror("write_metrics_file");
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+
+void metrics_tick(){
+    if (file_path == NULL || getpid() != metrics_owner){
+        return;
+    }
+    int64_t now = metrics_now();
+    if (now - file_written_ns >= file_interval_ns){
+        write_metrics_file();
+        file_written_ns = now;
+    }
+}
+
+
+void metrics_close(){
+    // children that failed to exec share our mappings; leave them alone
+    if (getpid() != metrics_owner){
+        return;
+    }
+    if (file_path != NULL){
+        write_metrics_file();
+    }
+    if (shm_name != NULL){
+        munmap(metrics, sizeof(MetricsBlock));
+        shm_unlink(shm_name);
+        free(shm_name);
+        shm_name = NULL;
+        metrics = &local_metrics;
+    }
+}
@@ -0,0 +1,160 @@
+#include "cscshell.h"
+
+/*
+** A pass over each parsed pipeline, before it runs, that drops cat
+** stages which only move bytes from one place to another:
+**
+**   cat FILE | cmd ...        ->  cmd ... < FILE
+**   cat < FILE | cmd ...      ->  cmd ... < FILE
+**   cmd | cat > OUT           ->  cmd > OUT         (and >> OUT)
+**   cmd | cat | next ...      ->  cmd | next ...
+**
+** Each one saves a stage with its pipe and copy loop. A first stage is
+** only rewritten if FILE can be opened now, so a missing file still
+** gets cat's own error, and not into a wc that would line its columns
+** up by FILE's size; a last stage only if it writes to a file, since
+** `cmd | cat` is how scripts keep cmd's stdout off the terminal.
+** --no-optimize turns the pass off; --dump-pipelines prints each
+** pipeline before and after it to stderr.
+*/
+
+bool optimize_enabled = true;
+bool optimize_dump = false;
+
+
+static const char *command_name(Command *command){
+    const char *slash = strrchr(command->exec_path, '/');
+    return (slash != NULL) ? slash + 1 : command->exec_path;
+}
+
+
+// True if command is cat with at most max_operands operands and no options
+static bool is_plain_cat(Command *command, int max_operands){
+    if (strcmp(command_name(command), OPTIMIZE_CAT) != 0){
+        return false;
+    }
+    int operands = 0;
+    for (char **arg = command->args + 1; *arg != NULL; arg++){
+        if ((*arg)[0] == '-' && (*arg)[1] != '\0'){
+            return false;
+        }
+        operands++;
+    }
+    return operands <= max_operands;
+}
+
+
+// True if command prints differently reading a file than a pipe: wc
+// sizes its columns by a regular input file unless it prints one count
+static bool reads_input_size(Command *command){
+    if (strcmp(command_name(command), OPTIMIZE_WC) != 0){
+        return false;
+    }
+    char **args = command->args;
+    return args[1] == NULL || args[2] != NULL || strlen(args[1]) != 2 ||
+           args[1][0] != '-' || strchr("lwc", args[1][1]) == NULL;
+}
+
+
+// Frees a single stage, leaving the rest of its pipeline alone
+static void drop_stage(Command *command){
+    command->next = NULL;
+    free_command(command);
+}
+
+
+// Rewrites a leading cat of one readable file; true if it did
+static bool fold_input(Command **head){
+    Command *cat = *head;
+    if (cat->next == NULL || !is_plain_cat(cat, 1) ||
+        reads_input_size(cat->next)){
+        return false;
+    }
+    char **operand = &cat->args[1];
+    char **path = &cat->redir_in_path;
+    if (*operand != NULL && strcmp(*operand, "-") != 0){
+        if (*path != NULL){
+            return false;
+        }
+        path = operand;
+    }
+    struct stat st;
+    if (*path == NULL || access(*path, R_OK) != 0 ||
+        stat(*path, &st) != 0 || S_ISDIR(st.st_mode)){
+        return false;
+    }
+
+    // later stages never have a < of their own
+    cat->next->redir_in_path = *path;
+    *path = NULL;
+    *head = cat->next;
+    drop_stage(cat);
+    return true;
+}
+
+
+// Rewrites a cat with no operands after the first stage; true if it did
+static bool fold_output(Command *head){
+    for (Command *prev = head; prev->next != NULL; prev = prev->next){
+        Command *cat = prev->next;
+        if (!is_plain_cat(cat, 1) || (cat->args[1] != NULL &&
+                                      strcmp(cat->args[1], "-") != 0)){
+            continue;
+        }
+        if (cat->next == NULL && cat->redir_out_path == NULL){
+            continue;
+        }
+        prev->next = cat->next;
+        prev->redir_out_path = cat->redir_out_path;
+        prev->redir_append = cat->redir_append;
+        cat->redir_out_path = NULL;
+        drop_stage(cat);
+        return true;
+    }
+    return false;
+}
+
+
+// One line describing a pipeline, for --dump-pipelines
+static void dump_pipeline(const char *label, Command *head){
+    fprintf(stderr, "%s:", label);
+    for (Command *curr = head; curr != NULL; curr = curr->next){
+        if (curr != head){
+            fprintf(stderr, " |");
+        }
+        for (char **arg = curr->args; *arg != NULL; arg++){
+            fprintf(stderr, " %s", *arg);
+        }
+        if (curr->redir_in_path != NULL){
+            fprintf(stderr, " < %s", curr->redir_in_path);
+        }
+        if (curr->redir_out_path != NULL){
+            fprintf(stderr, " %s %s", curr->redir_append ? ">>" : ">",
+                    curr->redir_out_path);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+
+Command *optimize_pipeline(Command *head){
+    if (!optimize_enabled){
+        return head;
+    }
+    if (optimize_dump){
+        dump_pipeline(OPTIMIZE_DUMP_BEFORE, head);
+    }
+
+    int removed = 0;
+    while (fold_input(&head) || fold_output(head)){
+        removed++;
+    }
+    if (removed > 0){
+        METRIC_ADD(*metrics, stages_optimized, removed);
+    }
+
+    if (optimize_dump){
+        dump_pipeline(OPTIMIZE_DUMP_AFTER, head);
+    }
+    return head;
+}
@@ -1,7 +1,138 @@
 #include "cscshell.h"
 
+#include <limits.h>
+
 #define CONTINUE_SEARCH NULL
 
+// Results of PATH searches, direct-mapped by name. Emptied whenever PATH
+// changes, or when a directory searched before a hit was found has
+// changed since the cache was last emptied: a command installed there
+// would now shadow the cached one. An entry whose file has gone is
+// searched for again.
+typedef struct PathCacheEntry {
+    char *name;
+    char *exec_path;
+} PathCacheEntry;
+
+uint64_t path_generation = 0;
+
+static PathCacheEntry path_cache[PATH_CACHE_SIZE];
+static char *path_cache_value = NULL;
+static struct timespec *path_cache_mtimes = NULL;   // as it was emptied
+static int path_cache_num_dirs = 0;
+
+
+static void path_cache_reset(const char *path_value){
+    for (int i = 0; i < PATH_CACHE_SIZE; i++){
+        free(path_cache[i].name);
+        free(path_cache[i].exec_path);
+        path_cache[i].name = NULL;
+        path_cache[i].exec_path = NULL;
+    }
+    char *value = strdup(path_value);
+    free(path_cache_value);
+    path_cache_value = value;
+    free(path_cache_mtimes);
+    path_cache_mtimes = (value != NULL)
+        ? path_dir_mtimes(value, INT_MAX, &path_cache_num_dirs) : NULL;
+    path_generation++;
+}
+
+
+static PathCacheEntry *path_cache_slot(const char *command_name,
+                                       const char *path_value){
+    if (path_cache_value == NULL || strcmp(path_cache_value, path_value) != 0){
+        path_cache_reset(path_value);
+    }
+    uint64_t hash = fnv_bytes(FNV_OFFSET, command_name, strlen(command_name));
+    return &path_cache[hash % PATH_CACHE_SIZE];
+}
+
+
+// The index of the directory in path_value that exec_path is in, counted
+// the way resolve_executable walks PATH; -1 if none is
+static int path_dir_index(const char *path_value, const char *exec_path){
+    const char *name = strrchr(exec_path, '/');
+    char *dirs = strdup(path_value);
+    if (name == NULL || dirs == NULL){
+        free(dirs);
+        return -1;
+    }
+    size_t dir_len = name - exec_path;
+    int index = 0;
+    char *save;
+    for (char *dir = strtok_r(dirs, ":", &save); dir != NULL;
+         dir = strtok_r(NULL, ":", &save), index++){
+        size_t len = strlen(dir);
+        // resolve_executable only adds a '/' when the directory lacks one
+        if (len > 0 && dir[len - 1] == '/'){
+            len--;
+        }
+        if (len == dir_len && strncmp(dir, exec_path, len) == 0){
+            free(dirs);
+            return index;
+        }
+    }
+    free(dirs);
+    return -1;
+}
+
+
+// Empties the cache if a directory up to exec_path's own has changed;
+// an exec_path outside PATH was not searched for
+static void path_cache_validate(const char *exec_path){
+    if (path_cache_value == NULL){
+        return;
+    }
+    int dir_index = path_dir_index(path_cache_value, exec_path);
+    if (dir_index < 0){
+        return;
+    }
+    int num_dirs = 0;
+    struct timespec *mtimes = path_dir_mtimes(path_cache_value, dir_index + 1,
+                                              &num_dirs);
+    bool fresh = mtimes != NULL && path_cache_mtimes != NULL &&
+        num_dirs == dir_index + 1 && num_dirs <= path_cache_num_dirs &&
+        memcmp(mtimes, path_cache_mtimes,
+               num_dirs * sizeof(struct timespec)) == 0;
+    free(mtimes);
+    if (!fresh){
+        // whatever else was found is suspect too
+        char *path_value = path_cache_value;
+        path_cache_value = NULL;
+        path_cache_reset(path_value);
+        free(path_value);
+    }
+}
+
+
+bool path_lookups_current(const Command *head, uint64_t generation){
+    for (const Command *stage = head; stage != NULL; stage = stage->next){
+        // builtins keep a bare name
+        if (strchr(stage->exec_path, '/') != NULL){
+            path_cache_validate(stage->exec_path);
+        }
+    }
+    return generation == path_generation;
+}
+
+
+static void path_cache_store(PathCacheEntry *entry, const char *command_name,
+                             const char *exec_path){
+    char *name = strdup(command_name);
+    char *path_copy = strdup(exec_path);
+    if (name == NULL || path_copy == NULL){
+        // only a missed speedup
+        free(name);
+        free(path_copy);
+        return;
+    }
+    free(entry->name);
+    free(entry->exec_path);
+    entry->name = name;
+    entry->exec_path = path_copy;
+}
+
 
 // COMPLETE
 char *resolve_executable(const char *command_name, Variable *path){
@@ -72,7 +203,7 @@ char *resolve_executable(const char *command_name, Variable *path){
                 if (current_path[strlen(current_path)-1] != '/'){
                     strncat(exec_path, "/", 2);
                 }
-                strncat(exec_path, command_name, strlen(command_name)+1);
+                strcat(exec_path, command_name);
             }
         }
         closedir(dir);
@@ -87,6 +218,64 @@ res_ex_cleanup:
     return exec_path;
 }
 
+
+// Builtins stand for themselves: cd runs in execute_line, the others as
+// filters
+static bool is_builtin(const char *command_name){
+    return strcmp(command_name, CD) == 0 ||
+           strcmp(command_name, MEMSTATS_BUILTIN) == 0 ||
+           strcmp(command_name, PARSE_CACHE_BUILTIN) == 0 ||
+           strcmp(command_name, SUGGEST_BUILTIN) == 0;
+}
+
+
+// The exec_path for command_name: a builtin's own name, else what the
+// PATH cache or resolve_executable finds
+static char *find_executable(const char *command_name, Variable *path){
+    if (command_name == NULL || path == NULL){
+        return NULL;
+    }
+
+    if (is_builtin(command_name)){
+        if (strcmp(command_name, SUGGEST_BUILTIN) == 0 &&
+            strcmp(path->name, PATH_VAR_NAME) == 0){
+            suggest_set_path(path->value);
+        }
+        char *exec_path = strdup(command_name);
+        if (exec_path == NULL){
+            perror("find_executable");
+        }
+        return exec_path;
+    }
+
+    // only PATH searches are worth keeping
+    if (strchr(command_name, '/') != NULL ||
+        strcmp(path->name, PATH_VAR_NAME) != 0){
+        return resolve_executable(command_name, path);
+    }
+
+    PathCacheEntry *cached = path_cache_slot(command_name, path->value);
+    if (cached->name != NULL && strcmp(cached->name, command_name) == 0){
+        path_cache_validate(cached->exec_path);
+    }
+    if (cached->name != NULL && strcmp(cached->name, command_name) == 0 &&
+        access(cached->exec_path, F_OK) == 0){
+        METRIC_ADD(*metrics, path_cache_hits, 1);
+        char *exec_path = strdup(cached->exec_path);
+        if (exec_path == NULL){
+            perror("find_executable");
+        }
+        return exec_path;
+    }
+    METRIC_ADD(*metrics, path_cache_misses, 1);
+
+    char *exec_path = resolve_executable(command_name, path);
+    if (exec_path != NULL){
+        path_cache_store(cached, command_name, exec_path);
+    }
+    return exec_path;
+}
+
 // Helper function to remove the leading whitespace from line
 char *clear_leading_whitespace(char *line) {
 
@@ -117,7 +306,7 @@ char *clear_trailing_whitespace(char *line) {
 
 // Parse an individual command (seperated by pipes)
 Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
-  bool *output_exists) {
+  bool *output_exists, DirCache *dir_cache) {
 
     line = clear_leading_whitespace(line);
 
@@ -135,6 +324,11 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
     command->redir_in_path = NULL;
     command->redir_out_path = NULL;
     command->redir_append = 0;
+    command->memo = 0;
+    command->memo_inputs = NULL;
+    command->watch = NULL;
+    command->timeout_ns = 0;
+    command->timeout_grace_ns = 0;
 
     char* input_redir = strchr(line, '<');
     // Raise an error b/c we already have an input from the previous pipe
@@ -389,8 +583,8 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
             return NULL;
           }
 
-          input_redir = strdup(command->redir_in_path);
-          if (input_redir == NULL) {
+          command->redir_in_path = strdup(input_redir);
+          if (command->redir_in_path == NULL) {
             free(command->redir_out_path);
             free(command);
             perror("parse_a_command");
@@ -434,7 +628,7 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
     char *token_for_command;
     // The first word is always command_name
     char *command_name = strtok_r(line, " \t\n", &token_for_command);
-    char *path_to_executable = resolve_executable(command_name, path);
+    char *path_to_executable = find_executable(command_name, path);
     if (path_to_executable == NULL) {
       if (command->redir_in_path != NULL) {
         free(command->redir_in_path);
@@ -444,24 +638,22 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
       }
       free(command->args);
       free(command);
-      perror("parse_a_command");
-      return (Command *) -1;
-    }
-
-    command->exec_path = strdup(path_to_executable);
-    if (command->exec_path == NULL) {
-      if (command->redir_in_path != NULL) {
-        free(command->redir_in_path);
+      // a muted error is never seen, so it needs no suggestions
+      char suggestions[SUGGEST_REPORT_SIZE];
+      if (!errors_muted && command_name != NULL &&
+          strcmp(path->name, PATH_VAR_NAME) == 0 &&
+          suggest_commands(command_name, path->value, SUGGEST_SEPARATOR,
+                           suggestions, sizeof(suggestions)) > 0){
+        ERR_PRINT(ERR_NO_EXECU_SUGGEST, command_name, suggestions);
       }
-      if (command->redir_out_path != NULL) {
-        free(command->redir_out_path);
+      else {
+        ERR_PRINT(ERR_NO_EXECU, command_name);
       }
-      free(command->args);
-      free(command);
-      perror("parse_a_command");
       return (Command *) -1;
     }
 
+    command->exec_path = path_to_executable;
+
     command->args[0] = strdup(path_to_executable);
     if (command->args[0] == NULL) {
       if (command->redir_in_path != NULL) {
@@ -477,13 +669,46 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
       return (Command *) -1;
     }
 
-    // One by one, store arguments in args struct member
+    // One by one, store arguments in args struct member, expanding globs
+    int num_args = 1;
+    int args_capacity = arg_count + 2;
     char* token;
-    for (int i = 1; i < (arg_count + 1); i++) {
-      token = strtok_r(NULL, " \t\n", &token_for_command);
-      command->args[i] = strdup(token);
-      if (command->args[i] == NULL) {
-          for (int j = 0; j < i; j++) {
+    while ((token = strtok_r(NULL, " \t\n", &token_for_command)) != NULL) {
+      char **matches = NULL;
+      int num_matches = 0;
+      if (glob_has_magic(token)) {
+        parse_cache_skip = true;
+        num_matches = glob_expand(token, dir_cache, &matches);
+      }
+
+      // No matches keeps the word as it is, like sh does
+      int num_new = (num_matches > 0) ? num_matches : 1;
+      if (num_matches >= 0 && num_args + num_new + 1 > args_capacity) {
+        args_capacity = num_args + num_new + 1;
+        char **grown_args = realloc(command->args,
+                                    args_capacity * sizeof(char*));
+        if (grown_args == NULL) {
+          for (int j = 0; j < num_matches; j++) {
+            free(matches[j]);
+          }
+          num_matches = -1;
+        } else {
+          command->args = grown_args;
+        }
+      }
+
+      if (num_matches > 0) {
+        memcpy(command->args + num_args, matches, num_matches * sizeof(char*));
+        num_args += num_matches;
+        free(matches);
+        continue;
+      }
+      if (num_matches == 0) {
+        command->args[num_args] = strdup(token);
+      }
+      if (num_matches < 0 || command->args[num_args] == NULL) {
+          free(matches);
+          for (int j = 0; j < num_args; j++) {
             free(command->args[j]);
           }
           if (command->redir_in_path != NULL) {
@@ -498,10 +723,11 @@ Command *parse_a_command(char *line, Variable *path, bool *prev_pipe_exists,
           perror("parse_a_command");
           return (Command *) -1;
       }
+      num_args++;
     }
 
     // Making the last argument NULL so we can detect the end during freeing
-    command->args[arg_count + 1] = NULL;
+    command->args[num_args] = NULL;
 
     // Making this true to indicate that this pipe exists in the next pipe.
     // We will not run the next pipe if it contains input redirection
@@ -537,13 +763,18 @@ Command *parse_commands(char *line, Variable **variables) {
     bool prev_pipe_exists = false;
     bool output_exists = false;
 
+    // Directories read while globbing are shared by the whole line
+    DirCache dir_cache = {NULL, 0};
+
     Command *curr_command = parse_a_command(token, path_var, &prev_pipe_exists,
-                                            &output_exists);
+                                            &output_exists, &dir_cache);
 
     // If NULL or -1, parse_a_command encountered an error
     if (curr_command == NULL) {
+      dir_cache_free(&dir_cache);
       return NULL;
     } if (curr_command == (Command *) -1) {
+      dir_cache_free(&dir_cache);
       return (Command *) -1;
     }
 
@@ -557,11 +788,11 @@ Command *parse_commands(char *line, Variable **variables) {
         break;             // So, we are going to ignore the current piped token
       }
       next_command = parse_a_command(token, path_var, &prev_pipe_exists,
-                                     &output_exists);
-      if (next_command == NULL) {
-        return NULL;
-      } if (next_command == (Command *) -1) {
-        return (Command *) -1;
+                                     &output_exists, &dir_cache);
+      if (next_command == NULL || next_command == (Command *) -1) {
+        dir_cache_free(&dir_cache);
+        free_command(first_command);
+        return next_command;
       }
       curr_command->next = next_command;
       curr_command = curr_command->next;
@@ -570,9 +801,76 @@ Command *parse_commands(char *line, Variable **variables) {
       token = strtok_r(NULL, "|", &pipe_token);
     }
 
+    dir_cache_free(&dir_cache);
     return first_command;
 }
 
+// Variable names must only contain alphabetic and '_' characters
+bool valid_variable_name(const char *name) {
+    if (name[0] == '\0') {
+      return false;
+    }
+    for (int i = 0; name[i] != '\0'; i++) {
+      bool is_capital_letter = ('A' <= name[i] && name[i] <= 'Z');
+      bool is_small_letter = ('a' <= name[i] && name[i] <= 'z');
+      bool is_underscore = ('_' == name[i]);
+      if (!(is_capital_letter || is_small_letter || is_underscore)) {
+        return false;
+      }
+    }
+    return true;
+}
+
+Variable *set_variable(Variable **variables, const char *name,
+                       const char *value) {
+    Variable *curr_var = *variables;
+
+    // Traverse through the linked list to see if there is already var_name
+    while (curr_var != NULL) {
+      if (strcmp(curr_var->name, name) == 0) { // if current->name == name
+        char *new_value = strdup(value);
+        if (new_value == NULL) {
+          perror("set_variable");
+          return NULL;
+        }
+        free(curr_var->value);
+        curr_var->value = new_value;
+        variables_generation++;
+
+        if (curr_var->exported) {
+          env_mark_dirty();
+        }
+        return curr_var;
+      }
+      curr_var = curr_var->next;
+    }
+
+    Variable *new_variable = malloc(sizeof(Variable));
+    if (new_variable == NULL) {
+      perror("set_variable");
+      return NULL;
+    }
+    new_variable->name = strdup(name);
+    if (new_variable->name == NULL) {
+      free(new_variable);
+      perror("set_variable");
+      return NULL;
+    }
+    new_variable->value = strdup(value);
+    if (new_variable->value == NULL) {
+      free(new_variable->name);
+      free(new_variable);
+      perror("set_variable");
+      return NULL;
+    }
+    new_variable->exported = 0;
+    new_variable->next = *variables;
+    variables_generation++;
+
+    *variables = new_variable;
+    return new_variable;
+}
+
 Command *parse_variable_assignment(char *line, Variable **variables) {
     if (line[0] == '=') {
       // raise Error that '=' cannot be in the beginning
@@ -590,75 +888,211 @@ Command *parse_variable_assignment(char *line, Variable **variables) {
     char *var_name = strtok(line_cpy, "=");
 
     // Check validity of var_name
-    for (int i = 0; i < strlen(var_name); i++) {
-      bool is_capital_letter = ('A' <= var_name[i] && var_name[i] <= 'Z');
-      bool is_small_letter = ('a' <= var_name[i] && var_name[i] <= 'z');
-      bool is_underscore = ('_' == var_name[i]);
-      if (!(is_capital_letter || is_small_letter || is_underscore)) {
-        ERR_PRINT(ERR_VAR_NAME, var_name);
-        free(line_cpy);
-        return NULL;
-      }
+    if (!valid_variable_name(var_name)) {
+      ERR_PRINT(ERR_VAR_NAME, var_name);
+      free(line_cpy);
+      return NULL;
     }
 
-    Variable *curr_var = *variables;
+    // The value is expanded like a command line, so I=$((I + 1)) works
+    char *expanded_value = replace_variables_mk_line(
+      clear_trailing_whitespace(var_value), variables);
+    if (expanded_value == NULL || expanded_value == (char *) -1) {
+      free(line_cpy);
+      return (Command *) expanded_value;
+    }
 
-    // Traverse through the linked list to see if there is already var_name
-    while (curr_var != NULL) {
-      if (strcmp(curr_var->name, var_name) == 0) { // if current->name == name
-        free(curr_var->value);
+    if (set_variable(variables, var_name, expanded_value) == NULL) {
+      free(expanded_value);
+      free(line_cpy);
+      return (Command *) -1;
+    }
 
-        curr_var->value = strdup(var_value);
-        if (curr_var->value == NULL) {
-          free(line_cpy);
-          perror("parse_variable_assignment");
-          return (Command *) -1;
+    free(expanded_value);
+    free(line_cpy);
+    return NULL;
+}
+
+// The next blank-separated argument of export at *pos, keeping a $(...),
+// $((...)) or quoted string whole; NULL after the last
+static char *next_export_arg(char **pos) {
+    char *arg = *pos + strspn(*pos, " \t\n");
+    if (*arg == '\0') {
+      return NULL;
+    }
+    char *end = arg;
+    while (end != NULL && *end != '\0' && !isspace((unsigned char) *end)) {
+      end = (char *) list_skip_quoted(end);
+      if (end != NULL) {
+        end++;
+      }
+    }
+    // one never closed takes the rest of the line
+    if (end == NULL) {
+      end = arg + strlen(arg);
+    }
+    *pos = (*end != '\0') ? end + 1 : end;
+    *end = '\0';
+    return arg;
+}
+
+/*
+** The export builtin: `export` lists exported variables, and each
+** `NAME` or `NAME=VALUE` argument marks NAME as exported (assigning
+** it first, expanded, when a value is given). A bare NAME that is not a
+** shell variable is seeded from the inherited environment, and skipped if
+** it is unset there too. Exported variables reach the environment of every
+** command started afterwards.
+*/
+Command *parse_export(char *line, Variable **variables) {
+    char *line_cpy = strdup(line + strlen(EXPORT));
+    if (line_cpy == NULL) {
+      perror("parse_export");
+      return (Command *) -1;
+    }
+
+    char *next_arg = line_cpy;
+    char *arg = next_export_arg(&next_arg);
+    if (arg == NULL) {
+      for (Variable *var = *variables; var != NULL; var = var->next) {
+        if (var->exported) {
+          printf("export %s=%s\n", var->name, var->value);
         }
+      }
+      fflush(stdout);
+    }
 
+    while (arg != NULL) {
+      char *equals = strchr(arg, '=');
+      if (equals != NULL) {
+        (*equals) = '\0';
+      }
+      if (!valid_variable_name(arg)) {
+        ERR_PRINT(ERR_VAR_NAME, arg);
         free(line_cpy);
         return NULL;
       }
-      curr_var = curr_var->next;
+
+      Variable *var = *variables;
+      while (var != NULL && strcmp(var->name, arg) != 0) {
+        var = var->next;
+      }
+      // a bare NAME that is not a shell variable takes the value it was
+      // inherited with; one unset in the environment too is left unset
+      const char *inherited = NULL;
+      if (equals == NULL && var == NULL) {
+        inherited = getenv(arg);
+        if (inherited == NULL) {
+          arg = next_export_arg(&next_arg);
+          continue;
+        }
+      }
+      if (equals != NULL || var == NULL) {
+        // the value is expanded like an assignment's, so PATH=$PATH:... works
+        char *value = (equals != NULL)
+            ? replace_variables_mk_line(equals + 1, variables)
+            : strdup(inherited);
+        if (value == NULL || value == (char *) -1) {
+          free(line_cpy);
+          return (equals != NULL) ? (Command *) value : (Command *) -1;
+        }
+        var = set_variable(variables, arg, value);
+        free(value);
+        if (var == NULL) {
+          free(line_cpy);
+          return (Command *) -1;
+        }
+      }
+      if (!var->exported) {
+        var->exported = NON_ZERO_BYTE;
+        variables_generation++;
+        env_mark_dirty();
+      }
+
+      arg = next_export_arg(&next_arg);
     }
 
-    Variable *new_variable = malloc(sizeof(Variable));
-    if (new_variable == NULL) {
-      free(line_cpy);
-      perror("parse_variable_assignment");
+    free(line_cpy);
+    return NULL;
+}
+
+Command *parse_expanded_line(char *line, Variable **variables) {
+
+    // watch [OPTION]..., timeout [-k GRACE] DURATION and memo [-i FILE]...
+    // are stripped, in that order, before the pipeline is parsed
+    WatchSpec *watch = NULL;
+    char *pipeline = watch_parse_prefix(line, variables, &watch);
+    if (pipeline == (char *) -1) {
       return (Command *) -1;
     }
-    new_variable->name = strdup(var_name);
-    if (new_variable->name == NULL) {
-      free(new_variable);
-      free(line_cpy);
-      perror("parse_variable_assignment");
-      return (Command *) -1;
+    if (pipeline == NULL) {
+      pipeline = line;
+    } else if (watch == NULL) {
+      return NULL;
     }
-    new_variable->value = strdup(var_value);
-    if (new_variable->value == NULL) {
-      free(new_variable->name);
-      free(new_variable);
-      free(line_cpy);
-      perror("parse_variable_assignment");
+
+    int64_t timeout_ns, grace_ns;
+    char *timeout_pipeline = timeout_parse_prefix(pipeline, *variables,
+                                                  &timeout_ns, &grace_ns);
+    if (timeout_ns < 0) {
+      watch_free(watch);
+      return NULL;
+    }
+    if (timeout_pipeline != NULL) {
+      pipeline = timeout_pipeline;
+    }
+
+    char **memo_inputs = NULL;
+    char *memo_pipeline = memo_parse_prefix(pipeline, &memo_inputs);
+    if (memo_pipeline == (char *) -1) {
+      watch_free(watch);
       return (Command *) -1;
     }
-    new_variable->next = *variables;
+    if (memo_pipeline != NULL) {
+      pipeline = memo_pipeline;
+    }
 
-    *variables = new_variable;
+    Command *parsed_command = parse_commands(pipeline, variables);
 
-    free(line_cpy);
-    return NULL;
+    // In case parse_commands returned due to an error.
+    if (parsed_command == (Command *) -1 || parsed_command == NULL) {
+      for (int i = 0; memo_inputs != NULL && memo_inputs[i] != NULL; i++) {
+        free(memo_inputs[i]);
+      }
+      free(memo_inputs);
+      watch_free(watch);
+      return parsed_command;
+    }
+    parsed_command = optimize_pipeline(parsed_command);
+
+    if (memo_inputs != NULL) {
+      parsed_command->memo = NON_ZERO_BYTE;
+      parsed_command->memo_inputs = memo_inputs;
+    }
+    parsed_command->watch = watch;
+    parsed_command->timeout_ns = timeout_ns;
+    parsed_command->timeout_grace_ns = grace_ns;
+
+    // Rebuilds the child environment only if an export changed
+    if (env_refresh(*variables) < 0) {
+      free_command(parsed_command);
+      return (Command *) -1;
+    }
+
+    return parsed_command;
 }
 
 Command *parse_line(char *line, Variable **variables) {
 
+    METRIC_ADD(*metrics, lines_parsed, 1);
+
     // Dynamically allocating, so we can modify in case it's from read-only mem.
-    line = strdup(line);
-    if (strlen(line) == 0) {
-      ERR_PRINT(ERR_EXECUTE_LINE);
-      free(line);
-      return NULL;
+    char *line_copy = strdup(line);
+    if (line_copy == NULL) {
+      perror("parse_line");
+      return (Command *) -1;
     }
+    line = line_copy;
 
     // Remove the part including and after first #
     char* hashtag = strchr(line, '#');
@@ -666,52 +1100,38 @@ Command *parse_line(char *line, Variable **variables) {
       (*hashtag) = '\0';
     }
 
-    if ((*line) == '\0') {
-      ERR_PRINT(ERR_EXECUTE_LINE);
-      free(line);
-      return NULL;
-    }
-
     line = clear_leading_whitespace(line);
 
+    Command *parsed_command;
     if (strlen(line) == 0) {
       ERR_PRINT(ERR_EXECUTE_LINE);
-      return NULL;
+      parsed_command = NULL;
     }
 
-    char *ptr_to_equals = strchr(line, '=');
-
-    /* No = in line (so it's a command execution) or = in line, but there is a
-    space right before it (so it's a not variable assignment). */
-    if (ptr_to_equals == NULL || isspace(ptr_to_equals[-1])) {
-
-      char *new_line = replace_variables_mk_line(line, *variables);
-      if (new_line == (char *) -1) {
-        return (Command *) -1;
-      } if (new_line == NULL) {
-        return NULL;
-      }
-
-      Command *parsed_command = parse_commands(new_line, variables);
+    else if (strncmp(line, EXPORT, strlen(EXPORT)) == 0 &&
+        (line[strlen(EXPORT)] == '\0' || isspace(line[strlen(EXPORT)]))) {
+      parsed_command = parse_export(line, variables);
+    }
 
-      // In case parse_commands returned due to an error.
-      if (parsed_command == (Command *) -1) {
-        free(new_line);
-        return (Command *) -1;
-      }
+    /* No = in the first word (so it's a command execution, even if an argument
+    holds one, e.g. `[ $A != b ]`). */
+    else if (line[strcspn(line, "= \t\n")] != '=') {
 
-      if (parsed_command == NULL) {
+      char *new_line = replace_variables_mk_line(line, variables);
+      if (new_line == (char *) -1 || new_line == NULL) {
+        parsed_command = (Command *) new_line;
+      } else {
+        parsed_command = parse_expanded_line(new_line, variables);
         free(new_line);
-        return NULL;
       }
 
-      free(new_line);
-      return parsed_command;
-
     // = in line and no space right before it. So, it is a variable assignment.
     } else {
-      return parse_variable_assignment(line, variables);
+      parsed_command = parse_variable_assignment(line, variables);
     }
+
+    free(line_copy);
+    return parsed_command;
 }
 
 
@@ -725,100 +1145,181 @@ Command *parse_line(char *line, Variable **variables) {
 ** Returns NULL if replacement parsing had an error, or (char *) -1 if
 ** system calls fail and the shell needs to exit.
 */
-char *replace_variables_mk_line(const char *line, Variable *variables) {
+// Appends len chars of str to the heap line, growing it as needed
+static int append_to_line(char **line, size_t *len, size_t *capacity,
+                          const char *str, size_t str_len) {
+    if (*len + str_len + 1 > *capacity) {
+      size_t new_capacity = *capacity * 2;
+      while (*len + str_len + 1 > new_capacity) {
+        new_capacity *= 2;
+      }
+      char *grown = realloc(*line, new_capacity);
+      if (grown == NULL) {
+        return -1;
+      }
+      *line = grown;
+      *capacity = new_capacity;
+    }
+    memcpy(*line + *len, str, str_len);
+    *len += str_len;
+    (*line)[*len] = '\0';
+    return 0;
+}
 
-    // NULL terminator accounted for here
-    char new_line_ptr[MAX_SINGLE_LINE + 1]; // ptr to the start of our new_line
-    char* new_line = new_line_ptr;
+char *replace_variables_mk_line(const char *line, Variable **variables) {
 
+    size_t capacity = strlen(line) + 64;
+    size_t len = 0;
+    char *new_line = malloc(capacity);
+    if (new_line == NULL) {
+      perror("replace_variables_mk_line");
+      return (char *) -1;
+    }
+    new_line[0] = '\0';
 
     const char *tracker = line;
 
     while (*tracker != '\0') {
 
-      // If we hit '$', stop here
-      if (*tracker == '$') {
-
-        const char *parse_var_st, *parse_var_end;
-        // We have two options: either ${smth} or $smth
-        if (*(tracker + 1) == '{') {
+      // Copy everything up to the next '$' as it is
+      if (*tracker != '$') {
+        size_t literal_len = strcspn(tracker, "$");
+        if (append_to_line(&new_line, &len, &capacity, tracker,
+                           literal_len) < 0) {
+          goto replace_alloc_error;
+        }
+        tracker += literal_len;
+        continue;
+      }
 
-          parse_var_st = tracker + 2; // ptr to the start of VAR_NAME
-          parse_var_end = parse_var_st;
+      // $((expression)) is evaluated in the shell
+      if (strncmp(tracker, ARITH_START, strlen(ARITH_START)) == 0) {
+        const char *expr_st = tracker + strlen(ARITH_START);
+        const char *expr_end = arith_find_end(expr_st);
+        if (expr_end == NULL) {
+          ERR_PRINT(ERR_PARSING_LINE);
+          free(new_line);
+          return NULL;
+        }
 
-          while ( (*parse_var_end) != '}' && (*parse_var_end) != '\0' ) {
-            parse_var_end++;
-          }
-          if ((*parse_var_end) == '\0') {
-            ERR_PRINT(ERR_PARSING_LINE);
-            return NULL;
-          }
+        ArithExpr *expr = arith_lookup(expr_st, expr_end - expr_st);
+        if (expr == (ArithExpr *) -1) {
+          goto replace_alloc_error;
+        }
+        int64_t result;
+        int error = (expr == NULL) ? 1 : arith_eval(expr, variables, &result);
+        if (error != 0) {
+          free(new_line);
+          return (error < 0) ? (char *) -1 : NULL;
+        }
 
-          int var_name_len = parse_var_end - parse_var_st + 1; // considering \0
-          char var_name[var_name_len];
-          strncpy(var_name, parse_var_st, var_name_len);
-          var_name[var_name_len - 1] = '\0';
-
-          Variable *curr_var = variables;
-          while (curr_var != NULL) {
-            if ( strcmp(curr_var->name, var_name) == 0 ) {
-              strncat(new_line, curr_var->value, strlen(curr_var->value));
-              new_line += strlen(curr_var->value);
-              tracker += strlen(curr_var->name) + 3; // '$' + '{' + '}'
-              break;
-            }
-            curr_var = curr_var->next;
-          } if (curr_var == NULL) {
-            ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
-            return NULL;
-          }
-        } else {
+        char number[32];
+        int number_len = snprintf(number, sizeof(number), "%lld",
+                                  (long long) result);
+        if (append_to_line(&new_line, &len, &capacity, number,
+                           number_len) < 0) {
+          goto replace_alloc_error;
+        }
+        tracker = expr_end + strlen(ARITH_END);
+        continue;
+      }
 
-          parse_var_st = tracker + 1; // ptr to the start of VAR_NAME
-          parse_var_end = parse_var_st;
+      // $(pipeline) is replaced by what the pipeline prints
+      if (strncmp(tracker, SUBST_START, strlen(SUBST_START)) == 0) {
+        const char *cmd_st = tracker + strlen(SUBST_START);
+        const char *cmd_end = subst_find_end(cmd_st);
+        if (cmd_end == NULL) {
+          ERR_PRINT(ERR_PARSING_LINE);
+          free(new_line);
+          return NULL;
+        }
 
-          while ( !(isspace(*parse_var_end)) && (*parse_var_end) != '\0'
-                    && (*parse_var_end) != '$') {
-            parse_var_end++;
-          }
+        parse_cache_skip = true;
+        char *output = subst_run(cmd_st, cmd_end - cmd_st, variables);
+        if (output == NULL || output == (char *) -1) {
+          free(new_line);
+          return output;
+        }
+        int error = append_to_line(&new_line, &len, &capacity, output,
+                                   strlen(output));
+        free(output);
+        if (error < 0) {
+          goto replace_alloc_error;
+        }
+        tracker = cmd_end + strlen(SUBST_END);
+        continue;
+      }
 
-          int var_name_len = parse_var_end - parse_var_st + 1; // including \0
-          char var_name[var_name_len];
-          strncpy(var_name, parse_var_st, var_name_len);
-          var_name[var_name_len - 1] = '\0';
-
-          Variable *curr_var = variables;
-          while (curr_var != NULL) {
-            if ( strcmp(curr_var->name, var_name) == 0 ) {
-              strncat(new_line, curr_var->value, strlen(curr_var->value));
-              new_line += strlen(curr_var->value);
-              tracker += strlen(curr_var->name) + 1; // + '$'
-              break;
-            }
-            curr_var = curr_var->next;
-          } if (curr_var == NULL) {
-            ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
-            return NULL;
-          }
+      // $? is the exit status of the line before
+      if (strncmp(tracker, LAST_STATUS_VAR, strlen(LAST_STATUS_VAR)) == 0) {
+        parse_cache_skip = true;
+        char number[16];
+        int number_len = snprintf(number, sizeof(number), "%d", last_status);
+        if (append_to_line(&new_line, &len, &capacity, number,
+                           number_len) < 0) {
+          goto replace_alloc_error;
         }
+        tracker += strlen(LAST_STATUS_VAR);
+        continue;
       }
-      if ( (*tracker) != '$' && (*tracker) != '\0' ) {
-        (*new_line) = (*tracker);
-        *(new_line+1) = '\0';
-        new_line++;
-        tracker++;
+
+      const char *parse_var_st, *parse_var_end;
+      // We have two options: either ${smth} or $smth
+      if (*(tracker + 1) == '{') {
+
+        parse_var_st = tracker + 2; // ptr to the start of VAR_NAME
+        parse_var_end = parse_var_st;
+
+        while ( (*parse_var_end) != '}' && (*parse_var_end) != '\0' ) {
+          parse_var_end++;
+        }
+        if ((*parse_var_end) == '\0') {
+          ERR_PRINT(ERR_PARSING_LINE);
+          free(new_line);
+          return NULL;
+        }
+        tracker = parse_var_end + 1; // '$' + '{' + name + '}'
       } else {
-        (*new_line) = '\0';
+
+        parse_var_st = tracker + 1; // ptr to the start of VAR_NAME
+        parse_var_end = parse_var_st;
+
+        while ( !(isspace(*parse_var_end)) && (*parse_var_end) != '\0'
+                  && (*parse_var_end) != '$') {
+          parse_var_end++;
+        }
+        tracker = parse_var_end; // '$' + name
       }
-    }
 
-    char *new_line_malloced = strdup(new_line_ptr);
-    if (new_line == NULL) {
-        perror("replace_variables_mk_line");
-        return (char *) -1;
+      int var_name_len = parse_var_end - parse_var_st + 1; // including \0
+      char var_name[var_name_len];
+      strncpy(var_name, parse_var_st, var_name_len);
+      var_name[var_name_len - 1] = '\0';
+
+      Variable *curr_var = *variables;
+      while (curr_var != NULL) {
+        if ( strcmp(curr_var->name, var_name) == 0 ) {
+          break;
+        }
+        curr_var = curr_var->next;
+      }
+      if (curr_var == NULL) {
+        ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
+        free(new_line);
+        return NULL;
+      }
+      if (append_to_line(&new_line, &len, &capacity, curr_var->value,
+                         strlen(curr_var->value)) < 0) {
+        goto replace_alloc_error;
+      }
     }
 
-    return new_line_malloced;
+    return new_line;
+
+replace_alloc_error:
+    perror("replace_variables_mk_line");
+    free(new_line);
+    return (char *) -1;
 }
 
 void free_variable(Variable *var, uint8_t recursive) {
@@ -826,11 +1327,14 @@ void free_variable(Variable *var, uint8_t recursive) {
     Variable *curr = var;
     Variable *temp;
 
-    while (curr == NULL) {
+    while (curr != NULL) {
       temp = curr->next;
       free(curr->name);
       free(curr->value);
       free(curr);
+      if (!recursive) {
+        break;
+      }
       curr = temp;
     }
 }
@@ -0,0 +1,209 @@
+#include "cscshell.h"
+
+/*
+** Interactive lines are parsed through a small LRU cache keyed by the
+** line as typed and variables_generation, which every change to a
+** variable bumps. A hit hands back a copy of the parsed commands, so
+** the line is not expanded, globbed or resolved against PATH again.
+**
+** Lines that parse to nothing (assignments, export) are not cached, nor
+** are lines whose parse printed an error or changed a variable, or that
+** globbed, ran a $(...) (parse_cache_skip) or carry a watch prefix. A
+** hit whose executable has since gone, or that another command installed
+** earlier in PATH could now shadow (path_generation), is parsed again.
+** The parsecache builtin prints the hit rate.
+*/
+
+typedef struct ParseCacheEntry {
+    char *line;
+    uint64_t hash;
+    uint64_t generation;
+    uint64_t path_generation;
+    uint64_t last_used;
+    Command *commands;      // the template; only ever copied
+} ParseCacheEntry;
+
+uint64_t variables_generation = 0;
+bool parse_cache_skip = false;
+
+static ParseCacheEntry entries[PARSE_CACHE_SIZE];
+static uint64_t clock_ticks = 0;
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+
+
+static char **copy_strings(char **strs){
+    size_t count = 0;
+    while (strs[count] != NULL) count++;
+    char **copy = calloc(count + 1, sizeof(char *));
+    if (copy == NULL){
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++){
+        if ((copy[i] = strdup(strs[i])) == NULL){
+            for (size_t j = 0; j < i; j++) free(copy[j]);
+            free(copy);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+
+// A copy of a single stage; NULL if memory ran out
+static Command *copy_stage(const Command *stage){
+    Command *copy = calloc(1, sizeof(Command));
+    if (copy == NULL){
+        return NULL;
+    }
+    *copy = *stage;
+    copy->next = NULL;
+    copy->redir_in_path = NULL;
+    copy->redir_out_path = NULL;
+    copy->memo_inputs = NULL;
+    copy->watch = NULL;
+    copy->exec_path = strdup(stage->exec_path);
+    copy->args = copy_strings(stage->args);
+    if (copy->exec_path == NULL || copy->args == NULL ||
+        (stage->redir_in_path != NULL &&
+         (copy->redir_in_path = strdup(stage->redir_in_path)) == NULL) ||
+        (stage->redir_out_path != NULL &&
+         (copy->redir_out_path = strdup(stage->redir_out_path)) == NULL) ||
+        (stage->memo_inputs != NULL &&
+         (copy->memo_inputs = copy_strings(stage->memo_inputs)) == NULL)){
+        if (copy->args == NULL){
+            // free_command needs an args array
+            copy->args = calloc(1, sizeof(char *));
+        }
+        if (copy->args != NULL){
+            free_command(copy);
+        }
+        return NULL;
+    }
+    return copy;
+}
+
+
+static Command *copy_commands(const Command *head){
+    Command *first = NULL;
+    Command **link = &first;
+    for (const Command *stage = head; stage != NULL; stage = stage->next){
+        if ((*link = copy_stage(stage)) == NULL){
+            free_command(first);
+            perror("parse_cache_line");
+            return (Command *) -1;
+        }
+        link = &(*link)->next;
+    }
+    return first;
+}
+
+
+static void clear_entry(ParseCacheEntry *entry){
+    free(entry->line);
+    free_command(entry->commands);
+    memset(entry, 0, sizeof(ParseCacheEntry));
+}
+
+
+// True if every executable the template resolved to is still there and
+// still the first of its name in PATH
+static bool still_resolves(const ParseCacheEntry *entry){
+    const Command *head = entry->commands;
+    for (const Command *stage = head; stage != NULL; stage = stage->next){
+        if (strchr(stage->exec_path, '/') != NULL &&
+            access(stage->exec_path, F_OK) != 0){
+            return false;
+        }
+    }
+    return path_lookups_current(head, entry->path_generation);
+}
+
+
+// Keeps a copy of commands for line, in place of the least recently used
+static void store(const char *line, uint64_t hash, uint64_t generation,
+                  uint64_t path_gen, Command *commands){
+    ParseCacheEntry *slot = &entries[0];
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++){
+        if (entries[i].line == NULL){
+            slot = &entries[i];
+            break;
+        }
+        if (entries[i].last_used < slot->last_used){
+            slot = &entries[i];
+        }
+    }
+
+    // a failed copy is only a missed speedup
+    char *line_copy = strdup(line);
+    Command *template = copy_commands(commands);
+    if (line_copy == NULL || template == (Command *) -1){
+        free(line_copy);
+        if (template != (Command *) -1) free_command(template);
+        return;
+    }
+    clear_entry(slot);
+    slot->line = line_copy;
+    slot->hash = hash;
+    slot->generation = generation;
+    slot->path_generation = path_gen;
+    slot->last_used = ++clock_ticks;
+    slot->commands = template;
+}
+
+
+Command *parse_cache_line(char *line, Variable **variables){
+    uint64_t hash = fnv_bytes(FNV_OFFSET, line, strlen(line));
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++){
+        ParseCacheEntry *entry = &entries[i];
+        if (entry->line == NULL || entry->hash != hash ||
+            entry->generation != variables_generation ||
+            strcmp(entry->line, line) != 0){
+            continue;
+        }
+        if (!still_resolves(entry)){
+            clear_entry(entry);
+            break;
+        }
+        hits++;
+        entry->last_used = ++clock_ticks;
+        METRIC_ADD(*metrics, lines_parsed, 1);
+        return copy_commands(entry->commands);
+    }
+    misses++;
+
+    uint64_t generation = variables_generation;
+    int errors_before = errors_printed;
+    parse_cache_skip = false;
+    Command *commands = parse_line(line, variables);
+    if (commands != NULL && commands != (Command *) -1 &&
+        commands->watch == NULL && !parse_cache_skip &&
+        errors_printed == errors_before &&
+        variables_generation == generation){
+        store(line, hash, generation, path_generation, commands);
+    }
+    return commands;
+}
+
+
+size_t parse_cache_report(char *buf, size_t size){
+    int used = 0;
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++){
+        if (entries[i].line != NULL) used++;
+    }
+    uint64_t lookups = hits + misses;
+    size_t len = snprintf(buf, size,
+                          "entries %d/%d\nhits %llu\nmisses %llu\n"
+                          "hit_rate %.1f%%\n",
+                          used, PARSE_CACHE_SIZE, (unsigned long long) hits,
+                          (unsigned long long) misses,
+                          lookups ? 100.0 * hits / lookups : 0.0);
+    return (len < size) ? len : size - 1;
+}
+
+
+void parse_cache_free(){
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++){
+        clear_entry(&entries[i]);
+    }
+}
@@ -0,0 +1,389 @@
+#include "cscshell.h"
+
+/*
+** --record FILE logs every line the shell runs; --replay FILE runs the
+** logged lines again. A recording is RECORD_MAGIC, the format version
+** and the wall clock time the session started, followed by one record
+** per top-level line (a block is one record holding all its lines):
+**
+**   length of the rest, start (ns since the session started), parse ns,
+**   run ns, exit status, the input text, the expanded commands, and
+**   the number of resolved executables followed by each of them
+**
+** Numbers are LEB128 varints (the status zigzagged) and strings are a
+** varint length followed by the bytes, so a record of a short line is
+** a few dozen bytes. Lines the lookahead parsed ahead of time show a
+** parse time of about zero.
+*/
+
+typedef struct RecordBuf {
+    char *data;
+    size_t len;
+    size_t capacity;
+} RecordBuf;
+
+static FILE *record_file = NULL;
+static int64_t session_start;
+
+// the record of the line being run
+static bool in_line = false;
+static int64_t line_start;
+static int64_t parse_end;
+static RecordBuf text;
+static RecordBuf expanded;
+static RecordBuf execs;
+static uint64_t num_execs;
+static RecordBuf out;
+
+
+static int buf_append(RecordBuf *buf, const void *data, size_t len){
+    if (buf->len + len > buf->capacity){
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 256;
+        while (buf->len + len > capacity){
+            capacity *= 2;
+        }
+        char *grown = realloc(buf->data, capacity);
+        if (grown == NULL){
+            perror("record");
+            return -1;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+
+static int put_varint(RecordBuf *buf, uint64_t value){
+    uint8_t bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value != 0){
+            bytes[n] |= 0x80;
+        }
+        n++;
+    } while (value != 0);
+    return buf_append(buf, bytes, n);
+}
+
+
+static int put_string(RecordBuf *buf, const char *str, size_t len){
+    if (put_varint(buf, len) < 0){
+        return -1;
+    }
+    return buf_append(buf, str, len);
+}
+
+
+static void buf_free(RecordBuf *buf){
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->capacity = 0;
+}
+
+
+int record_open(const char *path){
+    record_file = fopen(path, "wb");
+    if (record_file == NULL){
+        perror("record_open");
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t wall_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    uint32_t version = RECORD_VERSION;
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_file);
+    fwrite(&version, sizeof(version), 1, record_file);
+    fwrite(&wall_ns, sizeof(wall_ns), 1, record_file);
+    session_start = metrics_now();
+    return 0;
+}
+
+
+void record_begin(const char *line){
+    if (record_file == NULL){
+        return;
+    }
+    in_line = true;
+    line_start = metrics_now();
+    parse_end = 0;
+    text.len = expanded.len = execs.len = 0;
+    num_execs = 0;
+    buf_append(&text, line, strlen(line));
+}
+
+
+// Rebuilds the line as it ran: every stage's args and redirects
+static void add_expanded(Command *head){
+    if (expanded.len > 0){
+        buf_append(&expanded, "\n", 1);
+    }
+    for (Command *command = head; command != NULL; command = command->next){
+        if (command != head){
+            buf_append(&expanded, " | ", 3);
+        }
+        for (int i = 0; command->args[i] != NULL; i++){
+            if (i > 0){
+                buf_append(&expanded, " ", 1);
+            }
+            buf_append(&expanded, command->args[i], strlen(command->args[i]));
+        }
+        if (command->redir_in_path != NULL){
+            buf_append(&expanded, " < ", 3);
+            buf_append(&expanded, command->redir_in_path,
+                       strlen(command->redir_in_path));
+        }
+        if (command->redir_out_path != NULL){
+            const char *op = command->redir_append ? " >> " : " > ";
+            buf_append(&expanded, op, strlen(op));
+            buf_append(&expanded, command->redir_out_path,
+                       strlen(command->redir_out_path));
+        }
+    }
+}
+
+
+void record_commands(Command *head){
+    if (!in_line){
+        return;
+    }
+    // the first line of commands ends the parse phase of the record
+    if (parse_end == 0){
+        parse_end = metrics_now();
+    }
+    add_expanded(head);
+    for (Command *command = head; command != NULL; command = command->next){
+        put_string(&execs, command->exec_path, strlen(command->exec_path));
+        num_execs++;
+    }
+}
+
+
+char *record_read(char *buf, int size, void *ctx){
+    RecordSource *source = ctx;
+    char *line = source->next_line(buf, size, source->ctx);
+    if (line != NULL && in_line){
+        size_t len = strcspn(line, "\n");
+        buf_append(&text, "\n", 1);
+        buf_append(&text, line, len);
+    }
+    return line;
+}
+
+
+void record_end(int status){
+    if (!in_line){
+        return;
+    }
+    in_line = false;
+    int64_t end = metrics_now();
+    if (parse_end == 0){
+        parse_end = end;
+    }
+
+    RecordBuf body = {0};
+    put_varint(&body, line_start - session_start);
+    put_varint(&body, parse_end - line_start);
+    put_varint(&body, end - parse_end);
+    put_varint(&body, ((uint64_t) status << 1) ^ (uint64_t) (status >> 31));
+    put_string(&body, text.data, text.len);
+    put_string(&body, expanded.data, expanded.len);
+    put_varint(&body, num_execs);
+    buf_append(&body, execs.data, execs.len);
+
+    out.len = 0;
+    put_varint(&out, body.len);
+    buf_append(&out, body.data, body.len);
+    fwrite(out.data, 1, out.len, record_file);
+    buf_free(&body);
+}
+
+
+void record_close(){
+    if (record_file == NULL){
+        return;
+    }
+    fclose(record_file);
+    record_file = NULL;
+    buf_free(&text);
+    buf_free(&expanded);
+    buf_free(&execs);
+    buf_free(&out);
+}
+
+
+typedef struct Reader {
+    const uint8_t *pos;
+    const uint8_t *end;
+} Reader;
+
+
+static bool get_varint(Reader *reader, uint64_t *value){
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        if (reader->pos >= reader->end){
+            return false;
+        }
+        uint8_t byte = *reader->pos++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool get_string(Reader *reader, const char **str, size_t *len){
+    uint64_t value;
+    if (!get_varint(reader, &value) ||
+        value > (uint64_t) (reader->end - reader->pos)){
+        return false;
+    }
+    *str = (const char *) reader->pos;
+    *len = value;
+    reader->pos += value;
+    return true;
+}
+
+
+// A LineSource over the rest of a recorded block
+static char *block_read(char *buf, int size, void *ctx){
+    const char **rest = ctx;
+    if (*rest == NULL){
+        return NULL;
+    }
+    const char *newline = strchr(*rest, '\n');
+    size_t len = (newline != NULL) ? (size_t) (newline - *rest) : strlen(*rest);
+    snprintf(buf, size, "%.*s\n", (int) len, *rest);
+    *rest = (newline != NULL) ? newline + 1 : NULL;
+    return buf;
+}
+
+
+// Runs one recorded line, or block, the way run_script would
+static int replay_line(const char *line_text, size_t len, Variable **root){
+    char *copy = strndup(line_text, len);
+    if (copy == NULL){
+        perror("replay");
+        return -1;
+    }
+    char *newline = strchr(copy, '\n');
+    const char *rest = NULL;
+    if (newline != NULL){
+        *newline = '\0';
+        rest = newline + 1;
+    }
+
+    char line[MAX_SINGLE_LINE];
+    snprintf(line, sizeof(line), "%s", copy);
+    record_begin(line);
+    int status;
+    if (vm_starts_block(line)){
+        RecordSource source = {block_read, &rest};
+        status = vm_run_block(line, record_read, &source, root);
+    }
+    else {
+        status = run_line(line, root);
+    }
+    record_end(status);
+    free(copy);
+    return status;
+}
+
+
+int replay_run(const char *path, bool original_speed, Variable **root){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0){
+        perror("replay_run");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t header_len = strlen(RECORD_MAGIC) + sizeof(uint32_t) +
+                        sizeof(uint64_t);
+    uint8_t *data = malloc(st.st_size + 1);
+    if (data == NULL){
+        perror("replay_run");
+        close(fd);
+        return -1;
+    }
+    ssize_t num_read = read(fd, data, st.st_size);
+    close(fd);
+    uint32_t version;
+    if (num_read != st.st_size || (size_t) num_read < header_len ||
+        memcmp(data, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0 ||
+        (memcpy(&version, data + strlen(RECORD_MAGIC), sizeof(version)),
+         version != RECORD_VERSION)){
+        ERR_PRINT(ERR_REPLAY_FORMAT, path);
+        free(data);
+        return -1;
+    }
+
+    Reader reader = {data + header_len, data + num_read};
+    int64_t replay_start = metrics_now();
+    int64_t recorded_ns = 0;
+    int64_t replayed_ns = 0;
+    int num_lines = 0;
+    int num_differed = 0;
+    int error = 0;
+    while (reader.pos < reader.end){
+        uint64_t record_len, offset, parse_ns, run_ns, zigzag;
+        const char *line_text;
+        size_t line_len;
+        if (!get_varint(&reader, &record_len) ||
+            record_len > (uint64_t) (reader.end - reader.pos)){
+            ERR_PRINT(ERR_REPLAY_FORMAT, path);
+            error = -1;
+            break;
+        }
+        Reader body = {reader.pos, reader.pos + record_len};
+        reader.pos += record_len;
+        if (!get_varint(&body, &offset) || !get_varint(&body, &parse_ns) ||
+            !get_varint(&body, &run_ns) || !get_varint(&body, &zigzag) ||
+            !get_string(&body, &line_text, &line_len)){
+            ERR_PRINT(ERR_REPLAY_FORMAT, path);
+            error = -1;
+            break;
+        }
+        int recorded_status = (int) (zigzag >> 1) ^ -(int) (zigzag & 1);
+
+        if (original_speed){
+            int64_t wait_ns = replay_start + (int64_t) offset - metrics_now();
+            if (wait_ns > 0){
+                struct timespec delay = {wait_ns / 1000000000,
+                                         wait_ns % 1000000000};
+                while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+            }
+        }
+
+        int64_t started = metrics_now();
+        int status = replay_line(line_text, line_len, root);
+        replayed_ns += metrics_now() - started;
+        metrics_tick();
+        num_lines++;
+        recorded_ns += parse_ns + run_ns;
+        if (status != recorded_status){
+            num_differed++;
+        }
+        if (status == RUN_PARSE_FAILED && recorded_status != status){
+            fprintf(stderr, "Error parsing line in replay: %.*s\n",
+                    (int) line_len, line_text);
+        }
+        if (status == -1){
+            error = -1;
+            break;
+        }
+    }
+    free(data);
+
+    fflush(stdout);
+    fprintf(stderr, "Replayed %d lines in %.3f ms (recorded %.3f ms), "
+            "%d exit statuses differed\n", num_lines, replayed_ns / 1e6,
+            recorded_ns / 1e6, num_differed);
+    return error;
+}
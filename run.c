@@ -1,5 +1,6 @@
 #include "cscshell.h"
 
+#include <signal.h>
 
 // COMPLETE
 int cd_cscshell(const char *target_dir){
@@ -25,26 +26,68 @@ int cd_cscshell(const char *target_dir){
 }
 
 
-int *execute_line(Command *head){
-    #ifdef DEBUG
-    printf("\n***********************\n");
-    printf("BEGIN: Executing line...\n");
-    #endif
+// Set while run_script runs a plain line; blocks may assign as they go
+static Lookahead *waiting_lookahead = NULL;
 
-    if (head == NULL) {
-      return NULL;
+
+// Closes the pipe and redirect fds start_line set up for a stage that
+// will not run
+static void close_stage_fds(Command *command){
+    if (command->stdin_fd != STDIN_FILENO) {
+      close(command->stdin_fd);
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+      close(command->stdout_fd);
     }
+}
 
-    if (strcmp(head->exec_path, CD) == 0) {
-	     int *return_value = malloc(sizeof(int));
-       if (return_value == NULL) {
-         perror("execute_line");
-         return (int *) -1;
-       }
-       *return_value = cd_cscshell(head->args[1]);
-   	   return return_value;
+
+// Undoes a start_line that failed partway, given that the filters of the
+// first num_started stages are running: kills the stages already forked,
+// ends the filters, closes the fds of every stage that never got to take
+// them over, reaps and waits for everything and frees the line.
+static int abandon_line(LineJob *job, int num_started){
+    pid_t *pids = job->pids;
+    Filter **filters = job->filters;
+    Command *curr = job->head;
+    for (int i = 0; i < job->num_commands; i++) {
+        bool running = pids[i] > 0 || (filters[i] != NULL && i < num_started);
+        if (pids[i] > 0) {
+          kill(pids[i], SIGKILL);
+        }
+        else if (!running) {
+          close_stage_fds(curr);
+          if (filters[i] != NULL) {
+            filter_abandon(filters[i]);
+          }
+        }
+        curr = curr->next;
     }
 
+    // started filters first, as they may still be using an abandoned
+    // filter's ring
+    for (int i = 0; i < job->num_commands; i++) {
+        if (pids[i] > 0) {
+          waitpid(pids[i], NULL, 0);
+        }
+        else if (filters[i] != NULL && i < num_started) {
+          filter_wait(filters[i]);
+        }
+    }
+    for (int i = num_started; i < job->num_commands; i++) {
+        if (filters[i] != NULL) {
+          filter_discard(filters[i]);
+        }
+    }
+
+    free(job->pids);
+    free(job->filters);
+    free_command(job->head);
+    return -1;
+}
+
+
+int start_line(Command *head, LineJob *job, int notify_fd){
     Command *curr = head;
     Command *tail = head->next;
     int num_commands = 0;
@@ -56,32 +99,65 @@ int *execute_line(Command *head){
         curr = curr->next;
     }
 
-    // Array to store child process IDs
-    pid_t pids[num_commands];
-
-    // Set up file descriptors for pipes
-    int pipes[2];
+    job->head = head;
+    job->tail = tail;
+    job->num_commands = num_commands;
+    job->out_size = 0;
+    job->deadline = 0;
+    job->grace_ns = head->timeout_grace_ns;
+
+    // Child process IDs, and the stages of a pipeline we can run as
+    // threads instead of processes
+    job->pids = calloc(num_commands, sizeof(pid_t));
+    job->filters = calloc(num_commands, sizeof(Filter *));
+    if (job->pids == NULL || job->filters == NULL) {
+      perror("start_line");
+      free(job->pids);
+      free(job->filters);
+      for (curr = head; curr != NULL; curr = curr->next) {
+        close_stage_fds(curr);
+      }
+      free_command(head);
+      return -1;
+    }
+    pid_t *pids = job->pids;
+    Filter **filters = job->filters;
 
+    // A deadline can only be kept by signalling processes, so under one
+    // the real programs run; builtins (a bare exec_path) only exist as
+    // filters, and never block
     curr = head;
-    while (curr->next != NULL) {
-      pipe(pipes);
-      curr->stdout_fd = pipes[1];
-      curr->next->stdin_fd = pipes[0];
+    for (int i = 0; i < num_commands; i++) {
+      if (head->timeout_ns > 0 && strchr(curr->exec_path, '/') != NULL) {
+        filters[i] = NULL;
+        curr = curr->next;
+        continue;
+      }
+      filters[i] = filter_prepare(curr);
+      if (filters[i] == (Filter *) -1) {
+        filters[i] = NULL;
+        return abandon_line(job, 0);
+      }
       curr = curr->next;
     }
 
     // Redirect input/output for the first command
     if (head->redir_in_path != NULL) {
-        int fd_in = open(head->redir_in_path, O_RDONLY);
+        int fd_in = open(head->redir_in_path, O_RDONLY | O_CLOEXEC);
         if (fd_in == -1) {
             perror("open");
             ERR_PRINT(ERR_EXECUTE_LINE);
-            return (int *) -1;
+            return abandon_line(job, 0);
         }
 	      if (head->stdin_fd != STDIN_FILENO) {
 	          close(head->stdin_fd);
 	      }
         head->stdin_fd = fd_in;
+
+        struct stat in_st;
+        if (metrics_timed && fstat(fd_in, &in_st) == 0) {
+            METRIC_ADD(*metrics, bytes_redirected, in_st.st_size);
+        }
     }
 
     // Redirect output for the last command
@@ -89,52 +165,128 @@ int *execute_line(Command *head){
         int fd_out;
         if (tail->redir_append) {
             fd_out = open(tail->redir_out_path, O_WRONLY | O_CREAT |
-                          O_APPEND, 0644);
+                          O_APPEND | O_CLOEXEC, 0644);
         }
         else {
             fd_out = open(tail->redir_out_path, O_WRONLY | O_CREAT |
-                          O_TRUNC, 0644);
+                          O_TRUNC | O_CLOEXEC, 0644);
         }
         if (fd_out == -1) {
             perror("open");
-            return (int *) -1;
+            return abandon_line(job, 0);
         }
 	      if (tail->stdout_fd != STDOUT_FILENO) {
 	          close(tail->stdout_fd);
 	      }
         tail->stdout_fd = fd_out;
+
+        // size of the output file before the line, to count what it wrote
+        struct stat out_st;
+        if (metrics_timed && fstat(fd_out, &out_st) == 0) {
+            job->out_size = out_st.st_size;
+        }
     }
 
+    // Fork everything before any thread starts. Each pipe is made just
+    // before the stage writing into it, and the shell closes its copies
+    // as soon as that stage is forked, so it only ever holds the read end
+    // waiting for the next stage (plus whatever filters keep open).
+    // Two filters share a ring instead.
+    int pipes[2];
     curr = head;
     int i = 0;
     while (curr != NULL) {
-        pids[i] = run_command(curr);
-        if (pids[i] == -1) {
-          return (int *) -1;
+        if (curr->next != NULL) {
+          if (filters[i] != NULL && filters[i + 1] != NULL) {
+            if (filter_connect(filters[i], filters[i + 1]) < 0) {
+              return abandon_line(job, 0);
+            }
+          }
+          else if (pipe2(pipes, O_CLOEXEC) < 0) {
+            perror("execute_line");
+            return abandon_line(job, 0);
+          }
+          else {
+            curr->stdout_fd = pipes[1];
+            curr->next->stdin_fd = pipes[0];
+          }
+        }
+
+        if (filters[i] != NULL) {
+          filter_set_fds(filters[i], curr->stdin_fd, curr->stdout_fd);
+          if (notify_fd >= 0) {
+            filter_set_notify(filters[i], notify_fd);
+          }
+          pids[i] = 0;
+        }
+        else {
+          pids[i] = run_command(curr);
+          if (pids[i] == -1) {
+            return abandon_line(job, 0);
+          }
         }
         i++;
         curr = curr->next;
     }
+    for (i = 0; i < num_commands; i++) {
+        if (filters[i] != NULL && filter_start(filters[i]) < 0) {
+          return abandon_line(job, i);
+        }
+    }
 
     #ifdef DEBUG
     printf("All children created\n");
     #endif
 
+    job->wait_start = metrics_timed ? metrics_now() : 0;
+    if (head->timeout_ns > 0) {
+      job->deadline = metrics_now() + head->timeout_ns;
+    }
+    return 0;
+}
+
+
+int *finish_line(LineJob *job){
+    // a line with a deadline is signalled when it passes, then reaped
+    int timed_out = 0;
+    if (job->deadline > 0) {
+      timed_out = timeout_wait(job);
+    }
+
     int status;
-    for (int i = 0; i < num_commands; i++) {
-        waitpid(pids[i], &status, 0);
+    for (int i = 0; i < job->num_commands; i++) {
+        if (job->filters[i] != NULL) {
+          status = W_EXITCODE(filter_wait(job->filters[i]), 0);
+        }
+        else {
+          waitpid(job->pids[i], &status, 0);
+        }
+    }
+    if (metrics_timed) {
+        metrics_observe(&metrics->wait, metrics_now() - job->wait_start);
+
+        struct stat out_st;
+        Command *tail = job->tail;
+        if (tail->redir_out_path != NULL &&
+            stat(tail->redir_out_path, &out_st) == 0 &&
+            out_st.st_size > job->out_size) {
+            METRIC_ADD(*metrics, bytes_redirected,
+                       out_st.st_size - job->out_size);
+        }
     }
 
     #ifdef DEBUG
     printf("All children finished\n");
     #endif
 
-    #ifdef DEBUG
-    printf("END: Executing line...\n");
-    printf("***********************\n\n");
-    #endif
+    if (timed_out > 0) {
+      ERR_PRINT(ERR_TIMEOUT, job->head->args[0]);
+      status = W_EXITCODE(TIMEOUT_STATUS, 0);
+    }
 
-    free_command(head);
+    free(job->pids);
+    free(job->filters);
+    free_command(job->head);
 
     if (WIFEXITED(status)) {
         int *ret = malloc(sizeof(int));
@@ -148,6 +300,56 @@ int *execute_line(Command *head){
     return NULL;
 }
 
+
+int *execute_line(Command *head){
+    #ifdef DEBUG
+    printf("\n***********************\n");
+    printf("BEGIN: Executing line...\n");
+    #endif
+
+    if (head == NULL) {
+      return NULL;
+    }
+
+    if (strcmp(head->exec_path, CD) == 0) {
+	     int *return_value = malloc(sizeof(int));
+       if (return_value == NULL) {
+         perror("execute_line");
+         return (int *) -1;
+       }
+       *return_value = cd_cscshell(head->args[1]);
+       free_command(head);
+   	   return return_value;
+    }
+
+    if (head->watch != NULL) {
+      return watch_execute_line(head);
+    }
+
+    if (head->memo) {
+      return memo_execute_line(head);
+    }
+
+    LineJob job;
+    if (start_line(head, &job, -1) < 0) {
+      return (int *) -1;
+    }
+
+    // use the time the children run to parse the next lines of the script
+    if (waiting_lookahead != NULL) {
+      lookahead_fill(waiting_lookahead);
+    }
+
+    int *ret = finish_line(&job);
+
+    #ifdef DEBUG
+    printf("END: Executing line...\n");
+    printf("***********************\n\n");
+    #endif
+
+    return ret;
+}
+
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
@@ -177,20 +379,38 @@ int run_command(Command *command){
            command->stdin_fd, command->stdout_fd);
     #endif
 
+    // The write end closes when the child execs, which stops the clock
+    int exec_pipe[2] = {-1, -1};
+    int64_t fork_start = 0;
+    if (metrics_timed) {
+        if (pipe2(exec_pipe, O_CLOEXEC) < 0) {
+            exec_pipe[0] = exec_pipe[1] = -1;
+        }
+        fork_start = metrics_now();
+    }
+
     pid_t pid = fork();
 
     if (pid < 0) {
         // Fork failed
         perror("fork");
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
         return -1;
     }
     else if (pid == 0) {
         // Child process
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+        }
+
         // Assign file descriptors using dup2
         if (command->stdin_fd != STDIN_FILENO) {
             if (dup2(command->stdin_fd, STDIN_FILENO) == -1) {
                 perror("dup2");
-                return -1;
+                _exit(EXEC_FAILED_STATUS);
             }
             close(command->stdin_fd);
         }
@@ -198,18 +418,32 @@ int run_command(Command *command){
         if (command->stdout_fd != STDOUT_FILENO) {
             if (dup2(command->stdout_fd, STDOUT_FILENO) == -1) {
                 perror("dup2");
-                return -1;
+                _exit(EXEC_FAILED_STATUS);
             }
             close(command->stdout_fd);
         }
 
-        // Execute the command
-        if (execv(command->exec_path, command->args) == -1) {
-            perror("execv");
-            return -1;
-        }
+        // Nothing past stderr reaches the program, not even fds the shell
+        // inherited or opened without O_CLOEXEC (like the script itself).
+        // They are only marked, so the exec pipe stays open until exec.
+        close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+
+        // Execute the command. The child shares the shell's stdio buffers
+        // and metrics, so it must leave without flushing or cleaning up.
+        execve(command->exec_path, command->args, env_current());
+        perror("execve");
+        _exit(EXEC_FAILED_STATUS);
     } else {
         // Parent process
+        METRIC_ADD(*metrics, commands_spawned, 1);
+        if (exec_pipe[0] >= 0) {
+            char unused;
+            close(exec_pipe[1]);
+            while (read(exec_pipe[0], &unused, 1) < 0 && errno == EINTR);
+            close(exec_pipe[0]);
+            metrics_observe(&metrics->fork_exec, metrics_now() - fork_start);
+        }
+
         // Close file descriptors from the command struct
         if (command->stdin_fd != STDIN_FILENO) {
             close(command->stdin_fd);
@@ -231,6 +465,137 @@ int run_command(Command *command){
 }
 
 
+int last_status = 0;
+
+
+int run_parsed_line(Command *commands){
+  if (commands == (Command *) -1) {
+      return RUN_PARSE_FAILED;
+  }
+  if (commands == NULL) {
+      last_status = 0;
+      return 0;
+  }
+  record_commands(commands);
+
+  int *last_ret_code_pt = execute_line(commands);
+  if (last_ret_code_pt == (int *) -1) {
+      return -1;
+  }
+  // killed by a signal
+  if (last_ret_code_pt == NULL) {
+      last_status = 1;
+      return 1;
+  }
+
+  // cd reports its failure as -1
+  int status = (*last_ret_code_pt < 0) ? 1 : *last_ret_code_pt;
+  free(last_ret_code_pt);
+  last_status = status;
+  return status;
+}
+
+
+// Calls the function line names, after expanding its arguments
+static int run_function_line(Function *function, char *line, Variable **root){
+  char text[MAX_SINGLE_LINE];
+  snprintf(text, sizeof(text), "%s", line);
+  text[strcspn(text, "#")] = '\0';
+
+  METRIC_ADD(*metrics, lines_parsed, 1);
+  char *expanded = replace_variables_mk_line(text, root);
+  if (expanded == (char *) -1) {
+      return -1;
+  }
+  if (expanded == NULL) {
+      METRIC_ADD(*metrics, parse_errors, 1);
+      return 1;
+  }
+  int status = vm_call(function, expanded, root);
+  free(expanded);
+  return status;
+}
+
+
+typedef Command *(*LineParser)(char *, Variable **);
+
+static int run_list(CommandList *list, Variable **root, LineParser parse);
+
+
+// Runs line, parsing it with parse unless it calls a function or is a
+// list of lines
+static int run_line_with(char *line, Variable **root, LineParser parse){
+  CommandList *list = list_parse(line);
+  if (list == (CommandList *) -1) {
+      return -1;
+  }
+  if (list != NULL) {
+      int status = run_list(list, root, parse);
+      list_free(list);
+      return status;
+  }
+
+  Function *function = vm_find_function(line);
+  if (function != NULL) {
+      int status = run_function_line(function, line, root);
+      if (status >= 0) {
+          last_status = status;
+      }
+      return status;
+  }
+
+  int errors_before = errors_printed;
+  Command *commands = parse(line, root);
+  if (commands == (Command *) -1 || errors_printed != errors_before) {
+      METRIC_ADD(*metrics, parse_errors, 1);
+  }
+  int status = run_parsed_line(commands);
+  // a line that printed why it could not run, e.g. an unknown command
+  if (commands == NULL && errors_printed != errors_before) {
+      status = last_status = 1;
+  }
+  return status;
+}
+
+
+// Runs each element of list whose && or || the status before allows
+static int run_list(CommandList *list, Variable **root, LineParser parse){
+  if (list->count == 0) {
+      last_status = 1;
+      return 1;
+  }
+
+  int status = 0;
+  for (int i = 0; i < list->count; i++) {
+      if ((list->ops[i] == LIST_OP_AND && status != 0) ||
+          (list->ops[i] == LIST_OP_OR && status == 0)) {
+          continue;
+      }
+      char *element = list->elements[i];
+      if (vm_starts_block(element)) {
+          ERR_PRINT(ERR_LIST_BLOCK, element);
+          status = last_status = 1;
+          continue;
+      }
+      status = run_line_with(element, root, parse);
+      if (status < 0) {
+          return status;
+      }
+  }
+  return status;
+}
+
+
+int run_line(char *line, Variable **root){
+  return run_line_with(line, root, parse_line);
+}
+
+
+int run_cached_line(char *line, Variable **root){
+  return run_line_with(line, root, parse_cache_line);
+}
+
+
 int run_script(char *file_path, Variable **root){
   FILE *file = fopen(file_path, "r");
   if (file == NULL) {
@@ -239,31 +604,56 @@ int run_script(char *file_path, Variable **root){
   }
 
   char line[MAX_SINGLE_LINE];
+  Lookahead *ahead = malloc(sizeof(Lookahead));
+  if (ahead == NULL) {
+      perror("run_script");
+      fclose(file);
+      return -1;
+  }
+  lookahead_init(ahead, file, root);
 
-  while (fgets(line, MAX_SINGLE_LINE, file) != NULL) {
+  Command *prepared;
+  while (lookahead_next(ahead, line, MAX_SINGLE_LINE, &prepared) != NULL) {
       // Remove newline character if present
       if (line[strlen(line) - 1] == '\n') {
           line[strlen(line) - 1] = '\0';
       }
 
-      Command *commands = parse_line(line, root);
-      if (commands == (Command *) -1) {
+      int status;
+      record_begin(line);
+      if (prepared != NULL) {
+          waiting_lookahead = ahead;
+          status = run_parsed_line(prepared);
+      } else if (vm_starts_block(line)) {
+          RecordSource source = {lookahead_read, ahead};
+          status = vm_run_block(line, record_read, &source, root);
+      } else {
+          // a function body or list may still assign or cd while its
+          // commands run, so nothing after it is parsed until it is done
+          if (!changes_shell_state(line)) {
+              waiting_lookahead = ahead;
+          }
+          status = run_line(line, root);
+      }
+      waiting_lookahead = NULL;
+      record_end(status);
+      metrics_tick();
+
+      if (status == RUN_PARSE_FAILED) {
           fprintf(stderr, "Error parsing line in script: %s\n", line);
+          lookahead_free(ahead);
           fclose(file);
           return -1;
       }
-      if (commands == NULL) continue;
-
-      int *last_ret_code_pt = execute_line(commands);
-      if (last_ret_code_pt == (int *) -1) {
+      if (status < 0) {
           fprintf(stderr, "Error executing line in script: %s\n", line);
-          free(last_ret_code_pt);
+          lookahead_free(ahead);
           fclose(file);
           return -1;
       }
-      free(last_ret_code_pt);
   }
 
+  lookahead_free(ahead);
   fclose(file);
   return 0;
 }
@@ -273,7 +663,7 @@ void free_command(Command *command){
   Command *curr_command = command;
   Command *temp_command;
 
-  while (curr_command == NULL) {
+  while (curr_command != NULL) {
     temp_command = curr_command->next;
     int i = 0;
     while (curr_command->args[i] != NULL) {
@@ -286,6 +676,13 @@ void free_command(Command *command){
     if (curr_command->redir_out_path != NULL) {
       free(curr_command->redir_out_path);
     }
+    if (curr_command->memo_inputs != NULL) {
+      for (i = 0; curr_command->memo_inputs[i] != NULL; i++) {
+        free(curr_command->memo_inputs[i]);
+      }
+      free(curr_command->memo_inputs);
+    }
+    watch_free(curr_command->watch);
     free(curr_command->exec_path);
     free(curr_command->args);
     free(curr_command);
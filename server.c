@@ -0,0 +1,639 @@
+#include "cscshell.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+/*
+** --server keeps one shell, with its variables, functions and PATH cache,
+** running behind a Unix socket. A client sends its stdin, stdout and
+** stderr (SCM_RIGHTS) along with its first line, then one line at a
+** time, and gets back a line with each one's exit status. A block goes
+** whole, all its lines at once, and gets one status line.
+**
+** Pipelines are started without waiting and finished from the event
+** loop once their processes (watched through pidfds) and filter threads
+** (through an eventfd) are done, so one client's slow command does not
+** hold up the others. Everything else -- assignments, cd, blocks,
+** function calls, lines with a timeout -- runs to completion in the
+** loop, with the client's fds in place of the shell's own.
+*/
+
+typedef enum WatchKind {
+    WATCH_LISTEN,
+    WATCH_CLIENT,
+    WATCH_FILTERS,
+    WATCH_PID,
+} WatchKind;
+
+struct Client;
+
+typedef struct Watch {
+    WatchKind kind;
+    struct Client *client;
+} Watch;
+
+typedef struct Client {
+    int sock;
+    int fds[3];         // stdin, stdout and stderr; -1 until received
+    int filters_fd;     // eventfd the running line's filters bump
+    Watch sock_watch;
+    Watch filters_watch;
+    char buf[SERVER_BUF_SIZE];
+    size_t len;
+    bool hung_up;
+
+    // the line being run, if any
+    bool running;
+    int pending;        // processes and filters not finished yet
+    LineJob job;
+    int *pidfds;
+    Watch pid_watch;
+
+    // freed once the current batch of events has been handled
+    bool retired;
+    struct Client *next_retired;
+} Client;
+
+static int epoll_fd = -1;
+static int saved_fds[3] = {-1, -1, -1};
+static volatile sig_atomic_t stopping = 0;
+static Client *retired = NULL;
+
+
+static void stop_server(int sig){
+    stopping = 1;
+}
+
+
+static int watch_fd(int fd, Watch *watch){
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = watch};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0){
+        perror("server");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Points the shell's own stdin, stdout and stderr at fds
+static void use_fds(const int fds[3]){
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++){
+        dup2(fds[i], i);
+    }
+}
+
+
+// Answers the client's line with its status
+static void reply(Client *client, int status){
+    metrics_tick();
+    char line[32];
+    int len = snprintf(line, sizeof(line), "%d\n", status);
+    // a client that went away only loses its answer
+    send(client->sock, line, len, MSG_NOSIGNAL);
+}
+
+
+// Closes the client's fds now; the rest waits in case events of the
+// current batch still point at it
+static void free_client(Client *client){
+    close(client->sock);
+    close(client->filters_fd);
+    for (int i = 0; i < 3; i++){
+        if (client->fds[i] >= 0){
+            close(client->fds[i]);
+        }
+    }
+    client->retired = true;
+    client->next_retired = retired;
+    retired = client;
+}
+
+
+// Called once every stage of the client's line is done
+static void finish_client_line(Client *client){
+    int *ret = finish_line(&client->job);
+    int status = 1;
+    if (ret != NULL && ret != (int *) -1){
+        status = *ret;
+        free(ret);
+    }
+    free(client->pidfds);
+    client->pidfds = NULL;
+    client->running = false;
+
+    reply(client, status);
+}
+
+
+// Watches every process of the line just started. Returns false if it
+// cannot, in which case the caller finishes the line by waiting.
+static bool watch_client_line(Client *client){
+    LineJob *job = &client->job;
+    client->pidfds = malloc(job->num_commands * sizeof(int));
+    if (client->pidfds == NULL){
+        perror("server");
+        return false;
+    }
+    client->pending = 0;
+    for (int i = 0; i < job->num_commands; i++){
+        client->pidfds[i] = -1;
+        if (job->filters[i] != NULL){
+            client->pending++;
+            continue;
+        }
+        int pidfd = syscall(SYS_pidfd_open, job->pids[i], 0);
+        if (pidfd < 0 || watch_fd(pidfd, &client->pid_watch) < 0){
+            if (pidfd >= 0) close(pidfd);
+            for (int j = 0; j < i; j++){
+                if (client->pidfds[j] >= 0) close(client->pidfds[j]);
+            }
+            return false;
+        }
+        client->pidfds[i] = pidfd;
+        client->pending++;
+    }
+    return true;
+}
+
+
+static void receive_client(Client *client);
+
+
+// Reads the client's next buffered line, or returns NULL if there is none
+static char *client_read_line(char *buf, int size, void *ctx){
+    Client *client = ctx;
+    char *newline = memchr(client->buf, '\n', client->len);
+    if (newline == NULL){
+        return NULL;
+    }
+    size_t len = newline + 1 - client->buf;
+    snprintf(buf, size, "%.*s", (int) len, client->buf);
+    client->len -= len;
+    memmove(client->buf, newline + 1, client->len);
+    return buf;
+}
+
+
+// The LineSource for a block's lines. The client sends a block in one
+// go, so the part not received yet is on its way; wait for it, a while.
+static char *client_read_block_line(char *buf, int size, void *ctx){
+    Client *client = ctx;
+    while (memchr(client->buf, '\n', client->len) == NULL &&
+           !client->hung_up){
+        struct pollfd pfd = {.fd = client->sock, .events = POLLIN};
+        int ready = poll(&pfd, 1, SERVER_BLOCK_WAIT_MS);
+        if (ready < 0 && errno == EINTR){
+            continue;
+        }
+        if (ready <= 0){
+            break;
+        }
+        receive_client(client);
+    }
+    return client_read_line(buf, size, ctx);
+}
+
+
+static void run_client_line(Client *client, char *line, Variable **root){
+    line[strcspn(line, "\n")] = '\0';
+    use_fds(client->fds);
+
+    // blocks, functions and lists may run any number of lines, so they
+    // run here
+    int status;
+    if (vm_starts_block(line)){
+        status = vm_run_block(line, client_read_block_line, client, root);
+        use_fds(saved_fds);
+        reply(client, status);
+        return;
+    }
+    if (vm_find_function(line) != NULL || line_is_list(line)){
+        status = run_line(line, root);
+        use_fds(saved_fds);
+        reply(client, status);
+        return;
+    }
+
+    int errors_before = errors_printed;
+    Command *commands = parse_line(line, root);
+    if (commands == (Command *) -1 || errors_printed != errors_before){
+        METRIC_ADD(*metrics, parse_errors, 1);
+    }
+    if (commands == NULL || commands == (Command *) -1 ||
+        strcmp(commands->exec_path, CD) == 0 || commands->memo ||
+        commands->watch != NULL || commands->timeout_ns > 0){
+        status = run_parsed_line(commands);
+        use_fds(saved_fds);
+        reply(client, status);
+        return;
+    }
+
+    // filters read and write their fds after we switch back, so the ends
+    // of the pipeline get their own copies; stderr is inherited at fork
+    Command *tail = commands;
+    while (tail->next != NULL){
+        tail = tail->next;
+    }
+    if (commands->stdin_fd == STDIN_FILENO){
+        commands->stdin_fd = fcntl(client->fds[0], F_DUPFD_CLOEXEC, 0);
+    }
+    if (tail->stdout_fd == STDOUT_FILENO){
+        tail->stdout_fd = fcntl(client->fds[1], F_DUPFD_CLOEXEC, 0);
+    }
+    int error = start_line(commands, &client->job, client->filters_fd);
+    use_fds(saved_fds);
+    if (error < 0){
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        reply(client, 1);
+        return;
+    }
+    client->running = true;
+    if (!watch_client_line(client)){
+        finish_client_line(client);
+    }
+}
+
+
+static void run_client_lines(Client *client, Variable **root){
+    char line[MAX_SINGLE_LINE];
+    while (!client->running &&
+           client_read_line(line, MAX_SINGLE_LINE, client) != NULL){
+        run_client_line(client, line, root);
+    }
+}
+
+
+// Receives what the client has sent, taking its fds from the first
+// message
+static void receive_client(Client *client){
+    while (!client->hung_up){
+        if (client->len == sizeof(client->buf)){
+            ERR_PRINT(ERR_SERVER_LINE);
+            client->hung_up = true;
+            client->len = 0;
+            break;
+        }
+
+        struct iovec iov = {client->buf + client->len,
+                            sizeof(client->buf) - client->len};
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+        ssize_t num_read = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+        if (num_read < 0 && errno == EINTR){
+            continue;
+        }
+        if (num_read < 0 && errno == EAGAIN){
+            break;
+        }
+        if (num_read <= 0){
+            client->hung_up = true;
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))){
+            int fds[3];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            for (int i = 0; i < 3; i++){
+                if (client->fds[i] >= 0) close(client->fds[i]);
+                client->fds[i] = fds[i];
+            }
+        }
+        if (client->fds[0] < 0){
+            ERR_PRINT(ERR_SERVER_FDS);
+            client->hung_up = true;
+            client->len = 0;
+            break;
+        }
+        client->len += num_read;
+    }
+}
+
+
+// Runs whatever complete lines the client has sent
+static void read_client(Client *client, Variable **root){
+    receive_client(client);
+    run_client_lines(client, root);
+    if (client->hung_up && !client->running){
+        free_client(client);
+    }
+}
+
+
+static void accept_clients(int listen_fd){
+    while (true){
+        int sock = accept4(listen_fd, NULL, NULL,
+                           SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (sock < 0){
+            if (errno != EAGAIN && errno != EINTR){
+                perror("accept_clients");
+            }
+            return;
+        }
+        Client *client = calloc(1, sizeof(Client));
+        int filters_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (client == NULL || filters_fd < 0){
+            perror("accept_clients");
+            free(client);
+            if (filters_fd >= 0) close(filters_fd);
+            close(sock);
+            continue;
+        }
+        client->sock = sock;
+        client->filters_fd = filters_fd;
+        client->fds[0] = client->fds[1] = client->fds[2] = -1;
+        client->sock_watch = (Watch) {WATCH_CLIENT, client};
+        client->filters_watch = (Watch) {WATCH_FILTERS, client};
+        client->pid_watch = (Watch) {WATCH_PID, client};
+        if (watch_fd(sock, &client->sock_watch) < 0 ||
+            watch_fd(filters_fd, &client->filters_watch) < 0){
+            free_client(client);
+        }
+    }
+}
+
+
+static int open_listener(const char *socket_path){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)){
+        ERR_PRINT(ERR_SERVER_PATH, socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // a socket left behind by a server that was killed
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0){
+        perror("server");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SERVER_BACKLOG) < 0){
+        perror("server");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// A pidfd turned readable. They share one watch, so each is polled; the
+// processes are left for finish_line to reap.
+static void process_exited(Client *client){
+    for (int i = 0; i < client->job.num_commands; i++){
+        if (client->pidfds[i] < 0){
+            continue;
+        }
+        siginfo_t info = {0};
+        if (waitid(P_PIDFD, client->pidfds[i], &info,
+                   WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0){
+            close(client->pidfds[i]);
+            client->pidfds[i] = -1;
+            client->pending--;
+        }
+    }
+}
+
+
+int server_run(const char *socket_path, Variable **root){
+    int listen_fd = open_listener(socket_path);
+    if (listen_fd < 0){
+        return -1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    Watch listen_watch = {WATCH_LISTEN, NULL};
+    for (int i = 0; i < 3; i++){
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 0);
+    }
+    if (epoll_fd < 0 || saved_fds[0] < 0 || saved_fds[1] < 0 ||
+        saved_fds[2] < 0 || watch_fd(listen_fd, &listen_watch) < 0){
+        perror("server_run");
+        close(listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+
+    struct sigaction action = {.sa_handler = stop_server};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int error = 0;
+    while (!stopping){
+        int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (num_events < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("server_run");
+            error = -1;
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++){
+            Watch *watch = events[i].data.ptr;
+            Client *client = watch->client;
+            // pidfds share a watch, so one event may have handled them all
+            if (client != NULL && (client->retired ||
+                (watch->kind == WATCH_PID && !client->running))){
+                continue;
+            }
+            switch (watch->kind){
+            case WATCH_LISTEN:
+                accept_clients(listen_fd);
+                break;
+            case WATCH_CLIENT:
+                read_client(client, root);
+                break;
+            case WATCH_FILTERS: {
+                uint64_t done;
+                if (read(client->filters_fd, &done, sizeof(done)) ==
+                    sizeof(done)){
+                    client->pending -= done;
+                }
+                break;
+            }
+            case WATCH_PID:
+                process_exited(client);
+                break;
+            }
+            // the line's last stage is done: answer it and go on to the
+            // client's next one
+            if ((watch->kind == WATCH_FILTERS || watch->kind == WATCH_PID) &&
+                client->running && client->pending == 0){
+                finish_client_line(client);
+                run_client_lines(client, root);
+                if (client->hung_up && !client->running){
+                    free_client(client);
+                }
+            }
+        }
+
+        while (retired != NULL){
+            Client *next = retired->next_retired;
+            free(retired);
+            retired = next;
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    close(epoll_fd);
+    return error;
+}
+
+
+// A block on its way to the server: its lines so far, and where the
+// rest comes from
+typedef struct Outgoing {
+    FILE *input;
+    char text[SERVER_BUF_SIZE];
+    size_t len;
+    bool too_long;
+} Outgoing;
+
+
+static void add_line(Outgoing *out, const char *line){
+    size_t len = strlen(line);
+    if (out->len + len + 1 >= sizeof(out->text)){
+        out->too_long = true;
+        return;
+    }
+    memcpy(out->text + out->len, line, len);
+    out->len += len;
+    if (len == 0 || line[len - 1] != '\n'){
+        out->text[out->len++] = '\n';
+    }
+    out->text[out->len] = '\0';
+}
+
+
+// A LineSource that reads the block's next line and keeps it to send
+static char *outgoing_read_line(char *buf, int size, void *ctx){
+    Outgoing *out = ctx;
+    if (out->too_long || fgets(buf, size, out->input) == NULL){
+        return NULL;
+    }
+    add_line(out, buf);
+    return buf;
+}
+
+
+int server_connect(const char *socket_path, const char *script_path){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)){
+        ERR_PRINT(ERR_SERVER_PATH, socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    FILE *input = stdin;
+    if (script_path != NULL && (input = fopen(script_path, "r")) == NULL){
+        perror("fopen");
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr,
+                            sizeof(addr)) < 0){
+        perror("server_connect");
+        if (sock >= 0) close(sock);
+        if (input != stdin) fclose(input);
+        return -1;
+    }
+
+    char line[MAX_SINGLE_LINE];
+    Outgoing *out = malloc(sizeof(Outgoing));
+    if (out == NULL){
+        perror("server_connect");
+        close(sock);
+        if (input != stdin) fclose(input);
+        return -1;
+    }
+    out->input = input;
+    bool sent_fds = false;
+    int error = 0;
+    while (error == 0 && fgets(line, MAX_SINGLE_LINE, input) != NULL){
+        out->len = 0;
+        out->too_long = false;
+        add_line(out, line);
+        // the server runs a block once it has all of it, and answers
+        // once; its errors are the server's to report
+        if (vm_starts_block(line)){
+            errors_muted++;
+            vm_read_block(line, outgoing_read_line, out);
+            errors_muted--;
+        }
+        if (out->too_long){
+            ERR_PRINT(ERR_SERVER_LINE);
+            error = -1;
+            break;
+        }
+        size_t len = out->len;
+
+        // our stdin, stdout and stderr go with the first line
+        struct iovec iov = {out->text, len};
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        if (!sent_fds){
+            int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+            sent_fds = true;
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) len){
+            perror("server_connect");
+            error = -1;
+            break;
+        }
+        // a block the input ended in the middle of has nothing more to
+        // wait for
+        if (feof(input)){
+            shutdown(sock, SHUT_WR);
+        }
+
+        // one status line comes back per line sent
+        char answer[32];
+        size_t answer_len = 0;
+        while (answer_len == 0 || answer[answer_len - 1] != '\n'){
+            ssize_t num_read = read(sock, answer + answer_len, 1);
+            if (num_read <= 0 || ++answer_len == sizeof(answer)){
+                ERR_PRINT(ERR_SERVER_GONE);
+                error = -1;
+                break;
+            }
+        }
+        if (error == 0 && atoi(answer) == RUN_PARSE_FAILED){
+            line[strcspn(line, "\n")] = '\0';
+            fprintf(stderr, "Error parsing line in script: %s\n", line);
+            error = -1;
+        }
+    }
+
+    free(out);
+    close(sock);
+    if (input != stdin){
+        fclose(input);
+    }
+    return error;
+}
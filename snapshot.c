@@ -0,0 +1,296 @@
+#include "cscshell.h"
+
+#include <sys/mman.h>
+
+/*
+** Snapshot layout: a SnapshotHeader, then num_vars records of
+**   uint32_t name_len, uint32_t value_len, uint32_t exported,
+**   name '\0', value '\0'
+** in the same order as the variable list.
+*/
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint64_t init_ino;
+    int64_t init_size;
+    int64_t init_mtime_sec;
+    int64_t init_mtime_nsec;
+    uint64_t init_hash;
+    uint32_t num_vars;
+    uint32_t reserved;
+    uint64_t data_size;
+} SnapshotHeader;
+
+
+static char *snapshot_path(const char *init_file){
+    char *path = malloc(strlen(init_file) + strlen(SNAPSHOT_SUFFIX) + 1);
+    if (path == NULL){
+        perror("snapshot_path");
+        return NULL;
+    }
+    sprintf(path, "%s%s", init_file, SNAPSHOT_SUFFIX);
+    return path;
+}
+
+
+// Reads the whole init file; *len gets its size. Caller frees.
+static char *read_init_file(const char *init_file, struct stat *st,
+                            size_t *len){
+    int fd = open(init_file, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)){
+        close(fd);
+        return NULL;
+    }
+    char *data = malloc(st->st_size + 1);
+    if (data == NULL){
+        close(fd);
+        return NULL;
+    }
+    size_t total = 0;
+    while (total < (size_t) st->st_size){
+        ssize_t num_read = read(fd, data + total, st->st_size - total);
+        if (num_read <= 0){
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        total += num_read;
+    }
+    close(fd);
+    data[total] = '\0';
+    *len = total;
+    return data;
+}
+
+
+// True if [c, end) holds at least one word, and only NAME=VALUE; a bare
+// NAME may take its value from the environment the shell was started with
+static bool export_is_declarative(const char *c, const char *end){
+    int num_words = 0;
+    while (c < end && *c != '#'){
+        if (isspace((unsigned char) *c)){
+            c++;
+            continue;
+        }
+        const char *name_start = c;
+        while (c < end && (isalpha((unsigned char) *c) || *c == '_')) c++;
+        if (c == name_start){
+            return false;
+        }
+        if (c >= end || *c != '='){
+            return false;
+        }
+        while (c < end && !isspace((unsigned char) *c)) c++;
+        num_words++;
+    }
+    return num_words > 0;
+}
+
+
+// True if every line is blank, a comment, an assignment or an export,
+// and none runs a $(...), whose output and effects differ from run to run
+static bool script_is_declarative(char *data){
+    char *line = data;
+    while (line != NULL && *line != '\0'){
+        char *next = strchr(line, '\n');
+        char *end = (next != NULL) ? next : line + strlen(line);
+
+        char *c = line;
+        while (c < end && isspace((unsigned char) *c)) c++;
+        // "$(" also finds "$((", which may assign as it goes
+        if (c < end && *c != '#' &&
+            memmem(c, end - c, SUBST_START, strlen(SUBST_START)) != NULL){
+            return false;
+        }
+        size_t export_len = strlen(EXPORT);
+        if ((size_t) (end - c) > export_len &&
+            strncmp(c, EXPORT, export_len) == 0 &&
+            isspace((unsigned char) c[export_len])){
+            if (!export_is_declarative(c + export_len, end)){
+                return false;
+            }
+        }
+        else if (c < end && *c != '#'){
+            char *name_start = c;
+            while (c < end && (isalpha((unsigned char) *c) || *c == '_')) c++;
+            if (c == name_start || c >= end || *c != '='){
+                return false;
+            }
+        }
+        line = (next != NULL) ? next + 1 : NULL;
+    }
+    return true;
+}
+
+
+static bool header_matches(const SnapshotHeader *header, const struct stat *st){
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+        header->init_ino == (uint64_t) st->st_ino &&
+        header->init_size == (int64_t) st->st_size &&
+        header->init_mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+        header->init_mtime_nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+
+int snapshot_load(const char *init_file, Variable **root){
+    struct stat init_st;
+    size_t init_len;
+    char *init_data = read_init_file(init_file, &init_st, &init_len);
+    if (init_data == NULL){
+        return 0;
+    }
+    uint64_t init_hash = fnv_bytes(FNV_OFFSET, init_data, init_len);
+    free(init_data);
+
+    char *path = snapshot_path(init_file);
+    if (path == NULL){
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0){
+        return 0;
+    }
+
+    struct stat snap_st;
+    if (fstat(fd, &snap_st) < 0 ||
+        snap_st.st_size < (off_t) sizeof(SnapshotHeader)){
+        close(fd);
+        return 0;
+    }
+    char *map = mmap(NULL, snap_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return 0;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *) map;
+    if (!header_matches(header, &init_st) || header->init_hash != init_hash ||
+        header->data_size != snap_st.st_size - sizeof(SnapshotHeader)){
+        munmap(map, snap_st.st_size);
+        return 0;
+    }
+
+    const char *pos = map + sizeof(SnapshotHeader);
+    const char *end = map + snap_st.st_size;
+    Variable *head = NULL, *tail = NULL;
+
+    for (uint32_t i = 0; i < header->num_vars; i++){
+        uint32_t lens[3];
+        if ((size_t) (end - pos) < sizeof(lens)) goto snap_bad;
+        memcpy(lens, pos, sizeof(lens));
+        pos += sizeof(lens);
+        if ((uint64_t) (end - pos) < (uint64_t) lens[0] + lens[1] + 2 ||
+            pos[lens[0]] != '\0' || pos[lens[0] + 1 + lens[1]] != '\0'){
+            goto snap_bad;
+        }
+
+        Variable *var = malloc(sizeof(Variable));
+        if (var == NULL){
+            perror("snapshot_load");
+            free_variable(head, NON_ZERO_BYTE);
+            munmap(map, snap_st.st_size);
+            return -1;
+        }
+        var->name = strndup(pos, lens[0]);
+        var->value = strndup(pos + lens[0] + 1, lens[1]);
+        var->exported = (lens[2] != 0) ? NON_ZERO_BYTE : 0;
+        var->next = NULL;
+        if (tail == NULL) head = var;
+        else tail->next = var;
+        tail = var;
+        if (var->name == NULL || var->value == NULL){
+            perror("snapshot_load");
+            free_variable(head, NON_ZERO_BYTE);
+            munmap(map, snap_st.st_size);
+            return -1;
+        }
+        pos += lens[0] + lens[1] + 2;
+    }
+
+    munmap(map, snap_st.st_size);
+    *root = head;
+    variables_generation++;
+    env_mark_dirty();
+    return 1;
+
+snap_bad:
+    if (head != NULL){
+        free_variable(head, NON_ZERO_BYTE);
+    }
+    munmap(map, snap_st.st_size);
+    return 0;
+}
+
+
+void snapshot_save(const char *init_file, Variable *root){
+    struct stat init_st;
+    size_t init_len;
+    char *init_data = read_init_file(init_file, &init_st, &init_len);
+    if (init_data == NULL){
+        return;
+    }
+    if (!script_is_declarative(init_data)){
+        free(init_data);
+        return;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.init_ino = init_st.st_ino;
+    header.init_size = init_st.st_size;
+    header.init_mtime_sec = init_st.st_mtim.tv_sec;
+    header.init_mtime_nsec = init_st.st_mtim.tv_nsec;
+    header.init_hash = fnv_bytes(FNV_OFFSET, init_data, init_len);
+    free(init_data);
+
+    for (Variable *var = root; var != NULL; var = var->next){
+        header.num_vars++;
+        header.data_size += 3 * sizeof(uint32_t) +
+            strlen(var->name) + strlen(var->value) + 2;
+    }
+
+    char *buf = malloc(sizeof(header) + header.data_size);
+    if (buf == NULL){
+        return;
+    }
+    memcpy(buf, &header, sizeof(header));
+    char *pos = buf + sizeof(header);
+    for (Variable *var = root; var != NULL; var = var->next){
+        uint32_t lens[3] = {strlen(var->name), strlen(var->value),
+                            var->exported};
+        memcpy(pos, lens, sizeof(lens));
+        pos += sizeof(lens);
+        memcpy(pos, var->name, lens[0] + 1);
+        pos += lens[0] + 1;
+        memcpy(pos, var->value, lens[1] + 1);
+        pos += lens[1] + 1;
+    }
+
+    // write to a temporary and rename, so readers never see half a file
+    char *path = snapshot_path(init_file);
+    char *tmp_path = (path != NULL) ? malloc(strlen(path) + 16) : NULL;
+    if (tmp_path == NULL){
+        free(path);
+        free(buf);
+        return;
+    }
+    sprintf(tmp_path, "%s.%d", path, getpid());
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0){
+        size_t total = sizeof(header) + header.data_size;
+        bool written = write(fd, buf, total) == (ssize_t) total;
+        close(fd);
+        if (!written || rename(tmp_path, path) < 0){
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+    free(buf);
+}
@@ -0,0 +1,178 @@
+#include "cscshell.h"
+
+/*
+** $(...) runs its pipeline with the last stage writing into a pipe that
+** the shell drains into a growable buffer while the line runs. Stages
+** that are builtin filters stay threads, so $(wc -l < file) never
+** forks; a lone `echo` of words and variables is answered without
+** running anything at all.
+*/
+
+
+const char *subst_find_end(const char *start){
+    int depth = 1;
+    for (const char *pos = start; *pos != '\0'; pos++){
+        if (*pos == '('){
+            depth++;
+        }
+        else if (*pos == ')' && --depth == 0){
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+
+// Drops the trailing newlines, as every shell does
+static char *trim_newlines(char *output, size_t len){
+    while (len > 0 && output[len - 1] == '\n'){
+        len--;
+    }
+    output[len] = '\0';
+    return output;
+}
+
+
+/*
+** Answers `echo WORDS...` from the words themselves, the way the real
+** echo would print them. Returns NULL when the line is anything else,
+** including echo options or globs that need the real thing.
+*/
+static char *builtin_echo(const char *line){
+    line += strspn(line, " \t");
+    size_t echo_len = strlen(ECHO);
+    if (strncmp(line, ECHO, echo_len) != 0 ||
+        (line[echo_len] != '\0' && !isspace((unsigned char) line[echo_len]))){
+        return NULL;
+    }
+    const char *args = line + echo_len;
+    args += strspn(args, " \t");
+    if (*args == '-' || args[strcspn(args, "|<>")] != '\0' ||
+        glob_has_magic(args)){
+        return NULL;
+    }
+
+    // words are joined by single spaces, as argv would have them
+    char *output = malloc(strlen(args) + 1);
+    if (output == NULL){
+        perror("subst");
+        return (char *) -1;
+    }
+    size_t len = 0;
+    while (*args != '\0'){
+        size_t word_len = strcspn(args, " \t\n");
+        if (len > 0){
+            output[len++] = ' ';
+        }
+        memcpy(output + len, args, word_len);
+        len += word_len;
+        args += word_len;
+        args += strspn(args, " \t\n");
+    }
+    output[len] = '\0';
+    return output;
+}
+
+
+// Reads fd until EOF into a heap string
+static char *read_all(int fd, size_t *len){
+    size_t capacity = SUBST_BUF_SIZE;
+    char *output = malloc(capacity);
+    if (output == NULL){
+        perror("subst");
+        return (char *) -1;
+    }
+    *len = 0;
+    while (true){
+        if (*len + 1 >= capacity){
+            char *grown = realloc(output, capacity * 2);
+            if (grown == NULL){
+                perror("subst");
+                free(output);
+                return (char *) -1;
+            }
+            output = grown;
+            capacity *= 2;
+        }
+        ssize_t num_read = read(fd, output + *len, capacity - *len - 1);
+        if (num_read < 0 && errno == EINTR){
+            continue;
+        }
+        if (num_read < 0){
+            perror("subst");
+            free(output);
+            return (char *) -1;
+        }
+        if (num_read == 0){
+            return output;
+        }
+        *len += num_read;
+    }
+}
+
+
+char *subst_run(const char *text, size_t len, Variable **variables){
+    char *inner = strndup(text, len);
+    if (inner == NULL){
+        perror("subst_run");
+        return (char *) -1;
+    }
+    // nested substitutions run first, as part of expanding this one
+    char *expanded = replace_variables_mk_line(inner, variables);
+    free(inner);
+    if (expanded == NULL || expanded == (char *) -1){
+        return expanded;
+    }
+
+    char *output = builtin_echo(expanded);
+    if (output != NULL){
+        free(expanded);
+        return output;
+    }
+
+    Command *commands = parse_expanded_line(expanded, variables);
+    free(expanded);
+    if (commands == NULL || commands == (Command *) -1){
+        return (char *) commands;
+    }
+    // cd would only have changed directory in a subshell
+    if (strcmp(commands->exec_path, CD) == 0){
+        free_command(commands);
+        return strdup("");
+    }
+
+    int capture[2];
+    if (pipe2(capture, O_CLOEXEC) < 0){
+        perror("subst_run");
+        free_command(commands);
+        return (char *) -1;
+    }
+    Command *tail = commands;
+    while (tail->next != NULL){
+        tail = tail->next;
+    }
+    // the last stage closes the write end once it has been handed over
+    tail->stdout_fd = capture[1];
+
+    LineJob job;
+    if (start_line(commands, &job, -1) < 0){
+        close(capture[0]);
+        return (char *) -1;
+    }
+    size_t output_len = 0;
+    output = read_all(capture[0], &output_len);
+    close(capture[0]);
+
+    int *status = finish_line(&job);
+    if (status == (int *) -1){
+        if (output != (char *) -1){
+            free(output);
+        }
+        return (char *) -1;
+    }
+    free(status);
+    if (output == (char *) -1){
+        return output;
+    }
+    return trim_newlines(output, output_len);
+}
@@ -0,0 +1,379 @@
+#include "cscshell.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+/*
+** "Did you mean" suggestions for commands that do not resolve. The
+** first time one is needed, the names in the PATH directories are read
+** into an index sorted by length, each with a signature: a bit for
+** every character it contains. Edit distance is at least the difference
+** in length, and at least half the bits in which two signatures differ,
+** since an edit adds or removes at most one character on each side. So
+** a lookup only looks at the lengths within reach and only computes the
+** distance of names whose signatures are close enough, which leaves a
+** handful out of tens of thousands.
+**
+** The distance counts a swap of two neighbouring letters as one edit,
+** so `gti` finds git. The index is rebuilt when PATH changes or one of
+** its directories has been modified since. The suggest builtin prints
+** the candidates for a name, best first.
+*/
+
+typedef struct SuggestEntry {
+    uint64_t chars;         // signature
+    uint32_t name;          // offset into names
+    uint32_t len;
+} SuggestEntry;
+
+typedef struct Candidate {
+    const char *name;
+    int distance;
+} Candidate;
+
+static struct {
+    char *path;             // the PATH the index was built from
+    struct timespec *mtimes;    // of each of its directories, then
+    int num_dirs;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    SuggestEntry *entries;
+    size_t count;
+    size_t capacity;
+    // entries of length len start at first[len]
+    size_t first[NAME_MAX + 2];
+} path_names;
+
+// PATH for the suggest builtin, which runs on a filter thread
+static char *builtin_path = NULL;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t signature(const char *name, size_t len){
+    uint64_t chars = 0;
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = name[i];
+        int bit;
+        if (c >= 'a' && c <= 'z') bit = c - 'a';
+        else if (c >= '0' && c <= '9') bit = 26 + c - '0';
+        else if (c >= 'A' && c <= 'Z') bit = 36 + (c - 'A') % 16;
+        // anything else shares the rest, which only weakens the bound
+        else bit = 52 + c % 12;
+        chars |= (uint64_t) 1 << bit;
+    }
+    return chars;
+}
+
+
+// Edit distance, a swap of neighbours being one edit, or limit + 1 if
+// it is more than limit
+static int distance(const char *a, size_t a_len, const char *b, size_t b_len,
+                    int limit){
+    // names are at most NAME_MAX long
+    uint16_t rows[3][NAME_MAX + 2];
+    uint16_t *before = rows[0], *prev = rows[1], *curr = rows[2];
+    uint16_t prev_min = 0;
+    for (size_t j = 0; j <= b_len; j++){
+        prev[j] = j;
+    }
+    for (size_t i = 1; i <= a_len; i++){
+        curr[0] = i;
+        uint16_t curr_min = curr[0];
+        for (size_t j = 1; j <= b_len; j++){
+            uint16_t best = prev[j - 1] + (a[i - 1] != b[j - 1]);
+            if (prev[j] + 1 < best) best = prev[j] + 1;
+            if (curr[j - 1] + 1 < best) best = curr[j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+                a[i - 2] == b[j - 1] && before[j - 2] + 1 < best){
+                best = before[j - 2] + 1;
+            }
+            curr[j] = best;
+            if (best < curr_min) curr_min = best;
+        }
+        // every later cell comes from one of the last two rows
+        if (curr_min > limit && prev_min > limit){
+            return limit + 1;
+        }
+        prev_min = curr_min;
+        uint16_t *spare = before;
+        before = prev;
+        prev = curr;
+        curr = spare;
+    }
+    return (prev[b_len] > limit) ? limit + 1 : prev[b_len];
+}
+
+
+static void clear_index(){
+    free(path_names.path);
+    free(path_names.mtimes);
+    free(path_names.names);
+    free(path_names.entries);
+    memset(&path_names, 0, sizeof(path_names));
+}
+
+
+static int add_name(const char *name){
+    size_t len = strlen(name);
+    if (len > NAME_MAX){
+        return 0;
+    }
+    if (path_names.count == path_names.capacity){
+        size_t capacity = path_names.capacity ? path_names.capacity * 2
+                                              : SUGGEST_INITIAL_NAMES;
+        SuggestEntry *entries = realloc(path_names.entries,
+                                        capacity * sizeof(SuggestEntry));
+        if (entries == NULL){
+            return -1;
+        }
+        path_names.entries = entries;
+        path_names.capacity = capacity;
+    }
+    if (path_names.names_len + len + 1 > path_names.names_capacity){
+        size_t capacity = path_names.names_capacity
+                          ? path_names.names_capacity * 2
+                          : SUGGEST_INITIAL_NAMES * 16;
+        while (path_names.names_len + len + 1 > capacity) capacity *= 2;
+        char *names = realloc(path_names.names, capacity);
+        if (names == NULL){
+            return -1;
+        }
+        path_names.names = names;
+        path_names.names_capacity = capacity;
+    }
+    path_names.entries[path_names.count++] = (SuggestEntry) {
+        signature(name, len), path_names.names_len, len
+    };
+    memcpy(path_names.names + path_names.names_len, name, len + 1);
+    path_names.names_len += len + 1;
+    return 0;
+}
+
+
+// By length, then by name
+static int compare_entries(const void *a, const void *b){
+    const SuggestEntry *left = a, *right = b;
+    if (left->len != right->len){
+        return (left->len < right->len) ? -1 : 1;
+    }
+    return strcmp(path_names.names + left->name,
+                  path_names.names + right->name);
+}
+
+
+// Sorts the entries, drops names that are in more than one directory and
+// fills in first
+static void sort_entries(){
+    qsort(path_names.entries, path_names.count, sizeof(SuggestEntry),
+          compare_entries);
+    size_t kept = 0;
+    for (size_t i = 0; i < path_names.count; i++){
+        if (kept > 0 && compare_entries(&path_names.entries[kept - 1],
+                                        &path_names.entries[i]) == 0){
+            continue;
+        }
+        path_names.entries[kept++] = path_names.entries[i];
+    }
+    path_names.count = kept;
+
+    size_t i = 0;
+    for (size_t len = 0; len <= NAME_MAX + 1; len++){
+        while (i < path_names.count && path_names.entries[i].len < len) i++;
+        path_names.first[len] = i;
+    }
+}
+
+
+struct timespec *path_dir_mtimes(const char *path, int max_dirs,
+                                 int *num_dirs){
+    char *dirs = strdup(path);
+    int count = 1;
+    for (const char *c = path; *c != '\0'; c++){
+        if (*c == ':') count++;
+    }
+    if (count > max_dirs){
+        count = max_dirs;
+    }
+    struct timespec *mtimes = calloc(count, sizeof(struct timespec));
+    if (dirs == NULL || mtimes == NULL){
+        free(dirs);
+        free(mtimes);
+        return NULL;
+    }
+    int i = 0;
+    char *save;
+    for (char *dir = strtok_r(dirs, ":", &save); dir != NULL && i < count;
+         dir = strtok_r(NULL, ":", &save)){
+        struct stat st;
+        if (stat(dir, &st) == 0){
+            mtimes[i] = st.st_mtim;
+        }
+        i++;
+    }
+    free(dirs);
+    *num_dirs = i;
+    return mtimes;
+}
+
+
+// Reads the names in every directory of path into a new index
+static int build(const char *path, struct timespec *mtimes, int num_dirs){
+    clear_index();
+    path_names.path = strdup(path);
+    path_names.mtimes = mtimes;
+    path_names.num_dirs = num_dirs;
+    char *dirs = strdup(path);
+    if (path_names.path == NULL || dirs == NULL){
+        free(dirs);
+        return -1;
+    }
+
+    int error = 0;
+    char *save;
+    for (char *dir_path = strtok_r(dirs, ":", &save);
+         dir_path != NULL && error == 0;
+         dir_path = strtok_r(NULL, ":", &save)){
+        DIR *dir = opendir(dir_path);
+        if (dir == NULL){
+            continue;
+        }
+        struct dirent *entry;
+        while (error == 0 && (entry = readdir(dir)) != NULL){
+            if (entry->d_name[0] != '.' && entry->d_type != DT_DIR){
+                error = add_name(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    free(dirs);
+    sort_entries();
+    return error;
+}
+
+
+// Makes the index match path as it is now. Called with index_lock held.
+static int refresh(const char *path){
+    int num_dirs;
+    struct timespec *mtimes = path_dir_mtimes(path, INT_MAX, &num_dirs);
+    if (mtimes == NULL){
+        return -1;
+    }
+    if (path_names.path != NULL && strcmp(path_names.path, path) == 0 &&
+        num_dirs == path_names.num_dirs &&
+        memcmp(mtimes, path_names.mtimes, num_dirs * sizeof(struct timespec)) == 0){
+        free(mtimes);
+        return 0;
+    }
+    if (build(path, mtimes, num_dirs) < 0){
+        clear_index();
+        return -1;
+    }
+    return 0;
+}
+
+
+// Keeps candidate in best, which holds the count best so far in order
+static void rank(Candidate *best, int *count, Candidate candidate){
+    int i = *count;
+    if (i == SUGGEST_MAX){
+        i--;
+        const Candidate *worst = &best[i];
+        if (candidate.distance > worst->distance ||
+            (candidate.distance == worst->distance &&
+             strcmp(candidate.name, worst->name) >= 0)){
+            return;
+        }
+    }
+    else {
+        (*count)++;
+    }
+    while (i > 0 && (best[i - 1].distance > candidate.distance ||
+                     (best[i - 1].distance == candidate.distance &&
+                      strcmp(best[i - 1].name, candidate.name) > 0))){
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i] = candidate;
+}
+
+
+size_t suggest_commands(const char *name, const char *path, const char *sep,
+                        char *buf, size_t size){
+    size_t len = strlen(name);
+    buf[0] = '\0';
+    if (path == NULL || len == 0 || len > NAME_MAX || strchr(name, '/') != NULL){
+        return 0;
+    }
+    // short names would otherwise match every other short name
+    int max_distance = (len <= SUGGEST_SHORT_NAME) ? 1 : SUGGEST_MAX_DISTANCE;
+    uint64_t chars = signature(name, len);
+
+    pthread_mutex_lock(&index_lock);
+    size_t used = 0;
+    if (refresh(path) == 0){
+        Candidate best[SUGGEST_MAX];
+        int count = 0;
+        size_t shortest = (len > (size_t) max_distance) ? len - max_distance : 0;
+        size_t longest = len + max_distance;
+        if (longest > NAME_MAX) longest = NAME_MAX;
+        size_t end = path_names.first[longest + 1];
+        for (size_t i = path_names.first[shortest]; i < end; i++){
+            const SuggestEntry *entry = &path_names.entries[i];
+            int differing = __builtin_popcountll(entry->chars ^ chars);
+            if ((differing + 1) / 2 > max_distance){
+                continue;
+            }
+            const char *entry_name = path_names.names + entry->name;
+            int dist = distance(name, len, entry_name, entry->len, max_distance);
+            if (dist <= max_distance){
+                rank(best, &count, (Candidate) {entry_name, dist});
+            }
+        }
+        for (int i = 0; i < count && used < size; i++){
+            used += snprintf(buf + used, size - used, "%s%s",
+                             (i > 0) ? sep : "", best[i].name);
+        }
+        if (used >= size){
+            used = size - 1;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return used;
+}
+
+
+void suggest_set_path(const char *path){
+    pthread_mutex_lock(&index_lock);
+    if (builtin_path == NULL || strcmp(builtin_path, path) != 0){
+        char *copy = strdup(path);
+        if (copy != NULL){
+            free(builtin_path);
+            builtin_path = copy;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+
+size_t suggest_builtin(const char *name, char *buf, size_t size){
+    pthread_mutex_lock(&index_lock);
+    char *path = (builtin_path != NULL) ? strdup(builtin_path) : NULL;
+    pthread_mutex_unlock(&index_lock);
+    size_t len = suggest_commands(name, path, "\n", buf, size - 1);
+    free(path);
+    if (len > 0){
+        buf[len++] = '\n';
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+
+void suggest_free(){
+    pthread_mutex_lock(&index_lock);
+    clear_index();
+    free(builtin_path);
+    builtin_path = NULL;
+    pthread_mutex_unlock(&index_lock);
+}
@@ -0,0 +1,190 @@
+#include "cscshell.h"
+
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+/*
+** `timeout [-k GRACE] DURATION PIPELINE`, or CMD_TIMEOUT=DURATION for
+** every pipeline without the prefix, gives a line a deadline. Instead
+** of blocking in waitpid, finish_line then polls a pidfd per process
+** and a timerfd: at the deadline every process still running gets
+** SIGTERM, and GRACE later (TIMEOUT_GRACE_NS by default) SIGKILL. The
+** line's status is then TIMEOUT_STATUS, as with timeout(1), whatever
+** the processes exited with.
+**
+** Durations are numbers, fractions allowed, with an optional s, m, h
+** or d suffix. A line with a deadline execs every stage rather than
+** running it as a filter thread, which could not be stopped; only the
+** builtins, which do not block, stay filters.
+*/
+
+
+// Parses a duration into nanoseconds; returns -1 if it is not one
+static int64_t parse_duration(const char *text){
+    char *end;
+    errno = 0;
+    double value = strtod(text, &end);
+    if (errno != 0 || end == text || !isfinite(value) || value < 0){
+        return -1;
+    }
+    double unit = 1e9;
+    switch (*end){
+    case '\0': break;
+    case 's': unit = 1e9; end++; break;
+    case 'm': unit = 60e9; end++; break;
+    case 'h': unit = 3600e9; end++; break;
+    case 'd': unit = 86400e9; end++; break;
+    default: return -1;
+    }
+    if (*end != '\0' || value * unit > (double) INT64_MAX){
+        return -1;
+    }
+    return (int64_t) (value * unit);
+}
+
+
+// Reads the next word of *rest, in place; NULL if there is none
+static char *next_word(char **rest){
+    *rest += strspn(*rest, " \t");
+    if (**rest == '\0'){
+        return NULL;
+    }
+    char *word = *rest;
+    *rest += strcspn(*rest, " \t");
+    if (**rest != '\0'){
+        *(*rest)++ = '\0';
+    }
+    return word;
+}
+
+
+char *timeout_parse_prefix(char *line, Variable *variables,
+                           int64_t *timeout_ns, int64_t *grace_ns){
+    *timeout_ns = 0;
+    *grace_ns = TIMEOUT_GRACE_NS;
+    size_t prefix_len = strlen(TIMEOUT);
+    if (strncmp(line, TIMEOUT, prefix_len) != 0 ||
+        !isspace((unsigned char) line[prefix_len])){
+        // no prefix: CMD_TIMEOUT, if set, is the deadline
+        for (Variable *var = variables; var != NULL; var = var->next){
+            if (strcmp(var->name, TIMEOUT_VAR_NAME) == 0){
+                if (var->value[0] != '\0' &&
+                    (*timeout_ns = parse_duration(var->value)) < 0){
+                    ERR_PRINT(ERR_TIMEOUT_VAR, var->value);
+                    *timeout_ns = 0;
+                }
+                break;
+            }
+        }
+        return NULL;
+    }
+
+    char *rest = line + prefix_len;
+    char *word = next_word(&rest);
+    if (word != NULL && strcmp(word, TIMEOUT_KILL_FLAG) == 0){
+        char *grace = next_word(&rest);
+        *grace_ns = (grace != NULL) ? parse_duration(grace) : -1;
+        word = next_word(&rest);
+    }
+    if (word != NULL){
+        *timeout_ns = parse_duration(word);
+    }
+    rest += strspn(rest, " \t");
+    if (word == NULL || *timeout_ns < 0 || *grace_ns < 0 || *rest == '\0'){
+        ERR_PRINT(ERR_TIMEOUT_USAGE);
+        *timeout_ns = -1;
+        return NULL;
+    }
+    return rest;
+}
+
+
+static void arm(int timer_fd, int64_t ns, int flags){
+    struct itimerspec when = {
+        .it_value = {ns / 1000000000, ns % 1000000000}
+    };
+    // a zero it_value would disarm the timer instead
+    if (ns <= 0){
+        when.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timer_fd, flags, &when, NULL);
+}
+
+
+int timeout_wait(LineJob *job){
+    int num_commands = job->num_commands;
+    struct pollfd *fds = calloc(num_commands + 1, sizeof(struct pollfd));
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fds == NULL || timer_fd < 0){
+        perror("timeout_wait");
+        free(fds);
+        if (timer_fd >= 0) close(timer_fd);
+        return -1;
+    }
+
+    // fds[0] is the timer, fds[i + 1] stage i's pidfd, -1 once it exits
+    fds[0].fd = timer_fd;
+    fds[0].events = POLLIN;
+    int running = 0;
+    int error = 0;
+    for (int i = 0; i < num_commands; i++){
+        fds[i + 1].fd = -1;
+        fds[i + 1].events = POLLIN;
+        if (job->pids[i] <= 0){
+            continue;
+        }
+        fds[i + 1].fd = syscall(SYS_pidfd_open, job->pids[i], 0);
+        if (fds[i + 1].fd < 0){
+            error = -1;
+            break;
+        }
+        running++;
+    }
+
+    int signals_sent = 0;
+    if (error == 0){
+        arm(timer_fd, job->deadline, TFD_TIMER_ABSTIME);
+    }
+    while (error == 0 && running > 0){
+        if (poll(fds, num_commands + 1, -1) < 0){
+            if (errno == EINTR) continue;
+            perror("timeout_wait");
+            error = -1;
+            break;
+        }
+        for (int i = 1; i <= num_commands; i++){
+            if (fds[i].fd >= 0 && (fds[i].revents & POLLIN)){
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                running--;
+            }
+        }
+        uint64_t expirations;
+        if (running == 0 || !(fds[0].revents & POLLIN) ||
+            read(timer_fd, &expirations, sizeof(expirations)) < 0){
+            continue;
+        }
+
+        // first the deadline: SIGTERM; then the grace period: SIGKILL
+        int signal = (signals_sent == 0) ? SIGTERM : SIGKILL;
+        for (int i = 1; i <= num_commands; i++){
+            if (fds[i].fd >= 0){
+                syscall(SYS_pidfd_send_signal, fds[i].fd, signal, NULL, 0);
+            }
+        }
+        if (signals_sent++ == 0){
+            arm(timer_fd, job->grace_ns, 0);
+        }
+    }
+
+    for (int i = 1; i <= num_commands; i++){
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+    free(fds);
+    close(timer_fd);
+    // without pidfds the line is left to the plain blocking wait
+    return (error < 0) ? -1 : (signals_sent > 0);
+}
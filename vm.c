@@ -0,0 +1,1405 @@
+#include "cscshell.h"
+
+/*
+** Blocks (for/while/if) are compiled once into a Program: a flat array
+** of instructions over a table of pre-lexed statements. Statements keep
+** their text split into literal segments and variable slots, so running
+** a loop body again only substitutes the current variable values.
+**
+** A function body is a Program of its own, kept in a table by name once
+** its definition runs. A call pushes $1..$N (and $@) onto the front of
+** the variable list, where they shadow globals the same way `local`
+** variables do, runs the body and unlinks them again.
+*/
+
+typedef enum Opcode {
+    OP_RUN,         // run statement arg, setting the status
+    OP_JUMP,        // continue at arg
+    OP_JUMP_FALSE,  // continue at arg if the status is non-zero
+    OP_JUMP_TRUE,   // continue at arg if the status is zero
+    OP_CLEAR,       // set the status to 0
+    OP_FOR_BEGIN,   // expand the word list of loop arg
+    OP_FOR_NEXT,    // assign the next word of loop arg, or leave the loop
+    OP_DEFINE,      // define function arg
+    OP_RETURN,      // leave the function, with statement arg as the status
+} Opcode;
+
+typedef struct Instr {
+    uint8_t op;
+    uint32_t arg;
+} Instr;
+
+typedef struct Slot {
+    char *name;
+    Variable *var;  // resolved on first use
+} Slot;
+
+typedef struct Segment {
+    char *literal;      // set for plain text
+    ArithExpr *arith;   // set for $((...))
+    char *subst;        // set for $(...), the command to run
+    bool last_status;   // set for $?
+    uint32_t slot;      // otherwise, a variable reference
+} Segment;
+
+typedef struct Template {
+    Segment *segs;
+    uint32_t num_segs;
+} Template;
+
+typedef enum StmtKind {
+    STMT_COMMAND,   // expand, then parse_expanded_line
+    STMT_ASSIGN,    // NAME=VALUE through a slot
+    STMT_RAW,       // anything else goes through run_line as written
+    STMT_LOCAL,     // local NAME[=VALUE]...
+    STMT_RETURN,    // return [N]
+} StmtKind;
+
+typedef struct Stmt {
+    StmtKind kind;
+    char *text;
+    uint32_t slot;
+    Template expansion;
+} Stmt;
+
+typedef struct Loop {
+    uint32_t slot;
+    Template words;
+    uint32_t exit_pc;
+} Loop;
+
+typedef struct Definition {
+    char *name;
+    struct Program *body;
+} Definition;
+
+typedef struct Program {
+    uint32_t refs;  // function bodies are shared with the function table
+    Instr *code;
+    uint32_t num_code, cap_code;
+    Stmt *stmts;
+    uint32_t num_stmts, cap_stmts;
+    Loop *loops;
+    uint32_t num_loops, cap_loops;
+    Slot *slots;
+    uint32_t num_slots, cap_slots;
+    Definition *defs;
+    uint32_t num_defs, cap_defs;
+} Program;
+
+typedef struct Compiler {
+    Program *prog;
+    LineSource next_line;
+    void *ctx;
+    char buf[MAX_SINGLE_LINE];
+    char *pos;      // the part of buf not split into pieces yet
+    char *pending;  // what followed a keyword, e.g. "echo" in "do echo"
+    int in_function;
+} Compiler;
+
+typedef struct LoopState {
+    char **words;
+    size_t num_words;
+    size_t next;
+} LoopState;
+
+struct Function {
+    char *name;
+    Program *body;
+    struct Function *next;
+};
+
+// The variables a running call has pushed: its arguments and locals
+typedef struct Frame {
+    Variable **pushed;
+    uint32_t num_pushed, cap_pushed;
+    struct Frame *caller;
+} Frame;
+
+static Function *functions[FUNCTION_TABLE_SIZE];
+static Frame *current_frame = NULL;
+static int call_depth = 0;
+
+static int vm_exec(Program *prog, Variable **root);
+
+
+// Makes room for one more element in a growable array
+static int grow(void **array, uint32_t *capacity, uint32_t used, size_t size){
+    if (used < *capacity){
+        return 0;
+    }
+    uint32_t new_capacity = (*capacity == 0) ? 8 : *capacity * 2;
+    void *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL){
+        perror("vm");
+        return -1;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+
+static char *trim(char *str){
+    while (isspace((unsigned char) *str)) str++;
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) end--;
+    *end = '\0';
+    return str;
+}
+
+
+// Returns what follows keyword if it is the first word of piece
+static char *after_keyword(char *piece, const char *keyword){
+    size_t len = strlen(keyword);
+    if (strncmp(piece, keyword, len) != 0 ||
+        (piece[len] != '\0' && !isspace((unsigned char) piece[len]))){
+        return NULL;
+    }
+    piece += len;
+    while (isspace((unsigned char) *piece)) piece++;
+    return piece;
+}
+
+
+// Returns the end of the function name if piece starts `NAME()`, and in
+// *rest what follows the parentheses
+static const char *function_header(const char *piece, const char **rest){
+    const char *end = piece;
+    if (!isalpha((unsigned char) *end) && *end != '_'){
+        return NULL;
+    }
+    while (isalnum((unsigned char) *end) || *end == '_' || *end == '-'){
+        end++;
+    }
+    const char *pos = end;
+    while (*pos == ' ' || *pos == '\t') pos++;
+    if (strncmp(pos, "()", 2) != 0){
+        return NULL;
+    }
+    pos += 2;
+    while (isspace((unsigned char) *pos)) pos++;
+    *rest = pos;
+    return end;
+}
+
+
+bool vm_starts_block(const char *line){
+    while (isspace((unsigned char) *line)) line++;
+    char *first = (char *) line;
+    const char *rest;
+    return after_keyword(first, KW_FOR) || after_keyword(first, KW_WHILE) ||
+        after_keyword(first, KW_IF) || function_header(first, &rest);
+}
+
+
+/*
+** Splits the input into pieces: lines with comments removed, cut at
+** ';'. Returns NULL at the end of input, or at the end of the current
+** line if may_read is false.
+*/
+static char *next_piece(Compiler *c, bool may_read){
+    if (c->pending != NULL){
+        char *piece = c->pending;
+        c->pending = NULL;
+        return piece;
+    }
+    while (true){
+        if (c->pos == NULL){
+            if (!may_read ||
+                c->next_line(c->buf, MAX_SINGLE_LINE, c->ctx) == NULL){
+                return NULL;
+            }
+            c->buf[strcspn(c->buf, "#\n")] = '\0';
+            c->pos = c->buf;
+        }
+        char *piece = c->pos;
+        // a ; in quotes or $(...) does not end the statement
+        char *semi = piece;
+        while (semi != NULL && *semi != '\0' && *semi != ';'){
+            semi = (char *) list_skip_quoted(semi);
+            if (semi != NULL) semi++;
+        }
+        if (semi != NULL && *semi == ';'){
+            *semi = '\0';
+            c->pos = semi + 1;
+        }
+        else {
+            c->pos = NULL;
+        }
+        piece = trim(piece);
+        if (*piece != '\0'){
+            return piece;
+        }
+    }
+}
+
+
+static int64_t emit(Program *prog, Opcode op, uint32_t arg){
+    if (grow((void **) &prog->code, &prog->cap_code, prog->num_code,
+             sizeof(Instr)) < 0){
+        return -1;
+    }
+    prog->code[prog->num_code].op = op;
+    prog->code[prog->num_code].arg = arg;
+    return prog->num_code++;
+}
+
+
+static int64_t get_slot(Program *prog, const char *name, size_t len){
+    for (uint32_t i = 0; i < prog->num_slots; i++){
+        if (strlen(prog->slots[i].name) == len &&
+            strncmp(prog->slots[i].name, name, len) == 0){
+            return i;
+        }
+    }
+    if (grow((void **) &prog->slots, &prog->cap_slots, prog->num_slots,
+             sizeof(Slot)) < 0){
+        return -1;
+    }
+    Slot *slot = &prog->slots[prog->num_slots];
+    slot->name = strndup(name, len);
+    slot->var = NULL;
+    if (slot->name == NULL){
+        perror("vm");
+        return -1;
+    }
+    return prog->num_slots++;
+}
+
+
+static int add_segment(Program *prog, Template *tmpl, const char *literal,
+                       size_t len, int64_t slot){
+    Segment *grown = realloc(tmpl->segs,
+                             (tmpl->num_segs + 1) * sizeof(Segment));
+    if (grown == NULL){
+        perror("vm");
+        return -1;
+    }
+    tmpl->segs = grown;
+    Segment *seg = &tmpl->segs[tmpl->num_segs];
+    seg->literal = NULL;
+    seg->arith = NULL;
+    seg->subst = NULL;
+    seg->last_status = false;
+    seg->slot = (uint32_t) slot;
+    if (literal != NULL){
+        seg->literal = strndup(literal, len);
+        if (seg->literal == NULL){
+            perror("vm");
+            return -1;
+        }
+    }
+    tmpl->num_segs++;
+    return 0;
+}
+
+
+/*
+** Splits text into literals, $? and $NAME / ${NAME} slots, with the same
+** rules as replace_variables_mk_line. Returns 1 if the text cannot be
+** split that way (so it is left to run_line), -1 on system errors.
+*/
+static int compile_template(Program *prog, const char *text, Template *tmpl){
+    const char *pos = text;
+    while (*pos != '\0'){
+        const char *name, *name_end, *next;
+        if (*pos != '$'){
+            const char *dollar = strchr(pos, '$');
+            size_t len = (dollar != NULL) ? (size_t) (dollar - pos)
+                                          : strlen(pos);
+            if (add_segment(prog, tmpl, pos, len, 0) < 0){
+                return -1;
+            }
+            pos += len;
+            continue;
+        }
+
+        if (strncmp(pos, ARITH_START, strlen(ARITH_START)) == 0){
+            // parsed now, evaluated on every run
+            const char *expr_start = pos + strlen(ARITH_START);
+            const char *expr_end = arith_find_end(expr_start);
+            if (expr_end == NULL){
+                return 1;
+            }
+            ArithExpr *expr = arith_compile(expr_start, expr_end - expr_start);
+            if (expr == NULL || expr == (ArithExpr *) -1){
+                return (expr == NULL) ? 1 : -1;
+            }
+            if (add_segment(prog, tmpl, NULL, 0, 0) < 0){
+                arith_free(expr);
+                return -1;
+            }
+            tmpl->segs[tmpl->num_segs - 1].arith = expr;
+            pos = expr_end + strlen(ARITH_END);
+            continue;
+        }
+
+        if (strncmp(pos, SUBST_START, strlen(SUBST_START)) == 0){
+            // run again on every expansion
+            const char *cmd_start = pos + strlen(SUBST_START);
+            const char *cmd_end = subst_find_end(cmd_start);
+            if (cmd_end == NULL){
+                return 1;
+            }
+            char *cmd = strndup(cmd_start, cmd_end - cmd_start);
+            if (cmd == NULL || add_segment(prog, tmpl, NULL, 0, 0) < 0){
+                if (cmd == NULL) perror("vm");
+                free(cmd);
+                return -1;
+            }
+            tmpl->segs[tmpl->num_segs - 1].subst = cmd;
+            pos = cmd_end + strlen(SUBST_END);
+            continue;
+        }
+
+        // read when the statement runs, like any other variable
+        if (strncmp(pos, LAST_STATUS_VAR, strlen(LAST_STATUS_VAR)) == 0){
+            if (add_segment(prog, tmpl, NULL, 0, 0) < 0){
+                return -1;
+            }
+            tmpl->segs[tmpl->num_segs - 1].last_status = true;
+            pos += strlen(LAST_STATUS_VAR);
+            continue;
+        }
+
+        if (pos[1] == '{'){
+            name = pos + 2;
+            name_end = strchr(name, '}');
+            if (name_end == NULL){
+                return 1;
+            }
+            next = name_end + 1;
+        }
+        else {
+            name = pos + 1;
+            name_end = name;
+            while (*name_end != '\0' && !isspace((unsigned char) *name_end) &&
+                   *name_end != '$'){
+                name_end++;
+            }
+            next = name_end;
+        }
+
+        int64_t slot = get_slot(prog, name, name_end - name);
+        if (slot < 0 || add_segment(prog, tmpl, NULL, 0, slot) < 0){
+            return -1;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+
+// Adds piece to the statement table as it is, returning its index
+static int64_t new_stmt(Program *prog, const char *piece){
+    if (grow((void **) &prog->stmts, &prog->cap_stmts, prog->num_stmts,
+             sizeof(Stmt)) < 0){
+        return -1;
+    }
+    Stmt *stmt = &prog->stmts[prog->num_stmts];
+    memset(stmt, 0, sizeof(Stmt));
+    stmt->kind = STMT_RAW;
+    stmt->text = strdup(piece);
+    if (stmt->text == NULL){
+        perror("vm");
+        return -1;
+    }
+    return prog->num_stmts++;
+}
+
+
+// Adds piece to the statement table, returning its index
+static int64_t compile_stmt(Program *prog, char *piece){
+    if (new_stmt(prog, piece) < 0){
+        return -1;
+    }
+
+    // classified the same way parse_line does
+    char *equals = piece + strcspn(piece, "= \t\n");
+    if (after_keyword(piece, EXPORT) != NULL){
+        return prog->num_stmts - 1;
+    }
+
+    StmtKind kind = STMT_COMMAND;
+    int64_t slot = 0;
+    char *expansion = piece;
+    if (*equals == '='){
+        *equals = '\0';
+        bool valid = valid_variable_name(piece);
+        slot = valid ? get_slot(prog, piece, strlen(piece)) : 0;
+        *equals = '=';
+        if (!valid || slot < 0){
+            return (slot < 0) ? -1 : prog->num_stmts - 1;
+        }
+        kind = STMT_ASSIGN;
+        expansion = equals + 1;
+    }
+
+    Template tmpl = {NULL, 0};
+    int result = compile_template(prog, expansion, &tmpl);
+    Stmt *stmt = &prog->stmts[prog->num_stmts - 1];
+    stmt->expansion = tmpl;
+    if (result < 0){
+        return -1;
+    }
+    if (result == 0){
+        stmt->kind = kind;
+        stmt->slot = slot;
+    }
+    return prog->num_stmts - 1;
+}
+
+
+static int compile_statement(Compiler *c, char *piece);
+
+
+/*
+** Compiles a list such as `a && b || c` one element at a time with
+** compile_one. An element after && or || is jumped over when the status
+** rules it out, which keeps that status for the next one, as run_list
+** does. Returns -1 on errors, which have been printed.
+*/
+static int compile_and_or(Compiler *c, char *piece,
+                          int (*compile_one)(Compiler *, char *)){
+    CommandList *list = list_parse(piece);
+    if (list == NULL){
+        return compile_one(c, piece);
+    }
+    if (list == (CommandList *) -1 || list->count == 0){
+        list_free((list == (CommandList *) -1) ? NULL : list);
+        return -1;
+    }
+
+    int error = 0;
+    for (int i = 0; i < list->count && error == 0; i++){
+        char *element = trim(list->elements[i]);
+        if (vm_starts_block(element)){
+            ERR_PRINT(ERR_LIST_BLOCK, element);
+            error = -1;
+            break;
+        }
+        int64_t skip = 0;
+        if (list->ops[i] == LIST_OP_AND){
+            skip = emit(c->prog, OP_JUMP_FALSE, 0);
+        }
+        else if (list->ops[i] == LIST_OP_OR){
+            skip = emit(c->prog, OP_JUMP_TRUE, 0);
+        }
+        error = (skip < 0) ? -1 : compile_one(c, element);
+        if (error == 0 && list->ops[i] != LIST_OP_SEQ){
+            c->prog->code[skip].arg = c->prog->num_code;
+        }
+    }
+    list_free(list);
+    return error;
+}
+
+
+// Compiles the condition of an if or while, which may be a list
+static int compile_condition(Compiler *c, char *condition){
+    if (line_is_list(condition)){
+        return compile_and_or(c, condition, compile_condition);
+    }
+    int64_t stmt = compile_stmt(c->prog, condition);
+    return (stmt < 0 || emit(c->prog, OP_RUN, stmt) < 0) ? -1 : 0;
+}
+
+
+// Compiles statements up to one of terms; returns which one, and *rest
+static int compile_list(Compiler *c, const char **terms, int num_terms,
+                        char **rest){
+    while (true){
+        char *piece = next_piece(c, true);
+        if (piece == NULL){
+            ERR_PRINT(ERR_BLOCK_EOF, terms[num_terms - 1]);
+            return -1;
+        }
+        for (int i = 0; i < num_terms; i++){
+            if ((*rest = after_keyword(piece, terms[i])) != NULL){
+                return i;
+            }
+        }
+        if (compile_statement(c, piece) < 0){
+            return -1;
+        }
+    }
+}
+
+
+// Reads the keyword that must come next, like the "do" of a loop
+static int expect_keyword(Compiler *c, const char *keyword){
+    char *piece = next_piece(c, true);
+    if (piece == NULL){
+        ERR_PRINT(ERR_BLOCK_EOF, keyword);
+        return -1;
+    }
+    char *rest = after_keyword(piece, keyword);
+    if (rest == NULL){
+        ERR_PRINT(ERR_BLOCK_SYNTAX, piece);
+        return -1;
+    }
+    if (*rest != '\0'){
+        c->pending = rest;
+    }
+    return 0;
+}
+
+
+// Compiles statements up to a closing keyword that must end its piece
+static int compile_body(Compiler *c, const char *closing){
+    char *rest;
+    if (compile_list(c, &closing, 1, &rest) < 0){
+        return -1;
+    }
+    if (*rest != '\0'){
+        ERR_PRINT(ERR_BLOCK_SYNTAX, rest);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int compile_for(Compiler *c, char *header){
+    Program *prog = c->prog;
+
+    char *name = header;
+    char *name_end = name;
+    while (*name_end != '\0' && !isspace((unsigned char) *name_end)) name_end++;
+    char *words = name_end;
+    while (isspace((unsigned char) *words)) words++;
+    words = after_keyword(words, KW_IN);
+    *name_end = '\0';
+    if (!valid_variable_name(name) || words == NULL){
+        ERR_PRINT(ERR_BLOCK_SYNTAX, KW_FOR);
+        return -1;
+    }
+
+    if (grow((void **) &prog->loops, &prog->cap_loops, prog->num_loops,
+             sizeof(Loop)) < 0){
+        return -1;
+    }
+    uint32_t loop = prog->num_loops++;
+    memset(&prog->loops[loop], 0, sizeof(Loop));
+    int64_t slot = get_slot(prog, name, strlen(name));
+    Template tmpl = {NULL, 0};
+    int result = (slot < 0) ? -1 : compile_template(prog, words, &tmpl);
+    prog->loops[loop].slot = slot;
+    prog->loops[loop].words = tmpl;
+    if (result != 0){
+        if (result > 0){
+            ERR_PRINT(ERR_PARSING_LINE);
+        }
+        return -1;
+    }
+
+    int64_t top;
+    if (emit(prog, OP_FOR_BEGIN, loop) < 0 ||
+        (top = emit(prog, OP_FOR_NEXT, loop)) < 0 ||
+        expect_keyword(c, KW_DO) < 0 ||
+        compile_body(c, KW_DONE) < 0 ||
+        emit(prog, OP_JUMP, top) < 0){
+        return -1;
+    }
+    prog->loops[loop].exit_pc = prog->num_code;
+    return 0;
+}
+
+
+static int compile_while(Compiler *c, char *condition){
+    Program *prog = c->prog;
+    int64_t top = prog->num_code;
+    int64_t exit_jump;
+
+    if (compile_condition(c, condition) < 0 ||
+        (exit_jump = emit(prog, OP_JUMP_FALSE, 0)) < 0 ||
+        expect_keyword(c, KW_DO) < 0 ||
+        compile_body(c, KW_DONE) < 0 ||
+        emit(prog, OP_JUMP, top) < 0){
+        return -1;
+    }
+    prog->code[exit_jump].arg = prog->num_code;
+    // a loop that ran to completion succeeds
+    return (emit(prog, OP_CLEAR, 0) < 0) ? -1 : 0;
+}
+
+
+static int compile_if(Compiler *c, char *condition){
+    Program *prog = c->prog;
+    const char *terms[] = {KW_ELIF, KW_ELSE, KW_FI};
+    uint32_t *end_jumps = NULL;
+    int num_end_jumps = 0;
+    int error = -1;
+
+    while (true){
+        int64_t false_jump;
+        if (compile_condition(c, condition) < 0 ||
+            (false_jump = emit(prog, OP_JUMP_FALSE, 0)) < 0 ||
+            expect_keyword(c, KW_THEN) < 0){
+            goto if_cleanup;
+        }
+
+        char *rest;
+        int term = compile_list(c, terms, 3, &rest);
+        int64_t end_jump;
+        uint32_t *grown = realloc(end_jumps,
+                                  (num_end_jumps + 1) * sizeof(uint32_t));
+        if (term < 0 || grown == NULL ||
+            (end_jump = emit(prog, OP_JUMP, 0)) < 0){
+            if (term >= 0 && grown == NULL) perror("vm");
+            if (grown != NULL) end_jumps = grown;
+            goto if_cleanup;
+        }
+        end_jumps = grown;
+        end_jumps[num_end_jumps++] = end_jump;
+        prog->code[false_jump].arg = prog->num_code;
+
+        if (term == 0){
+            if (*rest == '\0'){
+                ERR_PRINT(ERR_BLOCK_SYNTAX, KW_ELIF);
+                goto if_cleanup;
+            }
+            // the condition is copied by compile_stmt before reading on
+            condition = rest;
+            continue;
+        }
+        if (term == 1){
+            if (*rest != '\0'){
+                c->pending = rest;
+            }
+            if (compile_body(c, KW_FI) < 0){
+                goto if_cleanup;
+            }
+        }
+        else {
+            if (*rest != '\0'){
+                ERR_PRINT(ERR_BLOCK_SYNTAX, rest);
+                goto if_cleanup;
+            }
+            // no branch taken still succeeds
+            if (emit(prog, OP_CLEAR, 0) < 0){
+                goto if_cleanup;
+            }
+        }
+        break;
+    }
+
+    for (int i = 0; i < num_end_jumps; i++){
+        prog->code[end_jumps[i]].arg = prog->num_code;
+    }
+    error = 0;
+
+if_cleanup:
+    free(end_jumps);
+    return error;
+}
+
+
+static int compile_function(Compiler *c, char *name, const char *header_rest){
+    Program *prog = c->prog;
+    if (grow((void **) &prog->defs, &prog->cap_defs, prog->num_defs,
+             sizeof(Definition)) < 0){
+        return -1;
+    }
+    Definition *def = &prog->defs[prog->num_defs];
+    def->name = strdup(name);
+    def->body = calloc(1, sizeof(Program));
+    if (def->name == NULL || def->body == NULL){
+        perror("vm");
+        free(def->name);
+        free(def->body);
+        return -1;
+    }
+    def->body->refs = 1;
+    uint32_t index = prog->num_defs++;
+
+    // the body may start on the header's line: `name() { cmd; ...`
+    if (*header_rest != '\0'){
+        c->pending = (char *) header_rest;
+    }
+    if (expect_keyword(c, KW_BRACE_OPEN) < 0){
+        return -1;
+    }
+    c->prog = def->body;
+    c->in_function++;
+    int error = compile_body(c, KW_BRACE_CLOSE);
+    c->in_function--;
+    c->prog = prog;
+    if (error < 0 || emit(prog, OP_DEFINE, index) < 0){
+        return -1;
+    }
+    return 0;
+}
+
+
+// `return` and `local` only make sense inside a function body
+static int compile_function_stmt(Compiler *c, char *piece, StmtKind kind,
+                                 const char *keyword, char *rest){
+    if (!c->in_function){
+        ERR_PRINT(ERR_FUNC_ONLY, keyword);
+        return -1;
+    }
+    int64_t stmt = new_stmt(c->prog, rest);
+    if (stmt < 0){
+        return -1;
+    }
+    Template tmpl = {NULL, 0};
+    int result = compile_template(c->prog, rest, &tmpl);
+    c->prog->stmts[stmt].expansion = tmpl;
+    c->prog->stmts[stmt].kind = kind;
+    if (result != 0){
+        if (result > 0){
+            ERR_PRINT(ERR_BLOCK_SYNTAX, piece);
+        }
+        return -1;
+    }
+    return (emit(c->prog, (kind == STMT_RETURN) ? OP_RETURN : OP_RUN,
+                 stmt) < 0) ? -1 : 0;
+}
+
+
+static int compile_statement(Compiler *c, char *piece){
+    // blocks in a list are rejected there, not started here
+    if (line_is_list(piece) && !vm_starts_block(piece)){
+        return compile_and_or(c, piece, compile_statement);
+    }
+    char *rest;
+    const char *header_rest;
+    const char *name_end = function_header(piece, &header_rest);
+    if (name_end != NULL){
+        piece[name_end - piece] = '\0';
+        return compile_function(c, piece, header_rest);
+    }
+    if ((rest = after_keyword(piece, KW_RETURN)) != NULL){
+        return compile_function_stmt(c, piece, STMT_RETURN, KW_RETURN, rest);
+    }
+    if ((rest = after_keyword(piece, KW_LOCAL)) != NULL){
+        return compile_function_stmt(c, piece, STMT_LOCAL, KW_LOCAL, rest);
+    }
+    if ((rest = after_keyword(piece, KW_FOR)) != NULL){
+        return compile_for(c, rest);
+    }
+    if ((rest = after_keyword(piece, KW_WHILE)) != NULL){
+        return compile_while(c, rest);
+    }
+    if ((rest = after_keyword(piece, KW_IF)) != NULL){
+        return compile_if(c, rest);
+    }
+
+    const char *closing[] = {KW_DO, KW_DONE, KW_THEN, KW_ELIF, KW_ELSE, KW_FI,
+                             KW_BRACE_OPEN, KW_BRACE_CLOSE};
+    for (size_t i = 0; i < sizeof(closing) / sizeof(closing[0]); i++){
+        if (after_keyword(piece, closing[i]) != NULL){
+            ERR_PRINT(ERR_BLOCK_SYNTAX, closing[i]);
+            return -1;
+        }
+    }
+
+    int64_t stmt = compile_stmt(c->prog, piece);
+    if (stmt < 0 || emit(c->prog, OP_RUN, stmt) < 0){
+        return -1;
+    }
+    return 0;
+}
+
+
+static void free_template(Template *tmpl){
+    for (uint32_t i = 0; i < tmpl->num_segs; i++){
+        free(tmpl->segs[i].literal);
+        free(tmpl->segs[i].subst);
+        arith_free(tmpl->segs[i].arith);
+    }
+    free(tmpl->segs);
+}
+
+
+static void free_program(Program *prog){
+    for (uint32_t i = 0; i < prog->num_stmts; i++){
+        free(prog->stmts[i].text);
+        free_template(&prog->stmts[i].expansion);
+    }
+    for (uint32_t i = 0; i < prog->num_loops; i++){
+        free_template(&prog->loops[i].words);
+    }
+    for (uint32_t i = 0; i < prog->num_slots; i++){
+        free(prog->slots[i].name);
+    }
+    for (uint32_t i = 0; i < prog->num_defs; i++){
+        free(prog->defs[i].name);
+        if (--prog->defs[i].body->refs == 0){
+            free_program(prog->defs[i].body);
+        }
+    }
+    free(prog->code);
+    free(prog->stmts);
+    free(prog->loops);
+    free(prog->slots);
+    free(prog->defs);
+    free(prog);
+}
+
+
+static void release_program(Program *prog){
+    if (--prog->refs == 0){
+        free_program(prog);
+    }
+}
+
+
+// Forgets resolved variables, which a call's arguments and locals shadow
+static void reset_slots(Program *prog){
+    for (uint32_t i = 0; i < prog->num_slots; i++){
+        prog->slots[i].var = NULL;
+    }
+}
+
+
+static Variable *slot_lookup(Program *prog, uint32_t index, Variable *root){
+    Slot *slot = &prog->slots[index];
+    if (slot->var == NULL){
+        for (Variable *var = root; var != NULL; var = var->next){
+            if (strcmp(var->name, slot->name) == 0){
+                slot->var = var;
+                break;
+            }
+        }
+    }
+    return slot->var;
+}
+
+
+static int slot_assign(Program *prog, uint32_t index, const char *value,
+                       Variable **root){
+    Variable *var = slot_lookup(prog, index, *root);
+    if (var == NULL){
+        var = set_variable(root, prog->slots[index].name, value);
+        prog->slots[index].var = var;
+        return (var == NULL) ? -1 : 0;
+    }
+    char *new_value = strdup(value);
+    if (new_value == NULL){
+        perror("vm");
+        return -1;
+    }
+    free(var->value);
+    var->value = new_value;
+    variables_generation++;
+    if (var->exported){
+        env_mark_dirty();
+    }
+    return 0;
+}
+
+
+/*
+** Substitutes the current values into tmpl. Returns a heap string,
+** NULL if a variable is not set, or (char *) -1 on system errors.
+*/
+static char *expand(Program *prog, Template *tmpl, Variable **root){
+    size_t len = 0, capacity = 64;
+    char *line = malloc(capacity);
+    if (line == NULL){
+        perror("vm");
+        return (char *) -1;
+    }
+    line[0] = '\0';
+
+    for (uint32_t i = 0; i < tmpl->num_segs; i++){
+        const char *value = tmpl->segs[i].literal;
+        char *output = NULL;
+        char number[32];
+        if (tmpl->segs[i].subst != NULL){
+            output = subst_run(tmpl->segs[i].subst,
+                               strlen(tmpl->segs[i].subst), root);
+            if (output == NULL || output == (char *) -1){
+                free(line);
+                return output;
+            }
+            value = output;
+        }
+        else if (tmpl->segs[i].arith != NULL){
+            int64_t result;
+            int error = arith_eval(tmpl->segs[i].arith, root, &result);
+            if (error != 0){
+                free(line);
+                return (error < 0) ? (char *) -1 : NULL;
+            }
+            snprintf(number, sizeof(number), "%lld", (long long) result);
+            value = number;
+        }
+        else if (tmpl->segs[i].last_status){
+            snprintf(number, sizeof(number), "%d", last_status);
+            value = number;
+        }
+        else if (value == NULL){
+            Variable *var = slot_lookup(prog, tmpl->segs[i].slot, *root);
+            if (var == NULL){
+                ERR_PRINT(ERR_VAR_NOT_FOUND, prog->slots[tmpl->segs[i].slot].name);
+                free(line);
+                return NULL;
+            }
+            value = var->value;
+        }
+        size_t value_len = strlen(value);
+        if (len + value_len + 1 > capacity){
+            while (len + value_len + 1 > capacity) capacity *= 2;
+            char *grown = realloc(line, capacity);
+            if (grown == NULL){
+                perror("vm");
+                free(line);
+                free(output);
+                return (char *) -1;
+            }
+            line = grown;
+        }
+        memcpy(line + len, value, value_len + 1);
+        len += value_len;
+        free(output);
+    }
+    return line;
+}
+
+
+/* ************************************************************** */
+/*                            Functions                           */
+/* ************************************************************** */
+
+static Function **function_bucket(const char *name, size_t len){
+    return &functions[fnv_bytes(FNV_OFFSET, name, len) % FUNCTION_TABLE_SIZE];
+}
+
+
+static int define_function(Definition *def){
+    Function **bucket = function_bucket(def->name, strlen(def->name));
+    Function *function = *bucket;
+    while (function != NULL && strcmp(function->name, def->name) != 0){
+        function = function->next;
+    }
+    if (function == NULL){
+        function = malloc(sizeof(Function));
+        if (function == NULL || (function->name = strdup(def->name)) == NULL){
+            perror("vm");
+            free(function);
+            return -1;
+        }
+        function->body = NULL;
+        function->next = *bucket;
+        *bucket = function;
+    }
+    // a body still running keeps its own reference until it returns
+    if (function->body != NULL){
+        release_program(function->body);
+    }
+    def->body->refs++;
+    function->body = def->body;
+    return 0;
+}
+
+
+// Puts a new variable in front of *root for the running call
+static Variable *push_variable(Frame *frame, Variable **root,
+                               const char *name, const char *value){
+    if (grow((void **) &frame->pushed, &frame->cap_pushed, frame->num_pushed,
+             sizeof(Variable *)) < 0){
+        return NULL;
+    }
+    Variable *var = malloc(sizeof(Variable));
+    if (var == NULL || (var->name = strdup(name)) == NULL){
+        perror("vm");
+        free(var);
+        return NULL;
+    }
+    if ((var->value = strdup(value)) == NULL){
+        perror("vm");
+        free(var->name);
+        free(var);
+        return NULL;
+    }
+    var->exported = 0;
+    var->next = *root;
+    *root = var;
+    variables_generation++;
+    frame->pushed[frame->num_pushed++] = var;
+    return var;
+}
+
+
+// Unlinks and frees everything the call pushed
+static void pop_frame(Frame *frame, Variable **root){
+    for (uint32_t i = 0; i < frame->num_pushed; i++){
+        Variable **link = root;
+        while (*link != NULL && *link != frame->pushed[i]){
+            link = &(*link)->next;
+        }
+        if (*link != NULL){
+            *link = (*link)->next;
+        }
+        free(frame->pushed[i]->name);
+        free(frame->pushed[i]->value);
+        free(frame->pushed[i]);
+    }
+    if (frame->num_pushed > 0){
+        variables_generation++;
+    }
+    free(frame->pushed);
+}
+
+
+// local NAME[=VALUE]...: NAME shadows any outer variable until return
+static int run_local(char *words, Variable **root){
+    char *save;
+    for (char *word = strtok_r(words, " \t", &save); word != NULL;
+         word = strtok_r(NULL, " \t", &save)){
+        char *equals = strchr(word, '=');
+        const char *value = "";
+        if (equals != NULL){
+            *equals = '\0';
+            value = equals + 1;
+        }
+        if (!valid_variable_name(word)){
+            ERR_PRINT(ERR_VAR_NAME, word);
+            return 1;
+        }
+
+        Variable *existing = NULL;
+        for (uint32_t i = 0; i < current_frame->num_pushed; i++){
+            if (strcmp(current_frame->pushed[i]->name, word) == 0){
+                existing = current_frame->pushed[i];
+            }
+        }
+        if (existing != NULL){
+            char *new_value = strdup(value);
+            if (new_value == NULL){
+                perror("vm");
+                return -1;
+            }
+            free(existing->value);
+            existing->value = new_value;
+            variables_generation++;
+        }
+        else if (push_variable(current_frame, root, word, value) == NULL){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int run_return(const char *value){
+    char *end;
+    long status = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0'){
+        ERR_PRINT(ERR_FUNC_RETURN, value);
+        return 2;
+    }
+    return status & 0xff;
+}
+
+
+Function *vm_find_function(const char *line){
+    while (isspace((unsigned char) *line)) line++;
+    size_t len = strcspn(line, " \t\n#");
+    // calls run in the shell itself, so they cannot be piped or redirected
+    if (len == 0 || line[strcspn(line, "|<>")] != '\0'){
+        return NULL;
+    }
+    for (Function *function = *function_bucket(line, len); function != NULL;
+         function = function->next){
+        if (strlen(function->name) == len &&
+            strncmp(function->name, line, len) == 0){
+            return function;
+        }
+    }
+    return NULL;
+}
+
+
+int vm_call(Function *function, const char *line, Variable **root){
+    if (call_depth >= FUNCTION_MAX_DEPTH){
+        ERR_PRINT(ERR_FUNC_DEPTH, function->name);
+        return 1;
+    }
+
+    char *args = strdup(line);
+    if (args == NULL){
+        perror("vm_call");
+        return -1;
+    }
+    args[strcspn(args, "#")] = '\0';
+    char *rest = trim(args);
+    rest += strcspn(rest, " \t");
+    rest = trim(rest);
+
+    Frame frame = {NULL, 0, 0, current_frame};
+    int status = (push_variable(&frame, root, FUNCTION_ALL_ARGS, rest) == NULL)
+        ? -1 : 0;
+    char *save;
+    int num_args = 0;
+    for (char *arg = strtok_r(rest, " \t", &save);
+         arg != NULL && status == 0; arg = strtok_r(NULL, " \t", &save)){
+        char name[16];
+        snprintf(name, sizeof(name), "%d", ++num_args);
+        if (push_variable(&frame, root, name, arg) == NULL){
+            status = -1;
+        }
+    }
+    free(args);
+
+    Program *body = function->body;
+    if (status == 0){
+        body->refs++;
+        current_frame = &frame;
+        call_depth++;
+        reset_slots(body);
+        status = vm_exec(body, root);
+        // an outer call of the same body resolves its own again
+        reset_slots(body);
+        call_depth--;
+        current_frame = frame.caller;
+        release_program(body);
+    }
+    pop_frame(&frame, root);
+    return status;
+}
+
+
+static int run_stmt(Program *prog, Stmt *stmt, Variable **root){
+    if (stmt->kind == STMT_RAW){
+        return run_line(stmt->text, root);
+    }
+
+    METRIC_ADD(*metrics, lines_parsed, 1);
+    char *expanded = expand(prog, &stmt->expansion, root);
+    if (expanded == (char *) -1){
+        return -1;
+    }
+    if (expanded == NULL){
+        METRIC_ADD(*metrics, parse_errors, 1);
+        return 1;
+    }
+
+    int status;
+    switch (stmt->kind){
+    case STMT_ASSIGN:
+        status = slot_assign(prog, stmt->slot, expanded, root);
+        free(expanded);
+        return status;
+    case STMT_LOCAL:
+        status = run_local(expanded, root);
+        reset_slots(prog);
+        free(expanded);
+        return status;
+    case STMT_RETURN:
+        status = run_return(trim(expanded));
+        free(expanded);
+        return status;
+    default:
+        break;
+    }
+
+    Function *function = vm_find_function(expanded);
+    if (function != NULL){
+        status = vm_call(function, expanded, root);
+        free(expanded);
+        return status;
+    }
+
+    int errors_before = errors_printed;
+    Command *commands = parse_expanded_line(expanded, root);
+    free(expanded);
+    if (commands == (Command *) -1 || errors_printed != errors_before){
+        METRIC_ADD(*metrics, parse_errors, 1);
+    }
+    return run_parsed_line(commands);
+}
+
+
+static void free_words(LoopState *state){
+    for (size_t i = 0; i < state->num_words; i++){
+        free(state->words[i]);
+    }
+    free(state->words);
+    state->words = NULL;
+    state->num_words = 0;
+    state->next = 0;
+}
+
+
+// Expands a loop's word list, splitting on whitespace and globbing
+static int begin_loop(Program *prog, Loop *loop, LoopState *state,
+                      Variable **root){
+    free_words(state);
+    char *expanded = expand(prog, &loop->words, root);
+    if (expanded == NULL || expanded == (char *) -1){
+        return (expanded == NULL) ? 0 : -1;
+    }
+
+    DirCache dir_cache = {NULL, 0};
+    char *save;
+    int error = 0;
+    for (char *word = strtok_r(expanded, " \t\n", &save); word != NULL;
+         word = strtok_r(NULL, " \t\n", &save)){
+        char **matches = NULL;
+        int num_matches = glob_has_magic(word)
+            ? glob_expand(word, &dir_cache, &matches) : 0;
+        if (num_matches == 0){
+            matches = malloc(sizeof(char *));
+            if (matches != NULL && (matches[0] = strdup(word)) != NULL){
+                num_matches = 1;
+            }
+            else {
+                free(matches);
+                num_matches = -1;
+            }
+        }
+        char **grown = (num_matches < 0) ? NULL : realloc(state->words,
+            (state->num_words + num_matches) * sizeof(char *));
+        if (grown == NULL){
+            for (int i = 0; i < num_matches; i++) free(matches[i]);
+            free(matches);
+            error = -1;
+            break;
+        }
+        state->words = grown;
+        memcpy(state->words + state->num_words, matches,
+               num_matches * sizeof(char *));
+        state->num_words += num_matches;
+        free(matches);
+    }
+
+    dir_cache_free(&dir_cache);
+    free(expanded);
+    return error;
+}
+
+
+static int vm_exec(Program *prog, Variable **root){
+    LoopState *states = calloc(prog->num_loops + 1, sizeof(LoopState));
+    if (states == NULL){
+        perror("vm");
+        return -1;
+    }
+
+    int status = 0;
+    uint32_t pc = 0;
+    while (pc < prog->num_code && status >= 0){
+        Instr instr = prog->code[pc++];
+        LoopState *state;
+        Loop *loop;
+
+        switch (instr.op){
+        case OP_RUN:
+            status = run_stmt(prog, &prog->stmts[instr.arg], root);
+            // assignments and calls set $? too, not just commands
+            if (status >= 0){
+                last_status = status;
+            }
+            break;
+        case OP_JUMP:
+            pc = instr.arg;
+            break;
+        case OP_JUMP_FALSE:
+            if (status != 0) pc = instr.arg;
+            break;
+        case OP_JUMP_TRUE:
+            if (status == 0) pc = instr.arg;
+            break;
+        case OP_CLEAR:
+            status = 0;
+            break;
+        case OP_FOR_BEGIN:
+            loop = &prog->loops[instr.arg];
+            status = begin_loop(prog, loop, &states[instr.arg], root);
+            break;
+        case OP_FOR_NEXT:
+            loop = &prog->loops[instr.arg];
+            state = &states[instr.arg];
+            if (state->next < state->num_words){
+                if (slot_assign(prog, loop->slot, state->words[state->next++],
+                                root) < 0){
+                    status = -1;
+                }
+            }
+            else {
+                free_words(state);
+                pc = loop->exit_pc;
+            }
+            break;
+        case OP_DEFINE:
+            status = define_function(&prog->defs[instr.arg]);
+            break;
+        case OP_RETURN:
+            // a bare return keeps the status of the last command
+            if (prog->stmts[instr.arg].text[0] != '\0'){
+                status = run_stmt(prog, &prog->stmts[instr.arg], root);
+            }
+            pc = prog->num_code;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < prog->num_loops; i++){
+        free_words(&states[i]);
+    }
+    free(states);
+    return status;
+}
+
+
+// Compiles the block opened by first_line into prog, reading the rest
+// of it from next_line. Returns 0, 1 if it does not compile or -1.
+static int compile_block(Program *prog, char *first_line,
+                         LineSource next_line, void *ctx){
+    Compiler *c = malloc(sizeof(Compiler));
+    if (c == NULL){
+        perror("vm");
+        return -1;
+    }
+    c->prog = prog;
+    c->next_line = next_line;
+    c->ctx = ctx;
+    c->pending = NULL;
+    c->in_function = 0;
+    strncpy(c->buf, first_line, MAX_SINGLE_LINE - 1);
+    c->buf[MAX_SINGLE_LINE - 1] = '\0';
+    c->buf[strcspn(c->buf, "#\n")] = '\0';
+    c->pos = c->buf;
+
+    // the block, then whatever follows it on its last line
+    int error = compile_statement(c, next_piece(c, false));
+    char *piece;
+    while (error == 0 && (piece = next_piece(c, false)) != NULL){
+        error = compile_statement(c, piece);
+    }
+    free(c);
+    return error;
+}
+
+
+int vm_run_block(char *first_line, LineSource next_line, void *ctx,
+                 Variable **root){
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL){
+        perror("vm_run_block");
+        return -1;
+    }
+    int error = compile_block(prog, first_line, next_line, ctx);
+
+    prog->refs = 1;
+    int status = (error < 0) ? 1 : vm_exec(prog, root);
+    release_program(prog);
+    return status;
+}
+
+
+int vm_read_block(char *first_line, LineSource next_line, void *ctx){
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL){
+        perror("vm_read_block");
+        return -1;
+    }
+    int error = compile_block(prog, first_line, next_line, ctx);
+    prog->refs = 1;
+    release_program(prog);
+    return error;
+}
@@ -0,0 +1,338 @@
+#include "cscshell.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+/*
+** `watch [-d MS] [-n RUNS] [-i PATH]... PIPELINE` runs the pipeline,
+** then runs it again every time its `<` input, a memo input or one of
+** the declared paths changes, instead of polling them with sleep.
+**
+** Files are watched through their parent directory, so an editor that
+** replaces a file by renaming over it, or a file that does not exist
+** yet, is still seen; a directory counts as changed when anything in
+** it does. Changes arriving within MS of each other (WATCH_DEBOUNCE_MS
+** by default) are one change. Runs stop after RUNS runs, if given, or
+** at SIGINT, which leaves the shell running.
+**
+** A pipeline that writes into what it watches re-runs itself forever.
+*/
+
+struct WatchSpec {
+    char *pipeline;         // the line after the prefix, parsed for each run
+    char **paths;
+    int debounce_ms;
+    int max_runs;
+    Variable **variables;
+};
+
+// One watched path: a directory (name NULL) or a file in one
+typedef struct WatchedPath {
+    int wd;
+    char *name;
+} WatchedPath;
+
+static volatile sig_atomic_t interrupted = 0;
+
+
+static void stop_watching(int sig){
+    interrupted = 1;
+}
+
+
+void watch_free(WatchSpec *spec){
+    if (spec == NULL){
+        return;
+    }
+    for (int i = 0; spec->paths[i] != NULL; i++){
+        free(spec->paths[i]);
+    }
+    free(spec->paths);
+    free(spec->pipeline);
+    free(spec);
+}
+
+
+// Reads the next word of rest into a heap string
+static char *take_word(char **rest){
+    *rest += strspn(*rest, " \t");
+    size_t len = strcspn(*rest, " \t");
+    if (len == 0){
+        return NULL;
+    }
+    char *word = strndup(*rest, len);
+    *rest += len;
+    return word;
+}
+
+
+// True if rest starts with flag as a word of its own
+static bool is_flag(const char *rest, const char *flag){
+    size_t flag_len = strlen(flag);
+    return strncmp(rest, flag, flag_len) == 0 &&
+           (rest[flag_len] == '\0' || isspace((unsigned char) rest[flag_len]));
+}
+
+
+char *watch_parse_prefix(char *line, Variable **variables, WatchSpec **spec){
+    *spec = NULL;
+    if (!is_flag(line, WATCH)){
+        return NULL;
+    }
+
+    // at most one path per remaining word, plus the NULL terminator
+    size_t max_paths = 1;
+    for (char *c = line; *c != '\0'; c++){
+        if (isspace((unsigned char) *c)) max_paths++;
+    }
+    WatchSpec *parsed = calloc(1, sizeof(WatchSpec));
+    char **paths = calloc(max_paths, sizeof(char *));
+    if (parsed == NULL || paths == NULL){
+        perror("watch_parse_prefix");
+        free(parsed);
+        free(paths);
+        return (char *) -1;
+    }
+    parsed->paths = paths;
+    parsed->debounce_ms = WATCH_DEBOUNCE_MS;
+    parsed->variables = variables;
+
+    int num_paths = 0;
+    bool usage_error = false;
+    char *rest = line + strlen(WATCH);
+    while (true){
+        rest += strspn(rest, " \t");
+        char *word;
+        if (is_flag(rest, WATCH_INPUT_FLAG)){
+            rest += strlen(WATCH_INPUT_FLAG);
+            word = take_word(&rest);
+            if (word == NULL){
+                usage_error = true;
+                break;
+            }
+            paths[num_paths++] = word;
+        }
+        else if (is_flag(rest, WATCH_DEBOUNCE_FLAG) ||
+                 is_flag(rest, WATCH_RUNS_FLAG)){
+            bool debounce = is_flag(rest, WATCH_DEBOUNCE_FLAG);
+            int *value = debounce ? &parsed->debounce_ms : &parsed->max_runs;
+            rest += strlen(debounce ? WATCH_DEBOUNCE_FLAG : WATCH_RUNS_FLAG);
+            word = take_word(&rest);
+            char *end = NULL;
+            long number = (word != NULL) ? strtol(word, &end, 10) : -1;
+            if (word == NULL || *end != '\0' || number < 0 ||
+                number > INT32_MAX){
+                usage_error = true;
+                free(word);
+                break;
+            }
+            *value = (int) number;
+            free(word);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (usage_error || *rest == '\0' ||
+        (parsed->pipeline = strdup(rest)) == NULL){
+        bool failed = !usage_error && *rest != '\0';
+        if (failed){
+            perror("watch_parse_prefix");
+        }
+        else {
+            ERR_PRINT(ERR_WATCH_USAGE);
+        }
+        watch_free(parsed);
+        return failed ? (char *) -1 : rest + strlen(rest);
+    }
+
+    *spec = parsed;
+    return rest;
+}
+
+
+// Watches path, through its directory if it is not one itself
+static int add_path(int fd, const char *path, WatchedPath *watched,
+                    int *num_watched){
+    struct stat st;
+    char dir[MAX_PATH_STR];
+    const char *name = NULL;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)){
+        snprintf(dir, sizeof(dir), "%s", path);
+    }
+    else {
+        const char *slash = strrchr(path, '/');
+        if (slash == NULL){
+            strcpy(dir, ".");
+            name = path;
+        }
+        else {
+            snprintf(dir, sizeof(dir), "%.*s",
+                     (int) (slash == path ? 1 : slash - path), path);
+            name = slash + 1;
+        }
+    }
+
+    int wd = inotify_add_watch(fd, dir, WATCH_EVENTS);
+    if (wd < 0){
+        ERR_PRINT(ERR_WATCH_PATH, path);
+        return -1;
+    }
+    watched[*num_watched].wd = wd;
+    watched[*num_watched].name = (name != NULL) ? strdup(name) : NULL;
+    (*num_watched)++;
+    return 0;
+}
+
+
+// Drains the events waiting on fd; true if any of them is a change to a
+// watched path. Returns -1 on errors or SIGINT.
+static int read_changes(int fd, WatchedPath *watched, int num_watched){
+    char events[WATCH_EVENT_BUF]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(fd, events, sizeof(events));
+    if (len < 0){
+        if (errno != EINTR && errno != EAGAIN){
+            perror("watch");
+        }
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    bool changed = false;
+    for (char *pos = events; pos < events + len;
+         pos += sizeof(struct inotify_event) +
+                ((struct inotify_event *) pos)->len){
+        struct inotify_event *event = (struct inotify_event *) pos;
+        // queue overflow: something changed, we cannot say what
+        if (event->mask & IN_Q_OVERFLOW){
+            changed = true;
+        }
+        for (int i = 0; i < num_watched; i++){
+            if (watched[i].wd == event->wd &&
+                (watched[i].name == NULL ||
+                 (event->len > 0 && strcmp(watched[i].name, event->name) == 0))){
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+
+// Waits for a change, then until none has come for debounce_ms.
+// Returns -1 on errors or SIGINT.
+static int wait_for_change(int fd, WatchedPath *watched, int num_watched,
+                           int debounce_ms){
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    bool changed = false;
+    while (!interrupted){
+        int ready = poll(&pfd, 1, changed ? debounce_ms : -1);
+        if (ready < 0){
+            if (errno != EINTR){
+                perror("watch");
+            }
+            return -1;
+        }
+        if (ready == 0){
+            return 0;
+        }
+        int result = read_changes(fd, watched, num_watched);
+        if (result < 0){
+            return -1;
+        }
+        changed = changed || result;
+    }
+    return -1;
+}
+
+
+int *watch_execute_line(Command *head){
+    WatchSpec *spec = head->watch;
+    head->watch = NULL;
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0){
+        perror("watch");
+        watch_free(spec);
+        free_command(head);
+        return (int *) -1;
+    }
+
+    // the < input, memo inputs and declared paths
+    size_t max_watched = 1;
+    for (int i = 0; spec->paths[i] != NULL; i++) max_watched++;
+    for (int i = 0; head->memo_inputs && head->memo_inputs[i]; i++) max_watched++;
+    WatchedPath *watched = calloc(max_watched, sizeof(WatchedPath));
+    int num_watched = 0;
+    int error = (watched == NULL) ? -1 : 0;
+    if (error == 0 && head->redir_in_path != NULL){
+        error = add_path(fd, head->redir_in_path, watched, &num_watched);
+    }
+    for (int i = 0; error == 0 && spec->paths[i] != NULL; i++){
+        error = add_path(fd, spec->paths[i], watched, &num_watched);
+    }
+    for (int i = 0; error == 0 && head->memo_inputs && head->memo_inputs[i]; i++){
+        error = add_path(fd, head->memo_inputs[i], watched, &num_watched);
+    }
+    if (error == 0 && num_watched == 0){
+        ERR_PRINT(ERR_WATCH_NOTHING);
+        error = -1;
+    }
+
+    int *ret = NULL;
+    if (error < 0){
+        free_command(head);
+        ret = malloc(sizeof(int));
+        if (ret != NULL){
+            *ret = 1;
+        }
+    }
+    else {
+        // SIGINT ends the watch rather than the shell
+        struct sigaction action = {.sa_handler = stop_watching};
+        struct sigaction old_action;
+        interrupted = 0;
+        sigaction(SIGINT, &action, &old_action);
+
+        Command *commands = head;
+        for (int runs = 1; ; runs++){
+            free(ret);
+            ret = execute_line(commands);
+            if (ret == (int *) -1){
+                break;
+            }
+            fflush(stdout);
+            if ((spec->max_runs > 0 && runs >= spec->max_runs) || interrupted ||
+                wait_for_change(fd, watched, num_watched, spec->debounce_ms) < 0){
+                break;
+            }
+            // parsing cuts up the line it is given
+            char *pipeline = strdup(spec->pipeline);
+            if (pipeline == NULL){
+                perror("watch");
+                break;
+            }
+            commands = parse_expanded_line(pipeline, spec->variables);
+            free(pipeline);
+            if (commands == NULL || commands == (Command *) -1){
+                // the last status stands; a failed parse has said why
+                if (commands == (Command *) -1){
+                    free(ret);
+                    ret = (int *) -1;
+                }
+                break;
+            }
+        }
+        sigaction(SIGINT, &old_action, NULL);
+    }
+
+    for (int i = 0; i < num_watched; i++){
+        free(watched[i].name);
+    }
+    free(watched);
+    close(fd);
+    watch_free(spec);
+    return ret;
+}